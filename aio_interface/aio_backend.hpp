@@ -0,0 +1,31 @@
+#pragma once
+#include "libaio_int.hpp"
+
+// internal interface between the aio front end (libaio_int.cpp) and the
+// kernel interface actually used to run the requests
+namespace rocksxl
+{
+namespace aio_interface
+{
+  class AioBackend
+  {
+  public:
+    virtual ~AioBackend() {}
+    // hand the requests to the kernel, return how many were taken: the
+    // accepted ones and the ones failed with requestDone because the kernel
+    // refused them. the rest is retried. called by one thread at a time
+    virtual size_t submit(AioData **requests, size_t n) = 0;
+    // wait for completions and call requestDone for each, never returns
+    virtual void   reap() = 0;
+    // memory that requests will use as data buffers, called once before
+    // the first request
+    virtual void   registerBuffers(const std::vector<struct iovec> &) {}
+  };
+
+  AioBackend *newLibaioBackend(const AioConfig &config, int fd);
+  AioBackend *newUringBackend(const AioConfig &config, int fd);
+
+  // common completion path, res is the byte count or a negative errno
+  void requestDone(AioData *aioData, long res);
+}
+}
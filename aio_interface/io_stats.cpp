@@ -0,0 +1,229 @@
+#include "io_stats.hpp"
+#include "numa.hpp"
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <string>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  uint Histogram::bucket(uint64_t value)
+  {
+    if (value < 4)
+      return value;
+    uint log = 63 - __builtin_clzll(value);
+    return log * 4 + ((value >> (log - 2)) & 3);
+  }
+
+  uint64_t Histogram::bucketTop(uint bucket)
+  {
+    if (bucket < 4)
+      return bucket;
+    uint log = bucket / 4;
+    return (1ull << log) + ((bucket % 4 + 1) << (log - 2)) - 1;
+  }
+
+  void Histogram::clear()
+  {
+    for (auto &b : m_buckets)
+      b.store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+  }
+
+  void Histogram::merge(const Histogram &other)
+  {
+    for (uint i = 0; i < s_nBuckets; i++)
+      statAdd(m_buckets[i], other.m_buckets[i].load(std::memory_order_relaxed));
+    statAdd(m_count, other.count());
+    statAdd(m_sum, other.m_sum.load(std::memory_order_relaxed));
+    if (other.max() > max())
+      m_max.store(other.max(), std::memory_order_relaxed);
+  }
+
+  static void statSub(std::atomic<uint64_t> &counter, uint64_t value)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) - value,
+		  std::memory_order_relaxed);
+  }
+
+  void Histogram::subtract(const Histogram &earlier)
+  {
+    for (uint i = 0; i < s_nBuckets; i++)
+      statSub(m_buckets[i], earlier.m_buckets[i].load(std::memory_order_relaxed));
+    statSub(m_count, earlier.count());
+    statSub(m_sum, earlier.m_sum.load(std::memory_order_relaxed));
+  }
+
+  uint64_t Histogram::percentile(double p) const
+  {
+    uint64_t total = 0;
+    for (auto const &b : m_buckets)
+      total += b.load(std::memory_order_relaxed);
+    if (total == 0)
+      return 0;
+    uint64_t target = (uint64_t)(total * p / 100);
+    uint64_t seen = 0;
+    for (uint i = 0; i < s_nBuckets; i++) {
+      seen += m_buckets[i].load(std::memory_order_relaxed);
+      if (seen > target)
+	return std::min(bucketTop(i), max());
+    }
+    return max();
+  }
+
+  void IoStats::clear()
+  {
+    for (uint i = 0; i < AioData::opNumCodes; i++) {
+      latency[i].clear();
+      deviceLatency[i].clear();
+      callback[i].clear();
+      bytes[i].store(0, std::memory_order_relaxed);
+    }
+    depth.clear();
+    eagain.store(0, std::memory_order_relaxed);
+    admissionWaits.store(0, std::memory_order_relaxed);
+    discard.clear();
+    discardBytes.store(0, std::memory_order_relaxed);
+  }
+
+  void IoStats::merge(const IoStats &other)
+  {
+    for (uint i = 0; i < AioData::opNumCodes; i++) {
+      latency[i].merge(other.latency[i]);
+      deviceLatency[i].merge(other.deviceLatency[i]);
+      callback[i].merge(other.callback[i]);
+      statAdd(bytes[i], other.bytes[i].load(std::memory_order_relaxed));
+    }
+    depth.merge(other.depth);
+    statAdd(eagain, other.eagain.load(std::memory_order_relaxed));
+    statAdd(admissionWaits, other.admissionWaits.load(std::memory_order_relaxed));
+    discard.merge(other.discard);
+    statAdd(discardBytes, other.discardBytes.load(std::memory_order_relaxed));
+  }
+
+  void IoStats::subtract(const IoStats &earlier)
+  {
+    for (uint i = 0; i < AioData::opNumCodes; i++) {
+      latency[i].subtract(earlier.latency[i]);
+      deviceLatency[i].subtract(earlier.deviceLatency[i]);
+      callback[i].subtract(earlier.callback[i]);
+      statSub(bytes[i], earlier.bytes[i].load(std::memory_order_relaxed));
+    }
+    depth.subtract(earlier.depth);
+    statSub(eagain, earlier.eagain.load(std::memory_order_relaxed));
+    statSub(admissionWaits, earlier.admissionWaits.load(std::memory_order_relaxed));
+    discard.subtract(earlier.discard);
+    statSub(discardBytes, earlier.discardBytes.load(std::memory_order_relaxed));
+  }
+
+  static void printHistogram(FILE *out, const char *name, const Histogram &h, double scale)
+  {
+    if (!h.count())
+      return;
+    fprintf(out, "  %-16s n %lu avg %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+	    name, h.count(), h.average() / scale,
+	    h.percentile(50) / scale, h.percentile(99) / scale,
+	    h.percentile(99.9) / scale, h.max() / scale);
+  }
+
+  void IoStats::print(FILE *out, const char *title) const
+  {
+    static const char *opNames[AioData::opNumCodes] = {"read", "write", "sync"};
+    fprintf(out, "%lu : %s (latency in usec)\n", time(0), title);
+    for (uint i = 0; i < AioData::opNumCodes; i++) {
+      std::string name(opNames[i]);
+      printHistogram(out, (name + " latency").c_str(), latency[i], 1000);
+      printHistogram(out, (name + " device").c_str(), deviceLatency[i], 1000);
+      printHistogram(out, (name + " callback").c_str(), callback[i], 1000);
+      if (bytes[i].load(std::memory_order_relaxed))
+	fprintf(out, "  %-16s %lu\n", (name + " bytes").c_str(),
+		bytes[i].load(std::memory_order_relaxed));
+    }
+    printHistogram(out, "queue depth", depth, 1);
+    printHistogram(out, "discard", discard, 1000);
+    if (discardBytes.load(std::memory_order_relaxed))
+      fprintf(out, "  %-16s %lu\n", "discard bytes",
+	      discardBytes.load(std::memory_order_relaxed));
+    fprintf(out, "  eagain %lu admission waits %lu\n",
+	    eagain.load(std::memory_order_relaxed),
+	    admissionWaits.load(std::memory_order_relaxed));
+  }
+
+  // every thread stats are registered once and kept after the thread exits
+  struct RegisteredStats
+  {
+    IoStats *stats;
+    int      node;   // the thread is pinned to, -1 - none
+  };
+  static std::mutex                    s_registryMutex;
+  static std::vector<RegisteredStats>  s_registry;
+  static thread_local int              s_localIndex = -1;
+
+  IoStats &IoStats::local()
+  {
+    static thread_local IoStats *stats;
+    if (!stats) {
+      stats = new IoStats;
+      std::lock_guard<std::mutex> lk(s_registryMutex);
+      s_localIndex = s_registry.size();
+      s_registry.push_back(RegisteredStats{stats, -1});
+    }
+    return *stats;
+  }
+
+  void IoStats::setLocalNode(int node)
+  {
+    local();
+    std::lock_guard<std::mutex> lk(s_registryMutex);
+    s_registry[s_localIndex].node = node;
+  }
+
+  void IoStats::snapshot(IoStats &to)
+  {
+    to.clear();
+    std::lock_guard<std::mutex> lk(s_registryMutex);
+    for (auto const &r : s_registry)
+      to.merge(*r.stats);
+  }
+
+  void IoStats::nodeSnapshot(uint node, IoStats &to)
+  {
+    to.clear();
+    std::lock_guard<std::mutex> lk(s_registryMutex);
+    for (auto const &r : s_registry) {
+      if (r.node == (int)node)
+	to.merge(*r.stats);
+    }
+  }
+
+  static void dumpThread(uint periodSeconds)
+  {
+    IoStats stats;
+    while (1) {
+      sleep(periodSeconds);
+      IoStats::snapshot(stats);
+      stats.print(stdout);
+      if (Numa::nNodes() > 1) {
+	for (uint node = 0; node < Numa::nNodes(); node++) {
+	  char title[32];
+	  snprintf(title, sizeof(title), "node %u io stats", node);
+	  IoStats::nodeSnapshot(node, stats);
+	  stats.print(stdout, title);
+	}
+      }
+    }
+  }
+
+  void IoStats::startDump(uint periodSeconds)
+  {
+    new std::thread(dumpThread, periodSeconds);
+  }
+}
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include "libaio_int.hpp"
+
+// low overhead I/O telemetry. every thread updates its own counters (no
+// shared cache lines on the hot path), snapshot() sums all the threads
+namespace rocksxl
+{
+namespace aio_interface
+{
+  inline uint64_t nowNs()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // counters have a single writer, relaxed updates keep concurrent
+  // snapshots well defined without the cost of an atomic add
+  inline void statAdd(std::atomic<uint64_t> &counter, uint64_t value)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+		  std::memory_order_relaxed);
+  }
+
+  // log2 histogram with 4 sub buckets per power of 2 (~20% precision)
+  class Histogram
+  {
+  public:
+    static const uint s_nBuckets = 64 * 4;
+    Histogram() {clear();}
+    void add(uint64_t value) {
+      statAdd(m_buckets[bucket(value)], 1);
+      statAdd(m_count, 1);
+      statAdd(m_sum, value);
+      if (value > m_max.load(std::memory_order_relaxed))
+	m_max.store(value, std::memory_order_relaxed);
+    }
+    void     merge(const Histogram &other);
+    // removes an earlier snapshot of the same histogram, max is kept
+    void     subtract(const Histogram &earlier);
+    void     clear();
+    uint64_t count() const {return m_count.load(std::memory_order_relaxed);}
+    uint64_t max() const {return m_max.load(std::memory_order_relaxed);}
+    uint64_t average() const {return count() ? m_sum.load(std::memory_order_relaxed) / count() : 0;}
+    // p in [0,100]
+    uint64_t percentile(double p) const;
+  private:
+    static uint bucket(uint64_t value);
+    static uint64_t bucketTop(uint bucket);
+  private:
+    std::atomic<uint64_t> m_buckets[s_nBuckets];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+  };
+
+  struct IoStats
+  {
+    // per operation type (AioData::OpCode)
+    Histogram             latency[AioData::opNumCodes];       // Read/Write call to completion, ns
+    Histogram             deviceLatency[AioData::opNumCodes]; // kernel submit to completion, ns
+    Histogram             callback[AioData::opNumCodes];      // completion callback run time, ns
+    std::atomic<uint64_t> bytes[AioData::opNumCodes];
+    Histogram             depth;          // requests of the queue in flight at admission
+    std::atomic<uint64_t> eagain;         // requests the kernel refused (EAGAIN)
+    std::atomic<uint64_t> admissionWaits; // requests that waited for a class credit
+    Histogram             discard;        // Discard call time, ns
+    std::atomic<uint64_t> discardBytes;
+
+    IoStats() {clear();}
+    void clear();
+    void merge(const IoStats &other);
+    // the counters since an earlier snapshot
+    void subtract(const IoStats &earlier);
+    void print(FILE *out, const char *title = "io stats") const;
+
+    // the calling thread counters
+    static IoStats &local();
+    // the calling thread counters belong to node from now, -1 - to none.
+    // set when the thread is pinned (Numa::pinThread)
+    static void setLocalNode(int node);
+    // sum of the counters of all the threads
+    static void snapshot(IoStats &to);
+    // sum of the counters of the threads pinned to node, the completion
+    // threads of the node queues among them
+    static void nodeSnapshot(uint node, IoStats &to);
+    // print the snapshot every periodSeconds from a background thread,
+    // and one per node when there are several
+    static void startDump(uint periodSeconds);
+  };
+}
+}
@@ -1,7 +1,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <libaio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,7 +17,14 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <thread>
-#include "libaio_int.hpp"
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include "aio_backend.hpp"
+#include "io_stats.hpp"
+#include "numa.hpp"
 #include <atomic>
 
 namespace rocksxl
@@ -21,116 +32,474 @@ namespace rocksxl
 namespace aio_interface
 {
 #define MAX_OPEN_REQUEST_NUM 4096 
-io_context_t ctx;
+#define MAX_SUBMIT_BATCH 256
 
-std::atomic<uint> n_requests; 
+static bool s_collectStats;
 
+struct IoQueue;
+static IoQueue *releaseCredit(AioData *aioData);
+static void drainPending(IoQueue *queue);
 
-static void requestDone(struct iocb *iocb, long size, long status)
+void requestDone(AioData *aioData, long res)
 {
-  if (size <= 0 || status != 0)  {
-    printf("failed to run cmd : %s  device %d lba %lld size=%ld return code  size %ld status %ld\n",
-	   iocb->aio_lio_opcode == IO_CMD_PREAD ? "Read" : "Write",
-	   iocb->aio_fildes,
-	   iocb->u.c.offset,
-	   iocb->u.c.nbytes,
-	   size,
-	   status);
-	   
-    assert(size >0 && status == 0);
+  // a read or write is done only when all of it is, a short one is an error
+  if (res < 0 || (aioData->opcode != AioData::opSync && (size_t)res != aioData->size))  {
+    static const char *opNames[AioData::opNumCodes] = {"Read", "Write", "Sync"};
+    printf("failed to run cmd : %s lba %lu size=%lu return code %ld\n",
+	   opNames[aioData->opcode],
+	   aioData->aioLba,
+	   aioData->size,
+	   res);
+    aioData->status = res < 0 ? res : -EIO;
+  } else {
+    aioData->status = 0;
   }
-  n_requests --;
-  auto aioData = (AioData *)iocb->data;
-  aioData->callbackFunc(aioData);
-  
+  // the callback may free the request
+  IoQueue *queue = releaseCredit(aioData);
+  if (s_collectStats) {
+    auto &stats = IoStats::local();
+    auto opcode = aioData->opcode;
+    uint64_t now = nowNs();
+    stats.latency[opcode].add(now - aioData->submitTime);
+    stats.deviceLatency[opcode].add(now - aioData->kernelTime);
+    statAdd(stats.bytes[opcode], aioData->size);
+    aioData->callbackFunc(aioData);
+    stats.callback[opcode].add(nowNs() - now);
+  } else {
+    aioData->callbackFunc(aioData);
+  }
+  drainPending(queue);
 }
     
   
+class LibaioBackend : public AioBackend
+{
+public:
+  LibaioBackend(const AioConfig &config, int fd) :
+    m_fd(fd), m_ctx(0), m_reapBatch(config.reapBatch), m_noAioSync(false)
+  {
+    if(io_setup(config.queueDepth, &m_ctx)!=0){ //init
+      printf("io_setup error\n");
+      assert(0);
+    }
+  }
+  size_t submit(AioData **requests, size_t n);
+  void   reap();
+private:
+  void   prepSync(struct iocb *iocb_p);
+private:
+  int               m_fd;
+  io_context_t      m_ctx;
+  uint              m_reapBatch;
+  std::atomic<bool> m_noAioSync; // the kernel has no aio fsync (before 4.18)
+};
 
+// without aio fsync a sync is an empty read, it completes on the reaper
+// thread that runs the fdatasync. a blocking sync inline in submit would
+// run the callbacks on the submitting thread, which may hold the locks
+// the callbacks take
+void LibaioBackend::prepSync(struct iocb *iocb_p)
+{
+  if (m_noAioSync) {
+    io_prep_pread(iocb_p, m_fd, 0, 0, 0);
+  } else {
+    io_prep_fdsync(iocb_p, m_fd);
+  }
+}
+
+size_t LibaioBackend::submit(AioData **requests, size_t n)
+{
+  static_assert(sizeof(struct iocb) <= sizeof(AioData::backendData),
+		"iocb must fit in the request");
+  assert(n <= MAX_SUBMIT_BATCH);
+  struct iocb *iocbs[MAX_SUBMIT_BATCH];
+  for (size_t i = 0; i < n; i++) {
+    AioData *aioData = requests[i];
+    struct iocb *iocb_p = (struct iocb *)aioData->backendData;
+    if (aioData->opcode == AioData::opSync) {
+      prepSync(iocb_p);
+    } else if (aioData->iovcnt) {
+      if (aioData->opcode == AioData::opRead) {
+	io_prep_preadv(iocb_p, m_fd, aioData->iov, aioData->iovcnt,
+		       aioData->aioLba);
+      } else {
+	io_prep_pwritev(iocb_p, m_fd, aioData->iov, aioData->iovcnt,
+			aioData->aioLba);
+      }
+    } else if (aioData->opcode == AioData::opRead) {
+      io_prep_pread(iocb_p, m_fd, aioData->data, aioData->size, aioData->aioLba);
+    } else {
+      io_prep_pwrite(iocb_p, m_fd, aioData->data, aioData->size, aioData->aioLba);
+    }
+    iocb_p->data = aioData;
+    iocbs[i] = iocb_p;
+  }
+  size_t done = 0;
+  while (done < n) {
+    int ret = io_submit(m_ctx, n - done, iocbs + done);
+    if (ret == -EAGAIN)  {
+      // the rest is retried by the front end
+      break;
+    }
+    if (ret == -EINVAL && iocbs[done]->aio_lio_opcode == IO_CMD_FDSYNC) {
+      m_noAioSync = true;
+      prepSync(iocbs[done]);
+      iocbs[done]->data = requests[done];
+      continue;
+    }
+    if (ret < 0) {
+      // the kernel will not take them, they fail instead of being retried
+      for (size_t i = done; i < n; i++)
+	requestDone(requests[i], ret);
+      return n;
+    }
+    done += ret;
+  }
+  return done;
+}
   
-  
-static void *aioThread()
+void LibaioBackend::reap()
 {
-  struct io_event e[20];
+  std::vector<struct io_event> e(m_reapBatch);
   while(1){
-    bzero(e, sizeof(e));
-    int count = io_getevents(ctx, 1, 20, e, 0);
+    int count = io_getevents(m_ctx, 1, m_reapBatch, e.data(), 0);
     if (count > 0) {
       for (int i = 0; i < count; i++) {
-	requestDone(e[i].obj, e[i].res, e[i].res2);
-	free(e[i].obj);
+	auto aioData = (AioData *)e[i].obj->data;
+	long res = (long)e[i].res;
+	if (aioData->opcode == AioData::opSync && e[i].obj->aio_lio_opcode == IO_CMD_PREAD) {
+	  res = fdatasync(m_fd) == 0 ? 0 : -errno; // see prepSync
+	}
+	requestDone(aioData, res);
       }
     }
   }
-  return 0;
+}
+
+AioBackend *newLibaioBackend(const AioConfig &config, int fd)
+{
+  return new LibaioBackend(config, fd);
+}
+
+// every queue has its own kernel context and its own completion thread
+struct IoQueue
+{
+  IoQueue() : backend(0), node(-1), submitActive(false), inFlight(0) {
+    bzero(classInFlight, sizeof(classInFlight));
+    bzero(classDepth, sizeof(classDepth));
+  }
+  AioBackend             *backend;
+  int                     node;    // of its reaper, -1 for any
+  // requests waiting to be handed to the kernel. whoever finds no active
+  // submitter drains the queue, so under load requests of many threads are
+  // coalesced into a single submit call
+  std::mutex              submitMutex;
+  std::vector<AioData *>  pendingRequests;
+  bool                    submitActive;
+  // admission control, a request is pending only once it holds a credit of
+  // its class. the others wait in their class queue until a completion
+  // returns a credit
+  uint                    inFlight;
+  uint                    classInFlight[ioNumClasses];
+  uint                    classDepth[ioNumClasses];
+  std::deque<AioData *>   waiting[ioNumClasses];
+};
+// the queues of device d are [d * s_queuesPerDevice, (d+1) * s_queuesPerDevice),
+// those of node n of them [n * s_queuesPerNode, (n+1) * s_queuesPerNode)
+static std::vector<IoQueue *> s_queues;
+static uint                   s_queuesPerDevice;
+static uint                   s_queuesPerNode;
+static std::vector<int>       s_deviceFds;
+static std::vector<bool>      s_deviceIsBlock;
+// buffers are registered only before the first request
+static std::atomic<bool>      s_ioStarted;
+
+static void aioThread(AioBackend *backend, int node)
+{
+  Numa::pinThread(node);
+  backend->reap();
 }
   
-static int fd;
 #ifdef LOCAL
 const char *driveName = "/home/hilik/test_disk/tmpfile";
 #else
 const char *driveName = "/home/hiliky/test_disk/tmpfile";
 #endif
-void aioInit()
+void aioInit(const AioConfig &config)
 {
-  if(io_setup(MAX_OPEN_REQUEST_NUM, &ctx)!=0){ //init
-    printf("io_setup error\n");
-    assert(0);
+  std::vector<std::string> drives = config.drives;
+  if (drives.empty()) {
+    drives.push_back(config.driveName ? config.driveName : driveName);
   }
-  
-  fd =  open(driveName, O_RDWR| O_NONBLOCK| O_CREAT | O_LARGEFILE   ,
-	     S_IRWXU);
-  assert(fd > 0);
-  new std::thread(aioThread);
+  uint credits = 0;
+  for (uint c = 0; c < ioNumClasses; c++) {
+    assert(config.classDepth[c] > 0);
+    credits += config.classDepth[c];
+  }
+  // the kernel ring must hold every request that got a credit
+  assert(credits <= config.queueDepth);
+  if (config.numaAware) {
+    Numa::enable();
+  }
+  const uint nNodes = Numa::nNodes();
+  uint nQueues = config.nQueues ? config.nQueues :
+    std::max<uint>(std::thread::hardware_concurrency() / nNodes, 1);
+  assert(nQueues > 0);
+  s_queuesPerNode = nQueues;
+  s_queuesPerDevice = nNodes * nQueues;
+  s_collectStats = config.collectStats;
+  if (s_collectStats && config.statsDumpSeconds) {
+    IoStats::startDump(config.statsDumpSeconds);
+  }
+  for (auto const &drive : drives) {
+    int fd =  open(drive.c_str(),
+		   O_RDWR| O_NONBLOCK| O_CREAT | O_LARGEFILE |
+		   (config.directIo ? O_DIRECT : 0),
+		   S_IRWXU);
+    assert(fd > 0);
+    s_deviceFds.push_back(fd);
+    struct stat st;
+    s_deviceIsBlock.push_back(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode));
+    for (uint i = 0; i < s_queuesPerDevice; i++) {
+      // the kernel places the rings of a context on the node of the thread
+      // creating it
+      const int node = config.numaAware ? i / nQueues : -1;
+      Numa::pinThread(node);
+      auto queue = new IoQueue;
+      queue->node = node;
+      for (uint c = 0; c < ioNumClasses; c++) {
+	queue->classDepth[c] = config.classDepth[c];
+      }
+      if (config.backend == AioConfig::ioUring) {
+	queue->backend = newUringBackend(config, fd);
+      }
+      if (!queue->backend) {
+	queue->backend = newLibaioBackend(config, fd);
+      }
+      s_queues.push_back(queue);
+      new std::thread(aioThread, queue->backend, node);
+    }
+  }
+  Numa::pinThread(-1);
 }
-  
 
-static bool submit(struct iocb *iocb_p)
+uint numDevices()
 {
-  static size_t count;
-  uint n_req = ++n_requests;
-  if (++count % 10000 == 0) {
-    printf("%lu : %u %lu \n", time(0), n_req, count);
-  }
-  if (n_req >=  MAX_OPEN_REQUEST_NUM ) {
-    int safeCount = 0;
-    while (n_requests >= MAX_OPEN_REQUEST_NUM ) {
-      // printf("sleeping queue is to long\n");
-      safeCount++;
-      assert (safeCount < 1000000);
-      usleep(1);
+  return s_deviceFds.size();
+}
+
+void registerBuffers(const std::vector<struct iovec> &nodeBuffers)
+{
+  static bool registered;
+  assert(!registered && !s_ioStarted);
+  registered = true;
+  for (auto queue : s_queues) {
+    // a request routed to a queue of another node just does without
+    if (queue->node >= 0 && (size_t)queue->node < nodeBuffers.size()) {
+      queue->backend->registerBuffers(std::vector<struct iovec>(1, nodeBuffers[queue->node]));
+    } else {
+      queue->backend->registerBuffers(nodeBuffers);
     }
   }
-  
-  int ret = io_submit(ctx, 1, &iocb_p);
-  while (ret ==  EAGAIN)  {
-    usleep(1);
-    ret = io_submit(ctx, 1, &iocb_p);            
+}
+
+// caller chosen queue of the request device, otherwise the one of the
+// submitting core among the queues of its node
+static uint selectQueue(const AioData *aioData)
+{
+  assert(aioData->device < s_deviceFds.size());
+  uint index;
+  if (aioData->affinity >= 0) {
+    index = aioData->affinity % s_queuesPerDevice;
+  } else if (s_queuesPerDevice > s_queuesPerNode) {
+    index = Numa::currentNode() * s_queuesPerNode + sched_getcpu() % s_queuesPerNode;
+  } else {
+    index = sched_getcpu() % s_queuesPerDevice;
   }
-  assert(ret >=0);
+  return aioData->device * s_queuesPerDevice + index;
+}
 
+// lock is held
+static void admit(IoQueue *queue, AioData *aioData)
+{
+  auto ioClass = aioData->ioClass;
+  assert(ioClass < ioNumClasses);
+  if (s_collectStats) {
+    auto &stats = IoStats::local();
+    aioData->submitTime = nowNs();
+    stats.depth.add(queue->inFlight);
+  }
+  if (queue->classInFlight[ioClass] < queue->classDepth[ioClass] &&
+      queue->waiting[ioClass].empty()) {
+    queue->classInFlight[ioClass]++;
+    queue->inFlight++;
+    queue->pendingRequests.push_back(aioData);
+  } else {
+    queue->waiting[ioClass].push_back(aioData);
+    if (s_collectStats)
+      statAdd(IoStats::local().admissionWaits, 1);
+  }
 }
 
+static IoQueue *releaseCredit(AioData *aioData)
+{
+  IoQueue *queue = s_queues[aioData->queue];
+  auto ioClass = aioData->ioClass;
+  std::lock_guard<std::mutex> lk(queue->submitMutex);
+  queue->inFlight--;
+  auto &waiting = queue->waiting[ioClass];
+  if (waiting.empty()) {
+    queue->classInFlight[ioClass]--;
+  } else {
+    // hand the credit to the next waiter of the class
+    queue->pendingRequests.push_back(waiting.front());
+    waiting.pop_front();
+    queue->inFlight++;
+  }
+  return queue;
+}
+
+static void drainPending(IoQueue *queue)
+{
+  std::vector<AioData *> toSubmit;
+  {
+    std::lock_guard<std::mutex> lk(queue->submitMutex);
+    if (queue->submitActive || queue->pendingRequests.empty()) {
+      // the active submitter will pick the requests
+      return;
+    }
+    queue->submitActive = true;
+  }
+  while (1) {
+    {
+      std::lock_guard<std::mutex> lk(queue->submitMutex);
+      // requests the kernel did not accept go back to the head of the queue
+      queue->pendingRequests.insert(queue->pendingRequests.begin(),
+				    toSubmit.begin(), toSubmit.end());
+      toSubmit.clear();
+      if (queue->pendingRequests.empty()) {
+	queue->submitActive = false;
+	return;
+      }
+      toSubmit.swap(queue->pendingRequests);
+    }
+    size_t done = 0;
+    while (done < toSubmit.size()) {
+      size_t nr = std::min<size_t>(toSubmit.size() - done, MAX_SUBMIT_BATCH);
+      if (s_collectStats) {
+	uint64_t now = nowNs();
+	for (size_t i = done; i < done + nr; i++)
+	  toSubmit[i]->kernelTime = now;
+      }
+      size_t accepted = queue->backend->submit(toSubmit.data() + done, nr);
+      done += accepted;
+      if (accepted < nr) {
+	if (s_collectStats)
+	  statAdd(IoStats::local().eagain, nr - accepted);
+	break;
+      }
+    }
+    toSubmit.erase(toSubmit.begin(), toSubmit.begin() + done);
+    if (!toSubmit.empty()) {
+      // kernel is out of resources (EAGAIN), completions of this queue
+      // will resubmit. if nothing is in flight there is no one to wait for
+      std::lock_guard<std::mutex> lk(queue->submitMutex);
+      if (queue->inFlight > toSubmit.size() + queue->pendingRequests.size()) {
+	queue->pendingRequests.insert(queue->pendingRequests.begin(),
+				      toSubmit.begin(), toSubmit.end());
+	queue->submitActive = false;
+	return;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static bool submit(IoQueue *queue, AioData **requests, size_t n)
+{
+  if (!s_ioStarted.load(std::memory_order_relaxed))
+    s_ioStarted.store(true, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lk(queue->submitMutex);
+    for (size_t i = 0; i < n; i++) {
+      admit(queue, requests[i]);
+    }
+  }
+  drainPending(queue);
+  return true;
+}
 
 bool Read(AioData *aioData)
 {  
-  struct iocb *iocb_p = (struct iocb *)malloc(sizeof(struct iocb));
-  bzero(iocb_p, sizeof(*iocb_p));
-  io_prep_pread(iocb_p, fd, aioData->data, aioData->size, aioData->aioLba);
-  iocb_p->data = aioData;
-  return submit(iocb_p);
+  aioData->opcode = AioData::opRead;
+  aioData->queue = selectQueue(aioData);
+  return submit(s_queues[aioData->queue], &aioData, 1);
 }
 
 	    
 bool Write(AioData *aioData)
 {
-  struct iocb *iocb_p = (struct iocb *)malloc(sizeof(struct iocb));
-  io_prep_pwrite(iocb_p, fd, aioData->data, aioData->size, aioData->aioLba);
-  iocb_p->data = aioData;
-  
-  return submit(iocb_p);
+  aioData->opcode = AioData::opWrite;
+  aioData->queue = selectQueue(aioData);
+  return submit(s_queues[aioData->queue], &aioData, 1);
 }
 
+bool Sync(AioData *aioData)
+{
+  aioData->opcode = AioData::opSync;
+  aioData->size = 0;
+  aioData->queue = selectQueue(aioData);
+  return submit(s_queues[aioData->queue], &aioData, 1);
+}
+
+int Discard(uint device, size_t offset, size_t size)
+{
+  assert(device < s_deviceFds.size());
+  uint64_t start = s_collectStats ? nowNs() : 0;
+  int ret;
+  if (s_deviceIsBlock[device]) {
+    uint64_t range[2] = {offset, size};
+    ret = ioctl(s_deviceFds[device], BLKDISCARD, range);
+  } else {
+    ret = fallocate(s_deviceFds[device], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    offset, size);
+  }
+  if (ret != 0)
+    return errno == ENOTTY ? -EOPNOTSUPP : -errno;
+  if (s_collectStats) {
+    auto &stats = IoStats::local();
+    stats.discard.add(nowNs() - start);
+    statAdd(stats.discardBytes, size);
+  }
+  return 0;
+}
+
+bool AioBatch::submit()
+{
+  if (m_requests.empty())
+    return true;
+  for (auto aioData : m_requests) {
+    aioData->queue = selectQueue(aioData);
+  }
+  // keep the order of the requests within each queue
+  std::vector<AioData *> perQueue;
+  perQueue.reserve(m_requests.size());
+  bool ret = true;
+  while (!m_requests.empty()) {
+    uint queue = m_requests.front()->queue;
+    size_t kept = 0;
+    for (auto aioData : m_requests) {
+      if (aioData->queue == queue)
+	perQueue.push_back(aioData);
+      else
+	m_requests[kept++] = aioData;
+    }
+    m_requests.resize(kept);
+    ret = aio_interface::submit(s_queues[queue], perQueue.data(), perQueue.size()) && ret;
+    perQueue.clear();
+  }
+  return ret;
+}
 
 }
 }
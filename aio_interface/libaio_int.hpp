@@ -1,13 +1,34 @@
-
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <limits.h>
+#include <vector>
+#include <string>
+#include "object_pool.hpp"
 
 namespace rocksxl
 {
 namespace aio_interface
 {
+  // admission classes, each class has its own in flight credits so a burst
+  // of one class never queues the requests of another
+  enum IoClass : uint8_t {ioForeground, ioFlush, ioCompaction, ioNumClasses};
+
+  // buffers of a vectored request, the kernel takes no more
+  static const size_t s_maxIov = IOV_MAX;
+  struct IovArray
+  {
+    struct iovec v[s_maxIov];
+  };
+  typedef ObjectPool<IovArray, 4, 64> IovPool;
 
   struct AioData
   {
     typedef  void   (*cb)(AioData *) ;
+    enum OpCode : uint8_t {opRead, opWrite, opSync, opNumCodes};
     AioData(size_t aioLba_,
 	     void   *data_,
 	     size_t  size_,
@@ -15,20 +36,128 @@ namespace aio_interface
 	     cb      callbackFunc_) :
       aioLba(aioLba_), data(data_), size(size_),
       userCntxt(userCntxt_), status(0),
-      callbackFunc(callbackFunc_) {};
+      callbackFunc(callbackFunc_), userTag(0), opcode(opRead), ioClass(ioForeground),
+      device(0), affinity(-1), queue(0), iov(0), iovcnt(0),
+      submitTime(0), kernelTime(0) {};
+    AioData(const AioData &) = delete;
+    AioData &operator = (const AioData &) = delete;
+    ~AioData() {
+      if (iov)
+	IovPool::free(iov);
+    }
 	     
     size_t  aioLba;
     void   *data;
     size_t  size;
     void   *userCntxt;
-    size_t  status;
+    int     status;    // 0, or -errno once the request failed
     cb      callbackFunc;
+    uint64_t userTag;  // free for the request owner
+    OpCode  opcode;
+    IoClass ioClass;
+    uint16_t device;   // aioLba is an offset in this device
+    int16_t affinity;  // queue to use, -1 - the queue of the submitting core
+    uint16_t queue;    // queue actually used, set on submit
+    // when iovcnt is not 0 the request is vectored (preadv/pwritev) over
+    // iov[0, iovcnt), size is the total and data is not used. the array
+    // is pooled, a request allocates it on the first setIovCount
+    struct iovec *iov;
+    uint16_t iovcnt;
+    void setIovCount(size_t n) {
+      assert(n <= s_maxIov);
+      if (!iov && n)
+	iov = ((IovArray *)IovPool::alloc())->v;
+      iovcnt = n;
+    }
+    uint64_t submitTime; // ns, for the statistics
+    uint64_t kernelTime;
+    // per request kernel structure (iocb), owned by the backend
+    uint64_t backendData[8];
+
+    // requests are allocated from a per thread cached pool
+    static void *operator new(size_t size) {
+      assert(size == sizeof(AioData));
+      return ObjectPool<AioData>::alloc();
+    }
+    static void operator delete(void *p) {
+      ObjectPool<AioData>::free(p);
+    }
+  };
+
+  struct AioConfig
+  {
+    enum Backend : uint8_t {libaio, ioUring};
+    AioConfig() :
+      backend(libaio), queueDepth(4096), nQueues(1), reapBatch(20),
+      sqPoll(false), directIo(false), numaAware(false), collectStats(true),
+      statsDumpSeconds(0), driveName(0) {
+      classDepth[ioForeground] = 2048;
+      classDepth[ioFlush]      = 1024;
+      classDepth[ioCompaction] = 1024;
+    }
+    Backend      backend;
+    uint         queueDepth; // per queue, at least the sum of classDepth
+    uint         classDepth[ioNumClasses]; // in flight requests per class and queue
+    uint         nQueues;    // contexts each with its own completion thread, 0 - one per core
+    uint         reapBatch;  // max completions handled per wakeup
+    bool         sqPoll;     // io_uring only, kernel thread polls the submissions
+    bool         directIo;   // O_DIRECT, buffers offsets and sizes must be 4K aligned
+    // every NUMA node gets nQueues queues of each device (0 - one per core
+    // of the node), their completion threads are pinned to the node and a
+    // request goes to a queue of the submitting thread node. see numa.hpp
+    bool         numaAware;
+    bool         collectStats;     // see io_stats.hpp
+    uint         statsDumpSeconds; // periodic print, 0 - none
+    const char  *driveName;  // 0 - use the default test drive
+    // one entry per device, each device gets its own nQueues queues.
+    // empty - a single device, driveName
+    std::vector<std::string> drives;
   };
 
   bool Read(AioData *);
   bool Write(AioData *);
-  void aioInit();
-  
+  // fdatasync of aioData->device, data and size are not used
+  bool Sync(AioData *);
+  // tell the device [offset, offset + size) holds no data: BLKDISCARD on
+  // a block device, a punched hole in a file. synchronous, returns 0 or
+  // -errno (-EOPNOTSUPP when the device can not discard)
+  int  Discard(uint device, size_t offset, size_t size);
+  void aioInit(const AioConfig &config = AioConfig());
+  uint numDevices();
+  // the data buffers of every node, indexed by node, may be pre-registered
+  // with the kernel (io_uring fixed buffers), saving the per request page
+  // pinning. a queue registers those of its node. called once, before the
+  // first request
+  void registerBuffers(const std::vector<struct iovec> &nodeBuffers);
+
+  // collect several requests and hand them to the kernel together
+  // (a single io_submit for the whole batch). leftovers are submitted
+  // when the batch goes out of scope
+  class AioBatch
+  {
+  public:
+    AioBatch() {}
+    ~AioBatch() {submit();}
+    void read(AioData *aioData) {
+      aioData->opcode = AioData::opRead;
+      m_requests.push_back(aioData);
+    }
+    void write(AioData *aioData) {
+      aioData->opcode = AioData::opWrite;
+      m_requests.push_back(aioData);
+    }
+    void sync(AioData *aioData) {
+      aioData->opcode = AioData::opSync;
+      m_requests.push_back(aioData);
+    }
+    bool   submit();
+    size_t size() const {return m_requests.size();}
+    bool   empty() const {return m_requests.empty();}
+  private:
+    AioBatch(const AioBatch &) = delete;
+    std::vector<AioData *> m_requests;
+  };
+
 
 
 }
@@ -0,0 +1,164 @@
+#include "numa.hpp"
+#include "io_stats.hpp"
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <assert.h>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  static const char *s_sysfsNodes = "/sys/devices/system/node";
+  static const int   s_mpolPreferred = 1; // MPOL_PREFERRED of numaif.h
+
+  bool                    Numa::s_enabled;
+  std::vector<Numa::Node> Numa::s_nodes(1, Numa::Node{0, {}});
+  std::vector<uint>       Numa::s_cpuNodes;
+
+  // the calling thread pinning, and its cpus from before
+  static thread_local int        s_pinnedNode = -1;
+  static thread_local bool       s_cpusSaved;
+  static thread_local cpu_set_t  s_savedCpus;
+
+  // "0-3,8-11"
+  static std::vector<int> parseCpuList(const char *list)
+  {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p && *p != '\n') {
+      char *end;
+      int first = strtol(p, &end, 10);
+      if (end == p)
+	break;
+      int last = first;
+      p = end;
+      if (*p == '-') {
+	last = strtol(p + 1, &end, 10);
+	p = end;
+      }
+      for (int cpu = first; cpu <= last; cpu++)
+	cpus.push_back(cpu);
+      if (*p == ',')
+	p++;
+    }
+    return cpus;
+  }
+
+  void Numa::enable()
+  {
+    assert(!s_enabled);
+    std::vector<Node> nodes;
+    DIR *dir = opendir(s_sysfsNodes);
+    while (struct dirent *entry = dir ? readdir(dir) : 0) {
+      int id;
+      if (sscanf(entry->d_name, "node%d", &id) != 1)
+	continue;
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s/cpulist", s_sysfsNodes, entry->d_name);
+      FILE *f = fopen(path, "r");
+      if (!f)
+	continue;
+      char list[4096];
+      if (fgets(list, sizeof(list), f)) {
+	Node node{id, parseCpuList(list)};
+	if (!node.cpus.empty()) // memory only nodes run no thread
+	  nodes.push_back(node);
+      }
+      fclose(f);
+    }
+    if (dir)
+      closedir(dir);
+    std::sort(nodes.begin(), nodes.end(),
+	      [](const Node &a, const Node &b) {return a.id < b.id;});
+    if (nodes.empty()) {
+      printf("no NUMA topology in %s, using a single node\n", s_sysfsNodes);
+      nodes.push_back(Node{0, {}});
+    }
+    for (size_t i = s_maxNodes; i < nodes.size(); i++) {
+      auto &to = nodes[i % s_maxNodes].cpus;
+      to.insert(to.end(), nodes[i].cpus.begin(), nodes[i].cpus.end());
+    }
+    if (nodes.size() > s_maxNodes) {
+      printf("%zu NUMA nodes, the ones past %u share the first ones\n",
+	     nodes.size(), s_maxNodes);
+      nodes.resize(s_maxNodes);
+    }
+    s_nodes = nodes;
+    for (uint n = 0; n < s_nodes.size(); n++) {
+      for (int cpu : s_nodes[n].cpus) {
+	if ((size_t)cpu >= s_cpuNodes.size())
+	  s_cpuNodes.resize(cpu + 1, 0);
+	s_cpuNodes[cpu] = n;
+      }
+    }
+    s_enabled = true;
+  }
+
+  uint Numa::currentNode()
+  {
+    if (s_pinnedNode >= 0)
+      return s_pinnedNode;
+    uint cpu = sched_getcpu();
+    return cpu < s_cpuNodes.size() ? s_cpuNodes[cpu] : 0;
+  }
+
+  void Numa::pinThread(int node)
+  {
+    if (!s_enabled || node == s_pinnedNode)
+      return;
+    if (!s_cpusSaved) {
+      sched_getaffinity(0, sizeof(s_savedCpus), &s_savedCpus);
+      s_cpusSaved = true;
+    }
+    cpu_set_t cpus;
+    if (node < 0) {
+      cpus = s_savedCpus;
+    } else {
+      assert((uint)node < s_nodes.size());
+      CPU_ZERO(&cpus);
+      for (int cpu : s_nodes[node].cpus)
+	CPU_SET(cpu, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      printf("failed to pin a thread to node %d, errno %d\n", node, errno);
+      return;
+    }
+    s_pinnedNode = node;
+    IoStats::setLocalNode(node);
+  }
+
+  int Numa::pinnedNode()
+  {
+    return s_pinnedNode;
+  }
+
+  bool Numa::bindMemory(void *addr, size_t size, uint node)
+  {
+    if (!s_enabled || s_nodes[node].cpus.empty())
+      return false;
+    unsigned long mask[2] = {0, 0};
+    const int id = s_nodes[node].id;
+    if ((size_t)id >= sizeof(mask) * 8)
+      return false;
+    mask[id / (sizeof(mask[0]) * 8)] |= 1ul << (id % (sizeof(mask[0]) * 8));
+    // the kernel counts maxnode one past the last bit
+    if (syscall(SYS_mbind, addr, size, s_mpolPreferred, mask, sizeof(mask) * 8 + 1, 0) != 0) {
+      static bool reported;
+      if (!reported) {
+	printf("mbind to node %d failed, errno %d, pages go where first touched\n", id, errno);
+	reported = true;
+      }
+      return false;
+    }
+    return true;
+  }
+}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  // NUMA topology, read from sysfs so there is no libnuma dependency.
+  // the aio queues with their completion threads and the block buffers are
+  // placed per node once enable() is called (AioConfig::numaAware), until
+  // then everything is a single node 0.
+  // nodes are numbered densely from 0, nodes without cpus are not used
+  class Numa
+  {
+  public:
+    static const uint s_maxNodes = 8;
+    // read the topology, the cpus of node i past s_maxNodes are added to
+    // node i % s_maxNodes
+    static void enable();
+    static bool enabled() {return s_enabled;}
+    static uint nNodes() {return s_nodes.size();}
+    static const std::vector<int> &cpus(uint node) {return s_nodes[node].cpus;}
+    // node of the calling thread, the one it is pinned to or of the cpu it
+    // runs on
+    static uint currentNode();
+    // restrict the calling thread to the cpus of node, -1 - back to the
+    // cpus it had before it was first pinned
+    static void pinThread(int node);
+    // -1 unless the calling thread is pinned
+    static int  pinnedNode();
+    // the pages of [addr, addr + size) are preferably placed on node when
+    // first touched, false when the kernel refuses
+    static bool bindMemory(void *addr, size_t size, uint node);
+  private:
+    struct Node
+    {
+      int              id;   // in sysfs
+      std::vector<int> cpus;
+    };
+    static bool              s_enabled;
+    static std::vector<Node> s_nodes;
+    static std::vector<uint> s_cpuNodes; // by cpu
+  };
+}
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <mutex>
+#include <stdlib.h>
+#include <assert.h>
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  // fixed size object pool for the I/O hot path.
+  // every thread keeps a private cache of free objects, so alloc/free are
+  // plain list operations. full batches move between the threads through a
+  // global depot under a mutex, taken once per batch, and the global
+  // allocator is called only to carve new slabs when the depot is really
+  // empty. memory is never returned to the system.
+  // Instance makes separate pools of the same type (e.g. one per NUMA node)
+  template <class T, size_t BatchSize = 64, size_t SlabObjects = 1024, size_t Instance = 0>
+  class ObjectPool
+  {
+  public:
+    typedef void *(*SlabAlloc)(size_t bytes);
+
+    static void *alloc() {
+      LocalCache &cache = s_cache;
+      if (!cache.head) {
+	cache.head  = popBatch();
+	cache.count = BatchSize;
+      }
+      FreeNode *ret = cache.head;
+      cache.head = ret->next;
+      cache.count--;
+      return ret;
+    }
+
+    static void free(void *p) {
+      LocalCache &cache = s_cache;
+      FreeNode *node = (FreeNode *)p;
+      node->next = cache.head;
+      cache.head = node;
+      if (++cache.count >= 2 * BatchSize) {
+	cache.giveBack(BatchSize);
+      }
+    }
+    // must be set before the first allocation, default is malloc
+    static void setSlabAllocator(SlabAlloc slabAlloc) {s_slabAlloc = slabAlloc;}
+
+  private:
+    struct FreeNode
+    {
+      FreeNode *next;       // next free object
+      FreeNode *nextBatch;  // valid on the first node of a batch in the depot
+    };
+    static_assert(sizeof(T) >= sizeof(FreeNode), "object too small for the pool");
+
+    struct LocalCache
+    {
+      LocalCache() : head(0), count(0) {}
+      ~LocalCache() {
+	while (count >= BatchSize)
+	  giveBack(BatchSize);
+	// a partial batch is lost, the pool never frees memory anyway
+      }
+      void giveBack(size_t n) {
+	FreeNode *batch = head;
+	FreeNode *last  = head;
+	for (size_t i = 1; i < n; i++)
+	  last = last->next;
+	head = last->next;
+	last->next = 0;
+	count -= n;
+	pushBatches(batch, batch);
+      }
+      FreeNode *head;
+      size_t    count;
+    };
+
+    // push a list of batches (linked by nextBatch) on the depot
+    static void pushBatches(FreeNode *first, FreeNode *last) {
+      std::lock_guard<std::mutex> lk(s_depotMutex);
+      last->nextBatch = s_depot;
+      s_depot = first;
+    }
+
+    static FreeNode *popBatch() {
+      {
+	std::lock_guard<std::mutex> lk(s_depotMutex);
+	if (FreeNode *batch = s_depot) {
+	  s_depot = batch->nextBatch;
+	  return batch;
+	}
+      }
+      return newSlab();
+    }
+
+    // carve a new slab, keep the first batch and push the others
+    static FreeNode *newSlab() {
+      static_assert(SlabObjects % BatchSize == 0, "slab must hold whole batches");
+      char *slab = (char *)(s_slabAlloc ? s_slabAlloc(sizeof(T) * SlabObjects) :
+			    malloc(sizeof(T) * SlabObjects));
+      assert(slab);
+      FreeNode *batches = 0;
+      for (size_t b = SlabObjects / BatchSize; b > 0; b--) {
+	FreeNode *batch = 0;
+	for (size_t i = 0; i < BatchSize; i++) {
+	  FreeNode *node = (FreeNode *)(slab + ((b - 1) * BatchSize + i) * sizeof(T));
+	  node->next = batch;
+	  batch = node;
+	}
+	batch->nextBatch = batches;
+	batches = batch;
+      }
+      FreeNode *ret = batches;
+      FreeNode *rest = batches->nextBatch;
+      if (rest) {
+	FreeNode *last = rest;
+	while (last->nextBatch)
+	  last = last->nextBatch;
+	pushBatches(rest, last);
+      }
+      return ret;
+    }
+
+    static thread_local LocalCache  s_cache;
+    static std::mutex               s_depotMutex;
+    static FreeNode                *s_depot;
+    static SlabAlloc                s_slabAlloc;
+  };
+
+  template <class T, size_t B, size_t S, size_t I>
+  thread_local typename ObjectPool<T, B, S, I>::LocalCache ObjectPool<T, B, S, I>::s_cache;
+  template <class T, size_t B, size_t S, size_t I>
+  std::mutex ObjectPool<T, B, S, I>::s_depotMutex;
+  template <class T, size_t B, size_t S, size_t I>
+  typename ObjectPool<T, B, S, I>::FreeNode *ObjectPool<T, B, S, I>::s_depot;
+  template <class T, size_t B, size_t S, size_t I>
+  typename ObjectPool<T, B, S, I>::SlabAlloc ObjectPool<T, B, S, I>::s_slabAlloc;
+}
+}
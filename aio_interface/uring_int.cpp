@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <strings.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aio_backend.hpp"
+
+// io_uring backend, built only when liburing is available (-DROCKSXL_IO_URING)
+#ifdef ROCKSXL_IO_URING
+#include <liburing.h>
+#include <sys/uio.h>
+#include <vector>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  // the kernel limits a single registered buffer to 1G
+  static const size_t s_maxFixedBufferSize = 1024ull * 1024 * 1024;
+
+  class UringBackend : public AioBackend
+  {
+  public:
+    UringBackend(const AioConfig &config, int fd);
+    size_t submit(AioData **requests, size_t n);
+    void   reap();
+    void   registerBuffers(const std::vector<struct iovec> &buffers);
+  private:
+    int    fixedBuffer(const AioData *aioData) const;
+    int    flush();
+    size_t fail(AioData **requests, size_t from, size_t to, int error);
+  private:
+    struct io_uring              m_ring;
+    // set once before the first request, read only after
+    std::vector<struct iovec>    m_fixedBuffers;
+    uint                         m_reapBatch;
+  };
+
+  UringBackend::UringBackend(const AioConfig &config, int fd) :
+    m_reapBatch(config.reapBatch)
+  {
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    if (config.sqPoll) {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = 1000; // ms
+    }
+    int ret = io_uring_queue_init_params(config.queueDepth, &m_ring, &params);
+    if (ret != 0) {
+      printf("io_uring_queue_init error %d\n", ret);
+      assert(0);
+    }
+    // requests use index 0 of the registered files instead of the fd
+    ret = io_uring_register_files(&m_ring, &fd, 1);
+    assert(ret == 0);
+  }
+
+  void UringBackend::registerBuffers(const std::vector<struct iovec> &buffers)
+  {
+    // the registered set can only be replaced as a whole, which is not
+    // safe with fixed requests in flight
+    assert(m_fixedBuffers.empty());
+    for (auto const &buffer : buffers) {
+      for (size_t offset = 0; offset < buffer.iov_len; offset += s_maxFixedBufferSize) {
+	struct iovec iov;
+	iov.iov_base = (char *)buffer.iov_base + offset;
+	iov.iov_len  = std::min(buffer.iov_len - offset, s_maxFixedBufferSize);
+	m_fixedBuffers.push_back(iov);
+      }
+    }
+    if (m_fixedBuffers.empty())
+      return;
+    int ret = io_uring_register_buffers(&m_ring, m_fixedBuffers.data(),
+					m_fixedBuffers.size());
+    if (ret != 0) {
+      printf("io_uring_register_buffers error %d\n", ret);
+      m_fixedBuffers.clear(); // the requests do without
+    }
+  }
+
+  // index of the registered buffer holding the request data or -1
+  int UringBackend::fixedBuffer(const AioData *aioData) const
+  {
+    const char *start = (const char *)aioData->data;
+    for (size_t i = 0; i < m_fixedBuffers.size(); i++) {
+      const char *base = (const char *)m_fixedBuffers[i].iov_base;
+      if (start >= base &&
+	  start + aioData->size <= base + m_fixedBuffers[i].iov_len) {
+	return i;
+      }
+    }
+    return -1;
+  }
+
+  // io_uring_submit retried while the kernel is busy, the number of
+  // entries submitted or -errno
+  int UringBackend::flush()
+  {
+    int ret;
+    while ((ret = io_uring_submit(&m_ring)) == -EAGAIN || ret == -EBUSY ||
+	   ret == -EINTR) {
+      usleep(1);
+    }
+    return ret;
+  }
+
+  // a request the kernel rejects completes with an error cqe, a failed
+  // submit is an error of the ring. the requests queued since the last
+  // submit are failed then and the ones not queued yet are retried by the
+  // front end
+  size_t UringBackend::submit(AioData **requests, size_t n)
+  {
+    size_t i = 0;
+    size_t queued = 0; // first request not submitted yet
+    while (i < n) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+      if (!sqe) {
+	// submission ring is full, push what we have and retry
+	int ret = flush();
+	if (ret < 0)
+	  return fail(requests, queued, i, ret);
+	queued = i;
+	if (ret == 0)
+	  usleep(1);
+	continue;
+      }
+      AioData *aioData = requests[i++];
+      int bufIndex = aioData->iovcnt ? -1 : fixedBuffer(aioData);
+      if (aioData->opcode == AioData::opSync) {
+	io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+      } else if (aioData->iovcnt) {
+	if (aioData->opcode == AioData::opRead)
+	  io_uring_prep_readv(sqe, 0, aioData->iov, aioData->iovcnt,
+			      aioData->aioLba);
+	else
+	  io_uring_prep_writev(sqe, 0, aioData->iov, aioData->iovcnt,
+			       aioData->aioLba);
+      } else if (aioData->opcode == AioData::opRead) {
+	if (bufIndex >= 0)
+	  io_uring_prep_read_fixed(sqe, 0, aioData->data, aioData->size,
+				   aioData->aioLba, bufIndex);
+	else
+	  io_uring_prep_read(sqe, 0, aioData->data, aioData->size, aioData->aioLba);
+      } else {
+	if (bufIndex >= 0)
+	  io_uring_prep_write_fixed(sqe, 0, aioData->data, aioData->size,
+				    aioData->aioLba, bufIndex);
+	else
+	  io_uring_prep_write(sqe, 0, aioData->data, aioData->size, aioData->aioLba);
+      }
+      sqe->flags |= IOSQE_FIXED_FILE;
+      io_uring_sqe_set_data(sqe, aioData);
+    }
+    int ret = flush();
+    if (ret < 0)
+      return fail(requests, queued, n, ret);
+    return n;
+  }
+
+  // requests [from, to) were queued but not submitted
+  size_t UringBackend::fail(AioData **requests, size_t from, size_t to, int error)
+  {
+    for (size_t i = from; i < to; i++)
+      requestDone(requests[i], error);
+    return to;
+  }
+
+  void UringBackend::reap()
+  {
+    std::vector<struct io_uring_cqe *> cqes(m_reapBatch);
+    std::vector<AioData *> done(m_reapBatch);
+    std::vector<long>      res(m_reapBatch);
+    while (1) {
+      struct io_uring_cqe *cqe;
+      int ret = io_uring_wait_cqe(&m_ring, &cqe);
+      if (ret == -EINTR)
+	continue;
+      assert(ret == 0);
+      unsigned count = io_uring_peek_batch_cqe(&m_ring, cqes.data(), m_reapBatch);
+      for (unsigned i = 0; i < count; i++) {
+	done[i] = (AioData *)io_uring_cqe_get_data(cqes[i]);
+	res[i]  = cqes[i]->res;
+      }
+      // release the completion entries before the callbacks submit more work
+      io_uring_cq_advance(&m_ring, count);
+      for (unsigned i = 0; i < count; i++) {
+	requestDone(done[i], res[i]);
+      }
+    }
+  }
+
+  AioBackend *newUringBackend(const AioConfig &config, int fd)
+  {
+    return new UringBackend(config, fd);
+  }
+}
+}
+
+#else
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  AioBackend *newUringBackend(const AioConfig &, int)
+  {
+    printf("io_uring support was not compiled in, using libaio\n");
+    return 0;
+  }
+}
+}
+#endif
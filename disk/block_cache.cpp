@@ -0,0 +1,129 @@
+#include "block_cache.hpp"
+
+namespace rocksxl
+{
+namespace disk
+{
+  BlockCache *BlockCache::s_blockCache;
+
+  BlockCache::BlockCache(size_t capacityBytes, uint nShards) :
+    m_shards(nShards)
+  {
+    m_shardCapacity = std::max<size_t>(capacityBytes / s_diskBlockSize / nShards, 1);
+    // 80% protected as in the classic SLRU split
+    m_protectedCapacity = m_shardCapacity * 8 / 10;
+  }
+
+  DiskBlockPtr BlockCache::lookup(DiskPartitionId partition, size_t blockNum,
+				  uint32_t *generation)
+  {
+    Shard &s = shard(partition);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto part = s.partitions.find(partition);
+    if (part == s.partitions.end() || part->second.blocks.count(blockNum) == 0) {
+      s.misses++;
+      if (generation)
+	*generation = part == s.partitions.end() ? 0 : part->second.generation;
+      return DiskBlockPtr();
+    }
+    s.hits++;
+    auto entry = part->second.blocks[blockNum];
+    if (entry->isProtected) {
+      s.protectedLru.splice(s.protectedLru.begin(), s.protectedLru, entry);
+    } else {
+      // second hit, promote
+      entry->isProtected = true;
+      s.protectedLru.splice(s.protectedLru.begin(), s.probation, entry);
+      if (s.protectedLru.size() > m_protectedCapacity) {
+	// demote the coldest protected block to the head of probation
+	auto demoted = std::prev(s.protectedLru.end());
+	demoted->isProtected = false;
+	s.probation.splice(s.probation.begin(), s.protectedLru, demoted);
+      }
+    }
+    return entry->block;
+  }
+
+  uint32_t BlockCache::generation(DiskPartitionId partition)
+  {
+    Shard &s = shard(partition);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto part = s.partitions.find(partition);
+    return part == s.partitions.end() ? 0 : part->second.generation;
+  }
+
+  void BlockCache::insert(DiskPartitionId partition, size_t blockNum,
+			  const DiskBlockPtr &block, uint32_t generation, CacheFill fill)
+  {
+    if (fill == cacheFillNone)
+      return;
+    Shard &s = shard(partition);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto &part = s.partitions[partition];
+    if (part.generation != generation || part.blocks.count(blockNum))
+      return;
+    if (s.nBlocks >= m_shardCapacity) {
+      evict(s);
+    }
+    auto where = fill == cacheFillNormal ? s.probation.begin() : s.probation.end();
+    part.blocks[blockNum] = s.probation.insert(where, Entry{partition, (uint32_t)blockNum,
+							    block, false});
+    s.nBlocks++;
+  }
+
+  // lock is held
+  void BlockCache::evict(Shard &s)
+  {
+    Lru &from = s.probation.empty() ? s.protectedLru : s.probation;
+    assert(!from.empty());
+    auto const &entry = from.back();
+    auto part = s.partitions.find(entry.partition);
+    part->second.blocks.erase(entry.blockNum);
+    if (part->second.blocks.empty() && part->second.generation == 0)
+      s.partitions.erase(part);
+    from.pop_back();
+    s.nBlocks--;
+  }
+
+  // a single shard lock, the blocks are found through the partition
+  void BlockCache::erasePartition(DiskPartitionId partition)
+  {
+    Shard &s = shard(partition);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto &part = s.partitions[partition];
+    part.generation++;
+    for (auto const &block : part.blocks) {
+      auto entry = block.second;
+      (entry->isProtected ? s.protectedLru : s.probation).erase(entry);
+    }
+    s.nBlocks -= part.blocks.size();
+    part.blocks.clear();
+  }
+
+  size_t BlockCache::hits() const
+  {
+    size_t ret = 0;
+    for (auto const &s : m_shards)
+      ret += s.hits;
+    return ret;
+  }
+
+  size_t BlockCache::misses() const
+  {
+    size_t ret = 0;
+    for (auto const &s : m_shards)
+      ret += s.misses;
+    return ret;
+  }
+
+  size_t BlockCache::sizeBytes() const
+  {
+    size_t ret = 0;
+    for (auto const &s : m_shards) {
+      std::lock_guard<std::mutex> lk(s.mutex);
+      ret += s.nBlocks;
+    }
+    return ret * s_diskBlockSize;
+  }
+}
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "disk_io_manager.hpp"
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // cache of disk blocks keyed by (partition, block number).
+  // sharded by partition, every shard is a segmented LRU: new blocks enter
+  // the probation segment and move to the protected segment on a second
+  // hit, so a scan only churns probation. cached blocks are shared, users
+  // must not modify them.
+  // a partition has a generation, bumped when it is erased. a read takes
+  // the generation before it is issued and its blocks are inserted with
+  // it, so a read that completes after the erase does not bring the old
+  // blocks back
+  class BlockCache
+  {
+  public:
+    static BlockCache *s_blockCache;
+    static void init(size_t capacityBytes, uint nShards = 64) {
+      s_blockCache = new BlockCache(capacityBytes, nShards);
+    }
+  public:
+    // on a miss generation (when given) is set for the insert of the block
+    DiskBlockPtr lookup(DiskPartitionId partition, size_t blockNum,
+			uint32_t *generation = 0);
+    uint32_t generation(DiskPartitionId partition);
+    // dropped when the partition was erased since generation was taken
+    void   insert(DiskPartitionId partition, size_t blockNum,
+		  const DiskBlockPtr &block, uint32_t generation,
+		  CacheFill fill = cacheFillNormal);
+    // drop every block of the partition, called when it is rewritten
+    void   erasePartition(DiskPartitionId partition);
+    size_t hits() const;
+    size_t misses() const;
+    size_t sizeBytes() const;
+  private:
+    BlockCache(size_t capacityBytes, uint nShards);
+    struct Entry
+    {
+      DiskPartitionId partition;
+      uint32_t        blockNum;
+      DiskBlockPtr    block;
+      bool            isProtected;
+    };
+    typedef std::list<Entry> Lru;
+    struct Partition
+    {
+      Partition() : generation(0) {}
+      uint32_t                                   generation;
+      std::unordered_map<uint32_t, Lru::iterator> blocks; // cached, by block number
+    };
+    struct Shard
+    {
+      Shard() : nBlocks(0), hits(0), misses(0) {}
+      mutable std::mutex                              mutex;
+      Lru                                             probation;
+      Lru                                             protectedLru;
+      // kept once erased, for the generation
+      std::unordered_map<DiskPartitionId, Partition>  partitions;
+      size_t                                          nBlocks;
+      std::atomic<size_t>                             hits;
+      std::atomic<size_t>                             misses;
+    };
+    Shard &shard(DiskPartitionId partition) {
+      return m_shards[(partition * 0x9E3779B97F4A7C15ull >> 32) % m_shards.size()];
+    }
+    void evict(Shard &shard);
+  private:
+    std::vector<Shard>  m_shards;
+    size_t              m_shardCapacity;   // blocks per shard
+    size_t              m_protectedCapacity;
+  };
+}
+}
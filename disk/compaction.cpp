@@ -0,0 +1,449 @@
+#include "compaction.hpp"
+#include "../aio_interface/libaio_int.hpp"
+#include "../aio_interface/numa.hpp"
+#include <string.h>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // RecordReader
+
+  RecordReader::RecordReader(const SortedFile &file, const UserKey *fromKey) :
+    m_pos(s_blockDataSize)
+  {
+    size_t firstBlock = 0;
+    if (fromKey) {
+      // a fence of fromKey itself may follow older versions of the key
+      for (auto const &fence : file.fences) {
+	if (!(fence.key < *fromKey))
+	  break;
+	firstBlock = fence.blockNum;
+      }
+    }
+    m_blocksLeft = file.nBlocks - firstBlock;
+    m_fetcher = new DiskFetcher(file.locations, cacheFillNone, firstBlock, file.nBlocks);
+    if (nextBlock()) {
+      m_pos = *(uint16_t *)m_block->data;
+      assert(m_pos != s_noRecord);
+    }
+  }
+
+  bool RecordReader::nextBlock()
+  {
+    if (m_blocksLeft == 0) {
+      m_block.reset();
+      return false;
+    }
+    m_block = m_fetcher->getBlock();
+    if (!m_block)
+      return false;
+    m_blocksLeft--;
+    m_pos = s_blockHeaderSize;
+    return true;
+  }
+
+  bool RecordReader::read(char *to, size_t size)
+  {
+    while (size) {
+      if (m_pos == s_blockDataSize && !nextBlock())
+	return false;
+      size_t n = std::min(size, s_blockDataSize - m_pos);
+      memcpy(to, m_block->data + m_pos, n);
+      m_pos += n;
+      to += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool RecordReader::next()
+  {
+    if (!m_block)
+      return false;
+    if (m_pos + sizeof(RecordHeader) > s_blockDataSize ||
+	((RecordHeader *)(m_block->data + m_pos))->keySize == 0) {
+      // padding, the next record starts the next block
+      if (!nextBlock())
+	return false;
+      assert(*(uint16_t *)m_block->data == s_blockHeaderSize);
+    }
+    RecordHeader header;
+    memcpy(&header, m_block->data + m_pos, sizeof(header));
+    m_pos += sizeof(header);
+    std::string key(header.keySize, 0);
+    m_value.resize(header.valueSize);
+    if (!read(const_cast<char *>(key.data()), key.size()) ||
+	!read(const_cast<char *>(m_value.data()), m_value.size())) {
+      assert(status() != 0); // truncated file
+      return false;
+    }
+    m_key = UserKey(key.data(), key.size());
+    m_type = (RecordType)header.type;
+    return true;
+  }
+
+  // MergeIterator
+
+  MergeIterator::MergeIterator(std::vector<RecordReader *> &inputs,
+			       const UserKey *fromKey, const UserKey *toKey) :
+    m_inputs(inputs),
+    m_fromKey(fromKey),
+    m_toKey(toKey),
+    m_heap(Greater{&inputs}),
+    m_current(0),
+    m_advance(false),
+    m_hasLastKey(false),
+    m_keyDone(false)
+  {
+    for (size_t i = 0; i < m_inputs.size(); i++) {
+      if (m_inputs[i]->next())
+	push(i);
+    }
+  }
+
+  void MergeIterator::push(size_t input)
+  {
+    auto reader = m_inputs[input];
+    while (m_fromKey && reader->key() < *m_fromKey) {
+      if (!reader->next())
+	return;
+    }
+    if (m_toKey && !(reader->key() < *m_toKey))
+      return; // the rest of the input is out of the range
+    m_heap.push(input);
+  }
+
+  bool MergeIterator::next()
+  {
+    if (m_advance && m_inputs[m_current]->next()) {
+      push(m_current);
+    }
+    m_advance = false;
+    while (!m_heap.empty()) {
+      size_t top = m_heap.top();
+      m_heap.pop();
+      auto reader = m_inputs[top];
+      bool sameKey = m_hasLastKey &&
+	!(reader->key() < m_lastKey) && !(m_lastKey < reader->key());
+      if (sameKey && m_keyDone) {
+	// hidden by a newer version
+	if (reader->next())
+	  push(top);
+	continue;
+      }
+      if (!sameKey) {
+	m_lastKey = reader->key();
+	m_hasLastKey = true;
+      }
+      m_keyDone = reader->type() != recordUpdate;
+      m_current = top;
+      m_advance = true;
+      return true;
+    }
+    return false;
+  }
+
+  // RecordWriter
+
+  RecordWriter::RecordWriter(SortedFile &file, WriteSignal *signal, WriterClass writerClass) :
+    m_file(file),
+    m_writer(new DiskWriter(signal, writerClass)),
+    m_pos(0),
+    m_blockNum(0)
+  {
+    newBlock();
+  }
+
+  void RecordWriter::newBlock()
+  {
+    if (m_block) {
+      memset(m_block->data + m_pos, 0, s_blockDataSize - m_pos);
+      m_writer->append(m_block);
+      m_blockNum++;
+    }
+    m_block.reset(new DiskBlock);
+    *(uint16_t *)m_block->data = s_noRecord;
+    m_pos = s_blockHeaderSize;
+  }
+
+  void RecordWriter::write(const char *from, size_t size)
+  {
+    while (size) {
+      if (m_pos == s_blockDataSize)
+	newBlock();
+      size_t n = std::min(size, s_blockDataSize - m_pos);
+      memcpy(m_block->data + m_pos, from, n);
+      m_pos += n;
+      from += n;
+      size -= n;
+    }
+  }
+
+  void RecordWriter::add(const UserKey &key, RecordType type, const std::string &value)
+  {
+    assert(key.size() > 0 && key.size() <= 0xffff);
+    if (m_pos + sizeof(RecordHeader) > s_blockDataSize)
+      newBlock();
+    uint16_t &firstRecord = *(uint16_t *)m_block->data;
+    if (firstRecord == s_noRecord) {
+      firstRecord = m_pos;
+      if (m_blockNum % s_fenceBlocks == 0)
+	m_file.fences.push_back(KeyFence{key, m_blockNum});
+    }
+    const size_t startBlock = m_blockNum;
+    RecordHeader header;
+    header.keySize = key.size();
+    header.type = type;
+    header.valueSize = value.size();
+    write((const char *)&header, sizeof(header));
+    write(key.data(), key.size());
+    write(value.data(), value.size());
+    // the index points at the newest version, older ones follow it
+    if (m_keys.empty() || m_keys.back() < key) {
+      m_keys.push_back(key);
+      m_locations.push_back(xl_index::ObjectLocationInfo(startBlock, type == recordUpdate,
+							 m_blockNum != startBlock));
+    }
+  }
+
+  void RecordWriter::finish()
+  {
+    if (!m_keys.empty()) {
+      memset(m_block->data + m_pos, 0, s_blockDataSize - m_pos);
+      m_writer->append(m_block);
+      m_file.nBlocks = m_blockNum + 1;
+      // m_keys is done growing, the index may point into it and the
+      // entries keep the order of the keys in memory too
+      std::vector< std::pair<const UserKey *, xl_index::ObjectLocationInfo> > entries;
+      entries.reserve(m_keys.size());
+      for (size_t i = 0; i < m_keys.size(); i++)
+	entries.push_back(std::make_pair(&m_keys[i], m_locations[i]));
+      m_file.index = xl_index::IndexInterface::build(entries);
+    }
+    m_block.reset();
+    m_writer->seal();
+  }
+
+  // the pool of the subcompactions. with several NUMA nodes the workers
+  // are spread over the nodes and pinned, a subcompaction reads and writes
+  // blocks of the pool of its worker node
+
+  class ThreadPool
+  {
+  public:
+    ThreadPool(uint nThreads) {
+      for (uint i = 0; i < nThreads; i++)
+	std::thread(&ThreadPool::worker, this, i % aio_interface::Numa::nNodes()).detach();
+    }
+    void run(std::function<void ()> task) {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_tasks.push_back(task);
+      m_cond.notify_one();
+    }
+  private:
+    void worker(uint node) {
+      aio_interface::Numa::pinThread(node);
+      while (1) {
+	std::function<void ()> task;
+	{
+	  std::unique_lock<std::mutex> lk(m_mutex);
+	  m_cond.wait(lk, [this] {return !m_tasks.empty();});
+	  task = m_tasks.front();
+	  m_tasks.pop_front();
+	}
+	task();
+      }
+    }
+  private:
+    std::mutex                           m_mutex;
+    std::condition_variable              m_cond;
+    std::deque< std::function<void ()> > m_tasks;
+  };
+
+  static ThreadPool     *s_pool;
+  static std::once_flag  s_poolOnce;
+  static const uint      s_defaultPoolThreads = 4;
+
+  void Compaction::initPool(uint nThreads)
+  {
+    std::call_once(s_poolOnce, [nThreads] {s_pool = new ThreadPool(nThreads);});
+  }
+
+  // Compaction
+
+  Compaction::Compaction(const std::vector<const SortedFile *> &inputs,
+			 const std::vector<UserKey> &splitKeys,
+			 WriterClass writerClass) :
+    m_splitKeys(splitKeys),
+    m_writerClass(writerClass),
+    m_outputs(splitKeys.size() + 1),
+    m_signals(splitKeys.size() + 1),
+    m_pending(0),
+    m_status(0),
+    m_done(0),
+    m_userCntxt(0)
+  {
+    for (auto input : inputs)
+      m_inputs.push_back(*input);
+    for (size_t i = 0; i < m_signals.size(); i++) {
+      m_signals[i].compaction = this;
+      m_signals[i].index = i;
+    }
+  }
+
+  void Compaction::run(cb done, void *userCntxt)
+  {
+    initPool(s_defaultPoolThreads);
+    m_done = done;
+    m_userCntxt = userCntxt;
+    m_pending = m_outputs.size();
+    for (size_t i = 0; i < m_outputs.size(); i++) {
+      s_pool->run([this, i] {runSubcompaction(i);});
+    }
+  }
+
+  // keys in [splitKeys[i - 1], splitKeys[i])
+  void Compaction::runSubcompaction(size_t i)
+  {
+    const UserKey *fromKey = i > 0 ? &m_splitKeys[i - 1] : 0;
+    const UserKey *toKey = i < m_splitKeys.size() ? &m_splitKeys[i] : 0;
+    std::vector<RecordReader *> readers;
+    for (auto const &input : m_inputs)
+      readers.push_back(new RecordReader(input, fromKey));
+    RecordWriter output(m_outputs[i], &m_signals[i], m_writerClass);
+    {
+      MergeIterator merge(readers, fromKey, toKey);
+      while (merge.next()) {
+	auto const &record = merge.current();
+	output.add(record.key(), record.type(), record.value());
+      }
+    }
+    for (auto reader : readers) {
+      if (reader->status() != 0) {
+	int expected = 0;
+	m_status.compare_exchange_strong(expected, reader->status());
+      }
+      delete reader;
+    }
+    // the last subcompaction to finish may complete the whole compaction
+    output.finish();
+  }
+
+  // an output is written (and durable with GroupCommit), or failed
+  void Compaction::writeDone(size_t i, DiskWriter *writer)
+  {
+    for (auto location : writer->locations())
+      m_outputs[i].locations.push_back(location);
+    if (writer->status() != 0) {
+      int expected = 0;
+      m_status.compare_exchange_strong(expected, writer->status());
+    }
+    delete writer;
+    if (--m_pending == 0) {
+      // finish syncs the journal, not on the aio completion thread
+      s_pool->run([this] {finish();});
+    }
+  }
+
+  // the syncs of the devices of the outputs
+  struct OutputSync
+  {
+    std::mutex              mutex;
+    std::condition_variable cond;
+    size_t                  pending;
+    int                     status;
+  };
+
+  static void outputSyncDone(aio_interface::AioData *aioData)
+  {
+    auto sync = (OutputSync *)aioData->userCntxt;
+    const int status = aioData->status;
+    delete aioData;
+    std::lock_guard<std::mutex> lk(sync->mutex);
+    if (status != 0 && sync->status == 0)
+      sync->status = status;
+    if (--sync->pending == 0)
+      sync->cond.notify_one();
+  }
+
+  // without GroupCommit the writers report the outputs written, not
+  // durable. an fdatasync of every device they are on, 0 or -errno
+  int Compaction::syncOutputs()
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    std::vector<bool> devices(spaceManager->nDevices());
+    for (auto const &output : m_outputs) {
+      for (auto location : output.locations)
+	devices[spaceManager->partitionDevice(location)] = true;
+    }
+    OutputSync sync;
+    sync.pending = std::count(devices.begin(), devices.end(), true);
+    sync.status = 0;
+    if (sync.pending == 0)
+      return 0;
+    {
+      aio_interface::AioBatch batch;
+      for (uint device = 0; device < devices.size(); device++) {
+	if (!devices[device])
+	  continue;
+	auto aioData = new aio_interface::AioData(0, 0, 0, &sync, outputSyncDone);
+	aioData->ioClass = aio_interface::ioFlush;
+	aioData->device = device;
+	batch.sync(aioData);
+      }
+    }
+    std::unique_lock<std::mutex> lk(sync.mutex);
+    sync.cond.wait(lk, [&sync] {return sync.pending == 0;});
+    return sync.status;
+  }
+
+  // on a pool thread
+  void Compaction::finish()
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    if (m_status == 0 && !GroupCommit::s_groupCommit) {
+      int status = syncOutputs();
+      if (status != 0)
+	m_status = status;
+    }
+    for (auto const &output : m_outputs) {
+      for (auto location : output.locations)
+	spaceManager->doneWithWrite(location);
+    }
+    if (m_status == 0) {
+      // the outputs are recorded before their inputs can be reused
+      int status = spaceManager->syncJournal();
+      if (status != 0)
+	m_status = status;
+    }
+    if (m_status != 0) {
+      // an input could not be read or an output written, the outputs are
+      // incomplete or not recorded
+      for (auto const &output : m_outputs) {
+	for (auto location : output.locations)
+	  spaceManager->freeLocation(location);
+	delete output.index;
+      }
+      m_outputs.clear();
+      m_done(this, m_userCntxt);
+      return;
+    }
+    std::vector<SortedFile> outputs;
+    for (auto const &output : m_outputs) {
+      if (output.nBlocks)
+	outputs.push_back(output);
+    }
+    m_outputs.swap(outputs);
+    for (auto const &input : m_inputs) {
+      for (auto location : input.locations)
+	spaceManager->freeLocation(location);
+    }
+    m_done(this, m_userCntxt);
+  }
+}
+}
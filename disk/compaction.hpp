@@ -0,0 +1,189 @@
+#pragma once
+#include "disk_io_manager.hpp"
+#include "../xl_index/xl_index.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+
+// merging compaction of sorted files.
+// a sorted file is a stream of records cut into DiskBlocks. every block
+// starts with the uint16 offset of the first record that starts in it
+// (s_noRecord when the block only continues a record). a record is a
+// RecordHeader, the key and the value, the key and the value may continue
+// in the next blocks but a header never does: when it does not fit the
+// rest of the block is zero (keySize 0) and the record starts in the next
+// block
+namespace rocksxl
+{
+namespace disk
+{
+  typedef xl_index::UserKey UserKey;
+
+  enum RecordType : uint8_t {
+    recordPut = 1,
+    recordUpdate,   // applies to the older versions of the key
+    recordDelete
+  };
+
+#pragma pack(push,1)
+  struct RecordHeader
+  {
+    uint16_t keySize;
+    uint8_t  type;      // RecordType
+    uint32_t valueSize;
+  };
+#pragma pack(pop)
+
+  // first key of a block, lets a reader start in the middle of a file
+  struct KeyFence
+  {
+    UserKey key;
+    size_t  blockNum;
+  };
+
+  static const uint16_t s_noRecord = 0xffff;
+  static const size_t   s_blockHeaderSize = sizeof(uint16_t);
+  static const size_t   s_fenceBlocks = 16;
+
+  struct SortedFile
+  {
+    SortedFile() : nBlocks(0), index(0) {}
+    Locations                  locations;
+    size_t                     nBlocks;
+    std::vector<KeyFence>      fences;  // ascending, one every s_fenceBlocks blocks at most
+    xl_index::IndexInterface  *index;   // block numbers are of DiskBlocks in the file
+  };
+
+  // records of a sorted file in key order, starting at the last fence
+  // below fromKey (or at the start)
+  class RecordReader
+  {
+  public:
+    RecordReader(const SortedFile &file, const UserKey *fromKey = 0);
+    ~RecordReader() {m_fetcher->terminate();}
+    // false at the end of the file, or when a read failed
+    bool              next();
+    // 0, or the error of the failed read
+    int               status() const {return m_fetcher->status();}
+    const UserKey     &key() const {return m_key;}
+    RecordType        type() const {return m_type;}
+    const std::string &value() const {return m_value;}
+  private:
+    bool              nextBlock();
+    bool              read(char *to, size_t size);
+  private:
+    DiskFetcher      *m_fetcher;
+    DiskBlockPtr      m_block;
+    size_t            m_pos;
+    size_t            m_blocksLeft;
+    UserKey           m_key;
+    RecordType        m_type;
+    std::string       m_value;
+  };
+
+  // newest version first merge of the readers, inputs[0] is the newest.
+  // versions of a key are returned up to and including the first one that
+  // is not an update
+  class MergeIterator
+  {
+  public:
+    MergeIterator(std::vector<RecordReader *> &inputs,
+		  const UserKey *fromKey, const UserKey *toKey);
+    // false when there are no more records below toKey
+    bool              next();
+    const RecordReader &current() const {return *m_inputs[m_current];}
+  private:
+    void              push(size_t input);
+    struct Greater
+    {
+      const std::vector<RecordReader *> *inputs;
+      bool operator () (size_t a, size_t b) const {
+	auto const &ka = (*inputs)[a]->key();
+	auto const &kb = (*inputs)[b]->key();
+	return kb < ka || (!(ka < kb) && a > b);
+      }
+    };
+  private:
+    std::vector<RecordReader *>                               &m_inputs;
+    const UserKey                                             *m_fromKey;
+    const UserKey                                             *m_toKey;
+    std::priority_queue<size_t, std::vector<size_t>, Greater>  m_heap;
+    size_t                                                     m_current;
+    bool                                                       m_advance;
+    bool                                                       m_hasLastKey;
+    bool                                                       m_keyDone; // final version of m_lastKey seen
+    UserKey                                                    m_lastKey;
+  };
+
+  // appends records to a streaming DiskWriter, the index and the fences
+  // of the file are built on the way
+  class RecordWriter
+  {
+  public:
+    RecordWriter(SortedFile &file, WriteSignal *signal, WriterClass writerClass);
+    DiskWriter *writer() const {return m_writer;}
+    void add(const UserKey &key, RecordType type, const std::string &value);
+    // builds the index and seals the writer, the file may not be touched after
+    void finish();
+  private:
+    void write(const char *from, size_t size);
+    void newBlock();
+  private:
+    SortedFile                                                        &m_file;
+    DiskWriter                                                        *m_writer;
+    DiskBlockPtr                                                       m_block;
+    size_t                                                             m_pos;
+    size_t                                                             m_blockNum;
+    std::vector<UserKey>                                               m_keys;      // indexed, ascending
+    std::vector<xl_index::ObjectLocationInfo>                          m_locations; // of m_keys
+  };
+
+  // merge of the input files into new files, split in key ranges that run
+  // as parallel subcompactions on a thread pool. the input partitions are
+  // freed only after the outputs are durable (and journaled when the space
+  // manager has a journal), then done is called
+  class Compaction
+  {
+  public:
+    typedef void (*cb)(Compaction *, void *userCntxt);
+    // inputs - newest first. splitKeys - ascending, n keys make n + 1
+    // subcompactions
+    Compaction(const std::vector<const SortedFile *> &inputs,
+	       const std::vector<UserKey> &splitKeys,
+	       WriterClass writerClass = writerCompaction);
+    void run(cb done, void *userCntxt);
+    // valid once done is called, files of no records are dropped
+    std::vector<SortedFile> &outputs() {return m_outputs;}
+    // 0, or the error of a failed input read, output write or sync. the
+    // inputs are then kept and there are no outputs
+    int                     status() const {return m_status;}
+
+    // threads of the pool that runs the subcompactions, before the first
+    // run. they are spread over the NUMA nodes, see numa.hpp
+    static void initPool(uint nThreads);
+  private:
+    // the writer of output index reports to its own signal
+    struct OutputSignal : public WriteSignal
+    {
+      Compaction *compaction;
+      size_t      index;
+      void writeDone(DiskWriter *writer) {compaction->writeDone(index, writer);}
+    };
+    void runSubcompaction(size_t i);
+    void writeDone(size_t i, DiskWriter *writer);
+    int  syncOutputs();
+    void finish();
+  private:
+    std::vector<SortedFile>         m_inputs;
+    std::vector<UserKey>            m_splitKeys;
+    WriterClass                     m_writerClass;
+    std::vector<SortedFile>         m_outputs;
+    std::vector<OutputSignal>       m_signals;  // of the outputs
+    std::atomic<size_t>             m_pending;
+    std::atomic<int>                m_status;
+    cb                              m_done;
+    void                           *m_userCntxt;
+  };
+}
+}
@@ -0,0 +1,174 @@
+#include "compression.hpp"
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // LZ77 in the LZ4 style: sequences of a token, literals and a match.
+  // the token has the literal length in its high 4 bits and the match
+  // length - 4 in the low 4 bits, 15 continues with bytes of 255 and a
+  // last byte. the match is a 2 byte offset back in the output. the last
+  // sequence has literals only
+  class LzCodec : public BlockCodec
+  {
+  public:
+    size_t compress(const char *in, size_t size, char *out, size_t outSize) const;
+    bool   decompress(const char *in, size_t size, char *out, size_t outSize) const;
+  private:
+    static const size_t s_minMatch = 4;
+    static const size_t s_lastLiterals = 5;  // a match never ends closer to the end
+    static const size_t s_maxOffset = 0xffff;
+    static const int    s_hashBits = 12;
+    static bool emit(uint8_t *&op, const uint8_t *oend, const uint8_t *literals,
+		     size_t nLiterals, size_t offset, size_t matchLength);
+  };
+
+  static inline uint32_t load32(const uint8_t *p)
+  {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline void putLength(uint8_t *&op, size_t length)
+  {
+    for (; length >= 255; length -= 255)
+      *op++ = 255;
+    *op++ = length;
+  }
+
+  // a sequence, matchLength 0 for the last one. false when out is full
+  bool LzCodec::emit(uint8_t *&op, const uint8_t *oend, const uint8_t *literals,
+		     size_t nLiterals, size_t offset, size_t matchLength)
+  {
+    const size_t matchCode = matchLength ? matchLength - s_minMatch : 0;
+    const size_t need = 1 + nLiterals / 255 + 1 + nLiterals + 2 + matchCode / 255 + 1;
+    if (need > (size_t)(oend - op))
+      return false;
+    uint8_t *token = op++;
+    *token = std::min<size_t>(nLiterals, 15) << 4 | std::min<size_t>(matchCode, 15);
+    if (nLiterals >= 15)
+      putLength(op, nLiterals - 15);
+    memcpy(op, literals, nLiterals);
+    op += nLiterals;
+    if (matchLength) {
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+      if (matchCode >= 15)
+	putLength(op, matchCode - 15);
+    }
+    return true;
+  }
+
+  size_t LzCodec::compress(const char *in, size_t size, char *out, size_t outSize) const
+  {
+    const uint8_t *const base = (const uint8_t *)in;
+    const uint8_t *const iend = base + size;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *op = (uint8_t *)out;
+    const uint8_t *const oend = op + outSize;
+    if (size > s_minMatch + s_lastLiterals) {
+      const uint8_t *const matchLimit = iend - s_lastLiterals;
+      // positions + 1 of the last 4 bytes of each hash, 0 - none
+      uint32_t table[1 << s_hashBits];
+      memset(table, 0, sizeof(table));
+      while (ip + s_minMatch <= matchLimit) {
+	const uint32_t sequence = load32(ip);
+	const uint32_t hash = (sequence * 2654435761u) >> (32 - s_hashBits);
+	const uint32_t candidate = table[hash];
+	table[hash] = ip - base + 1;
+	if (candidate == 0 || ip - (base + candidate - 1) > (long)s_maxOffset ||
+	    load32(base + candidate - 1) != sequence) {
+	  // a long run of literals does not compress, skip faster through it
+	  ip += 1 + ((ip - anchor) >> 6);
+	  continue;
+	}
+	const uint8_t *match = base + candidate - 1;
+	const uint8_t *end = ip + s_minMatch;
+	for (const uint8_t *m = match + s_minMatch; end < matchLimit && *end == *m; m++)
+	  end++;
+	if (!emit(op, oend, anchor, ip - anchor, ip - match, end - ip))
+	  return 0;
+	ip = anchor = end;
+      }
+    }
+    if (!emit(op, oend, anchor, iend - anchor, 0, 0))
+      return 0;
+    return op - (uint8_t *)out;
+  }
+
+  bool LzCodec::decompress(const char *in, size_t size, char *out, size_t outSize) const
+  {
+    const uint8_t *ip = (const uint8_t *)in;
+    const uint8_t *const iend = ip + size;
+    uint8_t *const ostart = (uint8_t *)out;
+    uint8_t *op = ostart;
+    uint8_t *const oend = op + outSize;
+    auto getLength = [&](size_t &length) {
+      uint8_t b;
+      do {
+	if (ip == iend)
+	  return false;
+	b = *ip++;
+	length += b;
+      } while (b == 255);
+      return true;
+    };
+    while (ip < iend) {
+      const uint8_t token = *ip++;
+      size_t nLiterals = token >> 4;
+      if (nLiterals == 15 && !getLength(nLiterals))
+	return false;
+      if (nLiterals > (size_t)(iend - ip) || nLiterals > (size_t)(oend - op))
+	return false;
+      memcpy(op, ip, nLiterals);
+      ip += nLiterals;
+      op += nLiterals;
+      if (ip == iend)
+	break; // the last sequence
+      if (iend - ip < 2)
+	return false;
+      const size_t offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      size_t matchLength = token & 15;
+      if (matchLength == 15 && !getLength(matchLength))
+	return false;
+      matchLength += s_minMatch;
+      if (offset == 0 || offset > (size_t)(op - ostart) || matchLength > (size_t)(oend - op))
+	return false;
+      // the match may overlap its copy, 8 bytes at a time only when it can not
+      const uint8_t *match = op - offset;
+      size_t i = 0;
+      if (offset >= 8) {
+	for (; i + 8 <= matchLength; i += 8)
+	  memcpy(op + i, match + i, 8);
+      }
+      for (; i < matchLength; i++)
+	op[i] = match[i];
+      op += matchLength;
+    }
+    return op == oend;
+  }
+
+  static BlockCodec **codecs()
+  {
+    static BlockCodec *s_codecs[256] = {0, new LzCodec};
+    return s_codecs;
+  }
+
+  void BlockCodec::registerCodec(uint8_t id, BlockCodec *codec)
+  {
+    assert(id != s_none && !codecs()[id]);
+    codecs()[id] = codec;
+  }
+
+  BlockCodec *BlockCodec::codec(uint8_t id)
+  {
+    return codecs()[id];
+  }
+}
+}
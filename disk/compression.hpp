@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // block compression codecs, known by a one byte id that is kept with
+  // every compressed file. the built in LZ codec is always there, others
+  // are registered before the first file that uses them is written or read
+  class BlockCodec
+  {
+  public:
+    static const uint8_t s_none = 0;
+    static const uint8_t s_lz = 1;  // the built in LZ codec
+    static void        registerCodec(uint8_t id, BlockCodec *codec);
+    static BlockCodec *codec(uint8_t id);
+  public:
+    virtual ~BlockCodec() {}
+    // the compressed size, 0 when it does not fit in outSize
+    virtual size_t compress(const char *in, size_t size, char *out, size_t outSize) const = 0;
+    // false unless in is a valid compressed buffer of exactly outSize bytes
+    virtual bool   decompress(const char *in, size_t size, char *out, size_t outSize) const = 0;
+  };
+
+  // where the blocks of a compressed file are. the compressed blocks are
+  // packed in file order into the blocks written to disk (the file
+  // blocks), a block never spans two file blocks so a single block is one
+  // read. a block that does not compress is kept whole
+  struct PackedBlock
+  {
+    uint32_t fileBlock;
+    uint16_t offset;
+    uint16_t size;      // DiskBlock::dataSize() when not compressed
+  };
+
+  struct BlockMap
+  {
+    BlockMap() : codec(BlockCodec::s_none) {}
+    uint8_t                  codec;
+    std::vector<PackedBlock> blocks;  // by block number
+    bool   empty() const {return blocks.empty();}
+    // file blocks [first, end) hold the blocks [firstBlock, endBlock)
+    void   fileBlocks(size_t firstBlock, size_t endBlock, size_t &first, size_t &end) const {
+      first = blocks[firstBlock].fileBlock;
+      end = blocks[endBlock - 1].fileBlock + 1;
+    }
+  };
+}
+}
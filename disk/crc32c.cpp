@@ -0,0 +1,198 @@
+#include "crc32c.hpp"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace rocksxl
+{
+namespace disk
+{
+  // the crc functions below work on the raw register, crc32c() inverts it
+  typedef uint32_t (*RawCrc)(uint32_t crc, const uint8_t *data, size_t size);
+
+  static const uint32_t s_poly = 0x82f63b78; // reflected
+  // bytes of each of the three interleaved streams
+  static const size_t   s_streamBytes = 256;
+
+  struct CrcTables
+  {
+    // bytes[k][b] - the register of byte b followed by k zero bytes
+    // (slicing by 8)
+    uint32_t bytes[8][256];
+    // shift[0] moves a register over s_streamBytes zero bytes, shift[1]
+    // over twice that, one table per byte of the register
+    uint32_t shift[2][4][256];
+    CrcTables();
+  };
+
+  CrcTables::CrcTables()
+  {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++)
+	crc = crc & 1 ? (crc >> 1) ^ s_poly : crc >> 1;
+      bytes[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+      for (int b = 0; b < 256; b++)
+	bytes[k][b] = bytes[0][bytes[k - 1][b] & 0xff] ^ (bytes[k - 1][b] >> 8);
+    }
+    // the register is linear in its bits, shift each bit and combine
+    for (int s = 0; s < 2; s++) {
+      uint32_t bits[32];
+      for (int i = 0; i < 32; i++) {
+	uint32_t crc = 1u << i;
+	for (size_t n = 0; n < (s + 1) * s_streamBytes; n++)
+	  crc = bytes[0][crc & 0xff] ^ (crc >> 8);
+	bits[i] = crc;
+      }
+      for (int k = 0; k < 4; k++) {
+	for (int b = 0; b < 256; b++) {
+	  uint32_t crc = 0;
+	  for (int i = 0; i < 8; i++) {
+	    if (b & (1 << i))
+	      crc ^= bits[k * 8 + i];
+	  }
+	  shift[s][k][b] = crc;
+	}
+      }
+    }
+  }
+
+  static const CrcTables &tables()
+  {
+    static const CrcTables t;
+    return t;
+  }
+
+  static inline uint64_t load64(const uint8_t *p)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  // the register after n zero bytes, n is s_streamBytes for s 0 and twice
+  // that for s 1
+  static inline uint32_t shiftCrc(const CrcTables &t, int s, uint32_t crc)
+  {
+    return t.shift[s][0][crc & 0xff] ^ t.shift[s][1][(crc >> 8) & 0xff] ^
+      t.shift[s][2][(crc >> 16) & 0xff] ^ t.shift[s][3][crc >> 24];
+  }
+
+  static uint32_t softwareCrc(uint32_t crc, const uint8_t *p, size_t size)
+  {
+    auto const &t = tables().bytes;
+    while (size && ((uintptr_t)p & 7)) {
+      crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+      size--;
+    }
+    for (; size >= 8; p += 8, size -= 8) {
+      uint64_t v = load64(p) ^ crc;
+      crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+	t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+	t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+	t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+    }
+    while (size--)
+      crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+  }
+
+  // a crc instruction has a latency of 3 and a throughput of 1, so three
+  // streams run at a time and are combined by shifting the first two over
+  // the length of the ones that follow
+#if defined(__x86_64__)
+  __attribute__((target("sse4.2")))
+  static uint32_t sse42Crc(uint32_t crc, const uint8_t *p, size_t size)
+  {
+    while (size && ((uintptr_t)p & 7)) {
+      crc = _mm_crc32_u8(crc, *p++);
+      size--;
+    }
+    auto const &t = tables();
+    for (; size >= 3 * s_streamBytes; p += 3 * s_streamBytes, size -= 3 * s_streamBytes) {
+      uint64_t a = crc, b = 0, c = 0;
+      const uint8_t *pb = p + s_streamBytes;
+      const uint8_t *pc = pb + s_streamBytes;
+      for (size_t i = 0; i < s_streamBytes; i += 8) {
+	a = _mm_crc32_u64(a, load64(p + i));
+	b = _mm_crc32_u64(b, load64(pb + i));
+	c = _mm_crc32_u64(c, load64(pc + i));
+      }
+      crc = shiftCrc(t, 1, a) ^ shiftCrc(t, 0, b) ^ c;
+    }
+    for (; size >= 8; p += 8, size -= 8)
+      crc = _mm_crc32_u64(crc, load64(p));
+    while (size--)
+      crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+  }
+#elif defined(__aarch64__)
+  __attribute__((target("+crc")))
+  static uint32_t armv8Crc(uint32_t crc, const uint8_t *p, size_t size)
+  {
+    while (size && ((uintptr_t)p & 7)) {
+      crc = __crc32cb(crc, *p++);
+      size--;
+    }
+    auto const &t = tables();
+    for (; size >= 3 * s_streamBytes; p += 3 * s_streamBytes, size -= 3 * s_streamBytes) {
+      uint32_t a = crc, b = 0, c = 0;
+      const uint8_t *pb = p + s_streamBytes;
+      const uint8_t *pc = pb + s_streamBytes;
+      for (size_t i = 0; i < s_streamBytes; i += 8) {
+	a = __crc32cd(a, load64(p + i));
+	b = __crc32cd(b, load64(pb + i));
+	c = __crc32cd(c, load64(pc + i));
+      }
+      crc = shiftCrc(t, 1, a) ^ shiftCrc(t, 0, b) ^ c;
+    }
+    for (; size >= 8; p += 8, size -= 8)
+      crc = __crc32cd(crc, load64(p));
+    while (size--)
+      crc = __crc32cb(crc, *p++);
+    return crc;
+  }
+#endif
+
+  struct CrcImplementation
+  {
+    RawCrc      crc;
+    const char *name;
+  };
+
+  static CrcImplementation selectImplementation()
+  {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+      return CrcImplementation{sse42Crc, "sse4.2"};
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+      return CrcImplementation{armv8Crc, "armv8"};
+#endif
+    return CrcImplementation{softwareCrc, "software"};
+  }
+
+  static const CrcImplementation &implementation()
+  {
+    static const CrcImplementation impl = selectImplementation();
+    return impl;
+  }
+
+  uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+  {
+    return ~implementation().crc(~crc, (const uint8_t *)data, size);
+  }
+
+  const char *crc32cImplementation()
+  {
+    return implementation().name;
+  }
+}
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // CRC32C (Castagnoli). uses the SSE4.2 or ARMv8 CRC instructions when the
+  // cpu has them, three interleaved streams so the instruction latency is
+  // hidden, and a table driven software version otherwise.
+  // crc - the crc of the preceding data, so a buffer can be done in parts
+  uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+  // the implementation in use: "sse4.2", "armv8" or "software"
+  const char *crc32cImplementation();
+}
+}
@@ -0,0 +1,170 @@
+#include "discard.hpp"
+#include "disk_space.hpp"
+#include "../aio_interface/libaio_int.hpp"
+#include "../aio_interface/io_stats.hpp"
+#include <stdio.h>
+#include <errno.h>
+#include <thread>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace disk
+{
+  DiscardQueue *DiscardQueue::s_discardQueue;
+
+  DiscardQueue::DiscardQueue(const DiscardConfig &config) :
+    m_config(config),
+    m_pendingSlots(0),
+    m_oldest(0),
+    m_nextDevice(0),
+    m_inFlightSlots(0),
+    m_tokens(0),
+    m_lastRefill(aio_interface::nowNs()),
+    m_discardedBytes(0)
+  {
+    std::thread(&DiscardQueue::discardThread, this).detach();
+  }
+
+  void DiscardQueue::add(uint device, size_t firstSlot, size_t nSlots)
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (device >= m_ranges.size()) {
+      m_ranges.resize(device + 1);
+      m_supported.resize(device + 1, true);
+    }
+    auto &ranges = m_ranges[device];
+    size_t first = firstSlot;
+    size_t count = nSlots;
+    // merge with the range that ends at first and the one that starts at the end
+    auto next = ranges.lower_bound(first);
+    if (next != ranges.begin()) {
+      auto prev = std::prev(next);
+      assert(prev->first + prev->second <= first);
+      if (prev->first + prev->second == first) {
+	first = prev->first;
+	count += prev->second;
+	ranges.erase(prev);
+      }
+    }
+    if (next != ranges.end() && next->first == firstSlot + nSlots) {
+      count += next->second;
+      ranges.erase(next);
+    }
+    ranges[first] = count;
+    if (m_pendingSlots == 0)
+      m_oldest = aio_interface::nowNs();
+    m_pendingSlots += nSlots;
+    m_cond.notify_one();
+  }
+
+  size_t DiscardQueue::reclaim()
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    for (uint device = 0; device < m_ranges.size(); device++) {
+      for (auto const &range : m_ranges[device])
+	spaceManager->discardDone(device, range.first, range.second);
+      m_ranges[device].clear();
+    }
+    size_t ret = m_pendingSlots;
+    m_pendingSlots = 0;
+    return ret;
+  }
+
+  size_t DiscardQueue::pendingSlots() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_pendingSlots + m_inFlightSlots;
+  }
+
+  // lock is held
+  uint64_t DiscardQueue::throttleNs(uint64_t now)
+  {
+    double rate = m_config.bytesPerSecond;
+    if (rate == 0)
+      return 0;
+    m_tokens = std::min<double>(m_config.maxDiscardBytes,
+				m_tokens + rate * (now - m_lastRefill) / 1e9);
+    m_lastRefill = now;
+    if (m_tokens > 0)
+      return 0;
+    return (uint64_t)(-m_tokens / rate * 1e9) + 1;
+  }
+
+  // lock is held. the lowest range of the next device that has one, at
+  // most maxDiscardBytes
+  bool DiscardQueue::takeRange(uint &device, size_t &first, size_t &count)
+  {
+    const size_t maxSlots = std::max<size_t>(1, m_config.maxDiscardBytes /
+					     DiskSpaceManager::s_diskSpaceManager->unitSize());
+    for (uint i = 0; i < m_ranges.size(); i++) {
+      uint d = (m_nextDevice + i) % m_ranges.size();
+      auto &ranges = m_ranges[d];
+      if (ranges.empty())
+	continue;
+      auto range = ranges.begin();
+      device = d;
+      first = range->first;
+      count = std::min(range->second, maxSlots);
+      if (count < range->second)
+	ranges[first + count] = range->second - count;
+      ranges.erase(range);
+      m_nextDevice = d + 1;
+      return true;
+    }
+    return false;
+  }
+
+  void DiscardQueue::discardThread()
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (1) {
+      if (m_pendingSlots == 0) {
+	m_cond.wait(lk);
+	continue;
+      }
+      uint64_t now = aio_interface::nowNs();
+      // give the neighbours of the ranges time to be freed too
+      uint64_t due = m_oldest + m_config.batchMs * 1000000ull;
+      uint64_t wait = now < due ? due - now : throttleNs(now);
+      if (wait) {
+	m_cond.wait_for(lk, std::chrono::nanoseconds(wait));
+	continue;
+      }
+      uint device;
+      size_t first, count;
+      bool taken = takeRange(device, first, count);
+      assert(taken);
+      (void)taken;
+      m_pendingSlots -= count;
+      m_inFlightSlots += count;
+      const bool supported = m_supported[device];
+      lk.unlock();
+
+      // the space manager may be replaced (load, recover) while the thread
+      // runs, the range goes back to the current one as in reclaim
+      auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+      const size_t bytes = count * spaceManager->unitSize();
+      int ret = supported ?
+	aio_interface::Discard(device, first * spaceManager->unitSize(), bytes) : -EOPNOTSUPP;
+      if (ret != 0 && ret != -EOPNOTSUPP) {
+	// the range is reusable anyway, the device just keeps the dead data
+	printf("discard of device %u offset %zu failed %d\n", device,
+	       first * spaceManager->unitSize(), ret);
+      }
+      spaceManager->discardDone(device, first, count);
+
+      lk.lock();
+      if (ret == -EOPNOTSUPP && supported) {
+	printf("device %u does not support discard\n", device);
+	m_supported[device] = false;
+      }
+      if (ret == 0)
+	m_discardedBytes += bytes;
+      m_tokens -= bytes;
+      m_inFlightSlots -= count;
+    }
+  }
+}
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace rocksxl
+{
+namespace disk
+{
+  struct DiscardConfig
+  {
+    DiscardConfig() :
+      bytesPerSecond(0), batchMs(100), maxDiscardBytes(256ull * 1024 * 1024) {}
+    size_t bytesPerSecond;  // 0 - not limited
+    uint   batchMs;         // freed ranges wait this long to merge with their neighbours
+    size_t maxDiscardBytes; // of a single discard call
+  };
+
+  // freed partitions are discarded (TRIM) before they can be allocated
+  // again, so the device does not keep copying dead data around.
+  // DiskSpaceManager hands the units of freed partitions here instead of
+  // marking them free, a background thread merges adjacent ranges of a
+  // device, discards them at the configured rate and only then gives the
+  // units back to the space manager. a device that can not discard just
+  // has its ranges freed
+  class DiscardQueue
+  {
+  public:
+    static DiscardQueue *s_discardQueue;
+    static void init(const DiscardConfig &config = DiscardConfig()) {
+      s_discardQueue = new DiscardQueue(config);
+    }
+  public:
+    // units [firstSlot, firstSlot + nSlots) of the device
+    void   add(uint device, size_t firstSlot, size_t nSlots);
+    // the ranges waiting for their discard are free at once, not
+    // discarded. used when the disk has no free partition left, never
+    // blocks on a discard. returns the slots freed
+    size_t reclaim();
+    size_t pendingSlots() const;
+    size_t discardedBytes() const {return m_discardedBytes;}
+  private:
+    DiscardQueue(const DiscardConfig &config);
+    void   discardThread();
+    bool   takeRange(uint &device, size_t &first, size_t &count);
+    // lock is held, how long to wait for tokens, 0 when allowed
+    uint64_t throttleNs(uint64_t now);
+  private:
+    typedef std::map<size_t, size_t> Ranges; // first slot -> slots
+    DiscardConfig                  m_config;
+    mutable std::mutex             m_mutex;
+    std::condition_variable        m_cond;
+    std::vector<Ranges>            m_ranges;    // per device, merged
+    std::vector<bool>              m_supported; // per device
+    size_t                         m_pendingSlots;
+    uint64_t                       m_oldest;    // ns, add time of the oldest pending range
+    uint                           m_nextDevice;
+    size_t                         m_inFlightSlots;
+    double                         m_tokens;
+    uint64_t                       m_lastRefill;
+    std::atomic<size_t>            m_discardedBytes;
+  };
+}
+}
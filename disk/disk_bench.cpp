@@ -0,0 +1,746 @@
+// benchmark of the disk layer. worker jobs run a mix of file writes
+// (streaming DiskWriter), file scans (DiskFetcher) and point reads
+// (MultiRead) on files of a configurable size distribution, for a fixed
+// time once the disk is populated. reports per operation and per device
+// request throughput and latency, as text or json.
+// a standalone binary, built with the disk and aio_interface sources:
+//   g++ -std=c++17 -O2 -pthread -I. disk/disk_bench.cpp disk/disk_io_manager.cpp
+//     disk/disk_space.cpp disk/block_cache.cpp disk/group_commit.cpp
+//     disk/disk_block_pool.cpp disk/discard.cpp disk/crc32c.cpp disk/compression.cpp
+//     aio_interface/libaio_int.cpp aio_interface/uring_int.cpp aio_interface/io_stats.cpp
+//     aio_interface/numa.cpp -laio
+#include "disk_io_manager.hpp"
+#include "disk_space.hpp"
+#include "block_cache.hpp"
+#include "disk_block_pool.hpp"
+#include "group_commit.hpp"
+#include "discard.hpp"
+#include "crc32c.hpp"
+#include "../aio_interface/io_stats.hpp"
+#include "../aio_interface/numa.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <thread>
+#include <random>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <string>
+
+using namespace rocksxl;
+using aio_interface::Histogram;
+using aio_interface::nowNs;
+using aio_interface::Numa;
+
+namespace
+{
+  enum SizeDist {sizeFixed, sizeUniform, sizeExp, sizeNumDists};
+  const char *s_distNames[sizeNumDists] = {"fixed", "uniform", "exp"};
+
+  struct BenchConfig
+  {
+    std::vector<std::string> drives;
+    size_t   diskGB = 16;
+    bool     uring = false;
+    bool     directIo = false;
+    uint     nQueues = 1;
+    uint     seconds = 30;
+    uint     jobs = 8;
+    // the mix, relative weights of the operations
+    uint     writeWeight = 20;
+    uint     scanWeight = 30;
+    uint     pointWeight = 50;
+    size_t   fileMinMB = 8;
+    size_t   fileMaxMB = 128;
+    SizeDist sizeDist = sizeUniform;
+    uint     fetchers = 4;        // scans in flight
+    uint     writers = 2;         // file writes in flight
+    uint     writeRequests = 2;   // DiskWriteManager concurrent requests
+    size_t   writeKB = 1024;      // largest write request
+    uint     pointBlocks = 1;     // blocks of a point read
+    uint     fillPercent = 60;    // of the disk, kept by deleting old files
+    size_t   cacheMB = 0;
+    size_t   poolMB = 0;
+    std::vector<size_t> classMB;  // partition size classes, empty - the default
+    bool     groupCommit = false;
+    int      discardMBps = -1;    // -1 - freed partitions are not discarded, 0 - no limit
+    bool     checksums = false;
+    bool     compress = false;    // LZ, the blocks are filled with compressible data
+    bool     numa = false;        // queues, block pools and jobs per NUMA node
+    uint     statsSeconds = 0;    // periodic aio stats print, 0 - none
+    const char *json = 0;         // file, "-" for stdout instead of the text
+  };
+
+  BenchConfig s_config;
+
+  enum BenchOp {opWrite, opScan, opPoint, opNumOps};
+  const char *s_opNames[opNumOps] = {"write_file", "scan_file", "point_read"};
+
+  // a file on disk, its partitions are freed with the last reference
+  struct BenchFile
+  {
+    std::vector<disk::DiskPartitionId> partitions;
+    disk::Locations                    locations;
+    disk::BlockMap                     blockMap;  // when compressed
+    size_t                             nBlocks = 0;
+    ~BenchFile();
+  };
+  typedef std::shared_ptr<BenchFile> BenchFilePtr;
+
+  // space of a file, a writer of known size wastes less than a unit
+  size_t fileSpace(size_t nBlocks)
+  {
+    size_t unit = disk::DiskSpaceManager::s_diskSpaceManager->unitSize();
+    return (nBlocks * disk::s_diskBlockSize + unit - 1) / unit * unit;
+  }
+
+  // the live files, oldest first. writers make room by dropping the oldest
+  // files, readers keep the files they use alive
+  class FilePool
+  {
+  public:
+    void init(size_t limitBytes) {m_limitBytes = limitBytes;}
+    // waits until a new file fits under the fill limit
+    void reserve(size_t bytes) {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      while (m_bytes + bytes > m_limitBytes) {
+	if (m_files.empty()) {
+	  // the dropped files are still read, or the writes in flight hold
+	  // the space
+	  m_cond.wait(lk);
+	  continue;
+	}
+	// freed with the last reference, out of the lock
+	BenchFilePtr oldest;
+	oldest.swap(m_files.front());
+	m_files.pop_front();
+	lk.unlock();
+	oldest.reset();
+	lk.lock();
+      }
+      m_bytes += bytes;
+    }
+    // a file was freed
+    void release(size_t bytes) {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_bytes -= bytes;
+      m_cond.notify_all();
+    }
+    void add(const BenchFilePtr &file) {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_files.push_back(file);
+      m_cond.notify_all();
+    }
+    BenchFilePtr pick(std::mt19937_64 &rand) {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (m_files.empty())
+	return BenchFilePtr();
+      return m_files[rand() % m_files.size()];
+    }
+    bool full() {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      return m_bytes >= m_limitBytes * 9 / 10;
+    }
+    size_t size() {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      return m_files.size();
+    }
+  private:
+    std::mutex                m_mutex;
+    std::condition_variable   m_cond;
+    std::deque<BenchFilePtr>  m_files;
+    size_t                    m_bytes = 0; // of the files not freed yet and the writes in flight
+    size_t                    m_limitBytes = 0;
+  };
+
+  FilePool s_files;
+
+  BenchFile::~BenchFile()
+  {
+    for (auto partition : partitions)
+      disk::DiskSpaceManager::s_diskSpaceManager->freeLocation(partition);
+    s_files.release(fileSpace(nBlocks));
+  }
+
+  // limits the operations of a kind in flight
+  class Slots
+  {
+  public:
+    void init(uint n) {m_free = n;}
+    void get() {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      m_cond.wait(lk, [this] {return m_free > 0;});
+      m_free--;
+    }
+    void put() {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_free++;
+      m_cond.notify_one();
+    }
+  private:
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    uint                    m_free = 0;
+  };
+
+  Slots s_scanSlots;
+  Slots s_writeSlots;
+
+  struct OpStats
+  {
+    Histogram latency;  // ns
+    uint64_t  bytes = 0;
+    uint64_t  errors = 0;
+  };
+
+  struct JobStats
+  {
+    OpStats ops[opNumOps];
+  };
+
+  class WriteWait : public disk::WriteSignal
+  {
+  public:
+    WriteWait(BenchFile *file) : m_file(file), m_done(false), m_status(0) {}
+    void writeDone(disk::DiskWriter *writer) {
+      auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+      m_status = writer->status();
+      m_file->locations = writer->locations();
+      m_file->blockMap = writer->blockMap();
+      for (auto location : m_file->locations) {
+	spaceManager->doneWithWrite(location);
+	m_file->partitions.push_back(location);
+      }
+      delete writer;
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_done = true;
+      m_cond.notify_one();
+    }
+    void wait() {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      m_cond.wait(lk, [this] {return m_done;});
+    }
+    int status() const {return m_status;}
+  private:
+    BenchFile               *m_file;
+    bool                     m_done;
+    int                      m_status;
+    std::mutex               m_mutex;
+    std::condition_variable  m_cond;
+  };
+
+  // records of a few text fields and a counter, about 3x with the LZ
+  // codec. made once, so the writers do not measure the making
+  static const size_t s_compressibleBlocks = 64;
+  std::vector<char>   s_compressible;
+
+  void initCompressible()
+  {
+    static const char *regions[] = {"eu-west-1", "us-east-1", "us-west-2", "ap-south-1"};
+    static const char *states[] = {"active", "pending", "closed"};
+    std::mt19937_64 rand(1);
+    s_compressible.resize(s_compressibleBlocks * disk::s_blockDataSize);
+    size_t pos = 0;
+    for (uint64_t id = 0; pos < s_compressible.size(); id++) {
+      char record[128];
+      int n = snprintf(record, sizeof(record), "{\"id\":%lu,\"region\":\"%s\",\"state\":\"%s\","
+		       "\"score\":%lu}\n", id, regions[rand() % 4], states[rand() % 3],
+		       rand() % 100000);
+      size_t len = std::min<size_t>(n, s_compressible.size() - pos);
+      memcpy(&s_compressible[pos], record, len);
+      pos += len;
+    }
+  }
+
+  void fillCompressible(char *data, std::mt19937_64 &rand)
+  {
+    memcpy(data, &s_compressible[rand() % s_compressibleBlocks * disk::s_blockDataSize],
+	   disk::s_blockDataSize);
+  }
+
+  size_t fileBlocks(std::mt19937_64 &rand)
+  {
+    const size_t mb = 1024 * 1024;
+    size_t bytes;
+    switch (s_config.sizeDist) {
+    case sizeFixed:
+      bytes = s_config.fileMinMB * mb;
+      break;
+    case sizeExp: {
+      // mean fileMinMB, cut at fileMaxMB
+      std::exponential_distribution<double> dist(1.0 / s_config.fileMinMB);
+      bytes = std::min(dist(rand), (double)s_config.fileMaxMB) * mb;
+      break;
+    }
+    default:
+      bytes = (s_config.fileMinMB + rand() % (s_config.fileMaxMB - s_config.fileMinMB + 1)) * mb;
+    }
+    return std::max(bytes / disk::s_diskBlockSize, (size_t)1);
+  }
+
+  void writeFile(std::mt19937_64 &rand, OpStats &stats)
+  {
+    size_t nBlocks = fileBlocks(rand);
+    s_writeSlots.get();
+    s_files.reserve(fileSpace(nBlocks));
+    BenchFilePtr file(new BenchFile);
+    file->nBlocks = nBlocks;
+    WriteWait signal(file.get());
+    uint64_t start = nowNs();
+    auto writer = new disk::DiskWriter(&signal, disk::writerFlush, nBlocks,
+				       disk::DiskWriter::s_defaultWindowBlocks,
+				       s_config.compress ? disk::BlockCodec::s_lz :
+				       disk::BlockCodec::s_none);
+    for (size_t i = 0; i < nBlocks; i++) {
+      disk::DiskBlockPtr block(new disk::DiskBlock);
+      if (s_config.compress)
+	fillCompressible(block->data, rand);
+      *(uint64_t *)block->data = i;
+      writer->append(block);
+    }
+    writer->seal();
+    signal.wait();
+    stats.latency.add(nowNs() - start);
+    s_writeSlots.put();
+    if (signal.status() != 0) {
+      stats.errors++; // the file frees its partitions
+      return;
+    }
+    stats.bytes += nBlocks * disk::s_diskBlockSize;
+    s_files.add(file);
+  }
+
+  void scanFile(std::mt19937_64 &rand, OpStats &stats)
+  {
+    auto file = s_files.pick(rand);
+    if (!file)
+      return;
+    s_scanSlots.get();
+    uint64_t start = nowNs();
+    auto fetcher = new disk::DiskFetcher(file->locations, disk::cacheFillNone, 0, file->nBlocks,
+					 &file->blockMap);
+    size_t nBlocks = 0;
+    size_t bad = 0;
+    while (nBlocks < file->nBlocks) {
+      auto block = fetcher->getBlock();
+      if (!block)
+	break;
+      bad += *(uint64_t *)block->data != nBlocks;
+      nBlocks++;
+    }
+    fetcher->terminate();
+    stats.latency.add(nowNs() - start);
+    s_scanSlots.put();
+    stats.bytes += nBlocks * disk::s_diskBlockSize;
+    if (nBlocks != file->nBlocks || bad)
+      stats.errors++;
+  }
+
+  void pointRead(std::mt19937_64 &rand, OpStats &stats)
+  {
+    auto file = s_files.pick(rand);
+    if (!file)
+      return;
+    disk::MultiRead read;
+    std::vector<size_t> blocks;
+    auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+    for (uint i = 0; i < s_config.pointBlocks; i++) {
+      size_t block = rand() % file->nBlocks;
+      blocks.push_back(block);
+      if (!file->blockMap.empty())
+	block = file->blockMap.blocks[block].fileBlock;
+      size_t p = 0;
+      while (block >= spaceManager->partitionBlocks(file->partitions[p]))
+	block -= spaceManager->partitionBlocks(file->partitions[p++]);
+      read.add(file->partitions[p], block);
+    }
+    uint64_t start = nowNs();
+    read.wait();
+    stats.latency.add(nowNs() - start);
+    stats.bytes += read.size() * disk::s_diskBlockSize;
+    bool bad = read.status() != 0;
+    for (size_t i = 0; i < read.size() && !bad; i++) {
+      auto block = read.block(i);
+      if (!file->blockMap.empty()) {
+	block.reset(new disk::DiskBlock);
+	bad = !disk::unpackBlock(file->blockMap, blocks[i], *read.block(i), *block);
+      }
+      bad = bad || *(uint64_t *)block->data != blocks[i];
+    }
+    if (bad)
+      stats.errors++;
+  }
+
+  std::atomic<bool> s_stop(false);
+
+  void runJob(uint index, JobStats *stats)
+  {
+    Numa::pinThread(index % Numa::nNodes());
+    std::mt19937_64 rand(index + 1);
+    uint total = s_config.writeWeight + s_config.scanWeight + s_config.pointWeight;
+    while (!s_stop) {
+      uint r = rand() % total;
+      if (r < s_config.writeWeight)
+	writeFile(rand, stats->ops[opWrite]);
+      else if (r < s_config.writeWeight + s_config.scanWeight)
+	scanFile(rand, stats->ops[opScan]);
+      else
+	pointRead(rand, stats->ops[opPoint]);
+    }
+  }
+
+  void populate(uint index)
+  {
+    Numa::pinThread(index % Numa::nNodes());
+    std::mt19937_64 rand(1000 + index);
+    OpStats stats;
+    while (!s_files.full())
+      writeFile(rand, stats);
+  }
+
+  // results
+
+  struct Result
+  {
+    const char *name;
+    uint64_t    count;
+    uint64_t    bytes;
+    uint64_t    errors;
+    const Histogram *latency;
+  };
+
+  void printText(const std::vector<Result> &results, double seconds)
+  {
+    printf("%-12s %10s %10s %10s %10s %10s %10s %10s\n",
+	   "", "ops", "iops", "MB/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (auto const &r : results) {
+      printf("%-12s %10lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f",
+	     r.name, r.count, r.count / seconds, r.bytes / seconds / (1024 * 1024),
+	     r.latency->percentile(50) / 1000.0, r.latency->percentile(99) / 1000.0,
+	     r.latency->percentile(99.9) / 1000.0, r.latency->max() / 1000.0);
+      if (r.errors)
+	printf(" errors %lu", r.errors);
+      printf("\n");
+    }
+    for (uint node = 0; node < disk::DiskBlockPool::nNodes() && Numa::nNodes() > 1; node++) {
+      printf("node%u block pool arena %.1f MB heap %.1f MB\n", node,
+	     disk::DiskBlockPool::arenaUsedBytes(node) / (1024.0 * 1024),
+	     disk::DiskBlockPool::heapBytes(node) / (1024.0 * 1024));
+    }
+  }
+
+  void printJson(FILE *out, const std::vector<Result> &results, double seconds)
+  {
+    fprintf(out, "{\n  \"config\": {\"seconds\": %.1f, \"jobs\": %u, \"mix\": [%u, %u, %u], "
+	    "\"file_mb\": [%zu, %zu], \"size_dist\": \"%s\", \"fetchers\": %u, \"writers\": %u, "
+	    "\"write_requests\": %u, \"write_kb\": %zu, \"point_blocks\": %u, "
+	    "\"block_size\": %zu, \"devices\": %u, \"direct_io\": %s, \"uring\": %s, "
+	    "\"checksums\": \"%s\", \"compress\": %s, \"numa_nodes\": %u},\n",
+	    seconds, s_config.jobs, s_config.writeWeight, s_config.scanWeight,
+	    s_config.pointWeight, s_config.fileMinMB, s_config.fileMaxMB,
+	    s_distNames[s_config.sizeDist], s_config.fetchers, s_config.writers,
+	    s_config.writeRequests, s_config.writeKB, s_config.pointBlocks,
+	    disk::s_diskBlockSize, aio_interface::numDevices(),
+	    s_config.directIo ? "true" : "false", s_config.uring ? "true" : "false",
+	    s_config.checksums ? disk::crc32cImplementation() : "none",
+	    s_config.compress ? "true" : "false", Numa::nNodes());
+    fprintf(out, "  \"results\": {\n");
+    for (size_t i = 0; i < results.size(); i++) {
+      auto const &r = results[i];
+      fprintf(out, "    \"%s\": {\"ops\": %lu, \"iops\": %.1f, \"mb_per_sec\": %.2f, "
+	      "\"errors\": %lu, \"latency_us\": {\"avg\": %.1f, \"p50\": %.1f, "
+	      "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}%s\n",
+	      r.name, r.count, r.count / seconds, r.bytes / seconds / (1024 * 1024),
+	      r.errors, r.latency->average() / 1000.0, r.latency->percentile(50) / 1000.0,
+	      r.latency->percentile(99) / 1000.0, r.latency->percentile(99.9) / 1000.0,
+	      r.latency->max() / 1000.0, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  },\n  \"block_pool_mb\": [");
+    for (uint node = 0; node < disk::DiskBlockPool::nNodes(); node++) {
+      fprintf(out, "%s{\"arena\": %.1f, \"heap\": %.1f}", node ? ", " : "",
+	      disk::DiskBlockPool::arenaUsedBytes(node) / (1024.0 * 1024),
+	      disk::DiskBlockPool::heapBytes(node) / (1024.0 * 1024));
+    }
+    fprintf(out, "]\n}\n");
+  }
+
+  void usage(const char *name)
+  {
+    printf("usage: %s [options]\n"
+	   "  --drive PATH          device or file, repeat for several devices\n"
+	   "  --disk-gb N           size used on the devices together (%zu)\n"
+	   "  --uring               io_uring backend\n"
+	   "  --direct              O_DIRECT\n"
+	   "  --queues N            aio queues per device, 0 - one per core (%u)\n"
+	   "  --seconds N           measured run time (%u)\n"
+	   "  --jobs N              worker threads (%u)\n"
+	   "  --mix W:S:P           weights of file writes, scans and point reads (%u:%u:%u)\n"
+	   "  --file-mb MIN[:MAX]   file size, the mean for exp (%zu:%zu)\n"
+	   "  --size-dist D         fixed, uniform or exp\n"
+	   "  --fetchers N          scans in flight (%u)\n"
+	   "  --writers N           file writes in flight (%u)\n"
+	   "  --write-requests N    write requests in flight (%u)\n"
+	   "  --write-kb N          largest write request (%zu)\n"
+	   "  --point-blocks N      %zu byte blocks of a point read (%u)\n"
+	   "  --fill N              percent of the disk kept in files (%u)\n"
+	   "  --cache-mb N          block cache, 0 - none (%zu)\n"
+	   "  --pool-mb N           registered block pool, 0 - none (%zu)\n"
+	   "  --classes MB[,MB..]   partition size classes, ascending (%zu)\n"
+	   "  --group-commit        writes are done once synced\n"
+	   "  --discard MBPS        discard freed partitions, 0 - no rate limit\n"
+	   "  --checksums           per block CRC32C, verified on every read\n"
+	   "  --compress            compressed files of compressible blocks\n"
+	   "  --numa                queues, block pools and jobs per NUMA node\n"
+	   "  --stats-seconds N     print the aio stats every N seconds, 0 - none\n"
+	   "  --json FILE           json results, - for stdout\n",
+	   name, s_config.diskGB, s_config.nQueues, s_config.seconds, s_config.jobs,
+	   s_config.writeWeight, s_config.scanWeight, s_config.pointWeight,
+	   s_config.fileMinMB, s_config.fileMaxMB, s_config.fetchers, s_config.writers,
+	   s_config.writeRequests, s_config.writeKB, disk::s_diskBlockSize,
+	   s_config.pointBlocks, s_config.fillPercent, s_config.cacheMB, s_config.poolMB,
+	   disk::s_partitionSizeBytes >> 20);
+    exit(1);
+  }
+
+  void parseArgs(int argc, char **argv)
+  {
+    enum {optDrive = 256, optDiskGB, optUring, optDirect, optQueues, optSeconds,
+	  optJobs, optMix, optFileMB, optSizeDist, optFetchers, optWriters,
+	  optWriteRequests, optWriteKB, optPointBlocks, optFill, optCacheMB,
+	  optPoolMB, optClasses, optGroupCommit, optDiscard, optChecksums, optCompress, optNuma, optStatsSeconds,
+	  optJson};
+    static const struct option options[] = {
+      {"drive", required_argument, 0, optDrive},
+      {"disk-gb", required_argument, 0, optDiskGB},
+      {"uring", no_argument, 0, optUring},
+      {"direct", no_argument, 0, optDirect},
+      {"queues", required_argument, 0, optQueues},
+      {"seconds", required_argument, 0, optSeconds},
+      {"jobs", required_argument, 0, optJobs},
+      {"mix", required_argument, 0, optMix},
+      {"file-mb", required_argument, 0, optFileMB},
+      {"size-dist", required_argument, 0, optSizeDist},
+      {"fetchers", required_argument, 0, optFetchers},
+      {"writers", required_argument, 0, optWriters},
+      {"write-requests", required_argument, 0, optWriteRequests},
+      {"write-kb", required_argument, 0, optWriteKB},
+      {"point-blocks", required_argument, 0, optPointBlocks},
+      {"fill", required_argument, 0, optFill},
+      {"cache-mb", required_argument, 0, optCacheMB},
+      {"pool-mb", required_argument, 0, optPoolMB},
+      {"classes", required_argument, 0, optClasses},
+      {"group-commit", no_argument, 0, optGroupCommit},
+      {"discard", required_argument, 0, optDiscard},
+      {"checksums", no_argument, 0, optChecksums},
+      {"compress", no_argument, 0, optCompress},
+      {"numa", no_argument, 0, optNuma},
+      {"stats-seconds", required_argument, 0, optStatsSeconds},
+      {"json", required_argument, 0, optJson},
+      {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, 0)) != -1) {
+      switch (opt) {
+      case optDrive:         s_config.drives.push_back(optarg); break;
+      case optDiskGB:        s_config.diskGB = strtoul(optarg, 0, 0); break;
+      case optUring:         s_config.uring = true; break;
+      case optDirect:        s_config.directIo = true; break;
+      case optQueues:        s_config.nQueues = strtoul(optarg, 0, 0); break;
+      case optSeconds:       s_config.seconds = strtoul(optarg, 0, 0); break;
+      case optJobs:          s_config.jobs = strtoul(optarg, 0, 0); break;
+      case optMix:
+	if (sscanf(optarg, "%u:%u:%u", &s_config.writeWeight, &s_config.scanWeight,
+		   &s_config.pointWeight) != 3)
+	  usage(argv[0]);
+	break;
+      case optFileMB:
+	if (sscanf(optarg, "%zu:%zu", &s_config.fileMinMB, &s_config.fileMaxMB) == 1)
+	  s_config.fileMaxMB = s_config.fileMinMB;
+	break;
+      case optSizeDist:
+	for (uint d = 0; d <= sizeNumDists; d++) {
+	  if (d == sizeNumDists)
+	    usage(argv[0]);
+	  if (!strcmp(optarg, s_distNames[d])) {
+	    s_config.sizeDist = (SizeDist)d;
+	    break;
+	  }
+	}
+	break;
+      case optFetchers:      s_config.fetchers = strtoul(optarg, 0, 0); break;
+      case optWriters:       s_config.writers = strtoul(optarg, 0, 0); break;
+      case optWriteRequests: s_config.writeRequests = strtoul(optarg, 0, 0); break;
+      case optWriteKB:       s_config.writeKB = strtoul(optarg, 0, 0); break;
+      case optPointBlocks:   s_config.pointBlocks = strtoul(optarg, 0, 0); break;
+      case optFill:          s_config.fillPercent = strtoul(optarg, 0, 0); break;
+      case optCacheMB:       s_config.cacheMB = strtoul(optarg, 0, 0); break;
+      case optPoolMB:        s_config.poolMB = strtoul(optarg, 0, 0); break;
+      case optClasses:
+	for (char *p = optarg; *p; p += *p == ',') {
+	  char *end;
+	  s_config.classMB.push_back(strtoul(p, &end, 0));
+	  if (end == p || s_config.classMB.back() == 0)
+	    usage(argv[0]);
+	  p = end;
+	}
+	break;
+      case optGroupCommit:   s_config.groupCommit = true; break;
+      case optDiscard:       s_config.discardMBps = strtoul(optarg, 0, 0); break;
+      case optChecksums:     s_config.checksums = true; break;
+      case optCompress:      s_config.compress = true; break;
+      case optNuma:          s_config.numa = true; break;
+      case optStatsSeconds:  s_config.statsSeconds = strtoul(optarg, 0, 0); break;
+      case optJson:          s_config.json = optarg; break;
+      default:               usage(argv[0]);
+      }
+    }
+    if (s_config.writeWeight + s_config.scanWeight + s_config.pointWeight == 0 ||
+	s_config.fileMinMB == 0 || s_config.fileMaxMB < s_config.fileMinMB ||
+	s_config.fetchers == 0 || s_config.writers == 0 || s_config.jobs == 0 ||
+	s_config.pointBlocks == 0 || s_config.fillPercent == 0 || s_config.fillPercent > 90 ||
+	s_config.writeKB * 1024 < disk::s_diskBlockSize) {
+      usage(argv[0]);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  parseArgs(argc, argv);
+  const size_t diskSize = s_config.diskGB * 1024 * 1024 * 1024;
+
+  aio_interface::AioConfig aioConfig;
+  aioConfig.backend = s_config.uring ? aio_interface::AioConfig::ioUring :
+    aio_interface::AioConfig::libaio;
+  aioConfig.directIo = s_config.directIo;
+  aioConfig.nQueues = s_config.nQueues;
+  aioConfig.statsDumpSeconds = s_config.statsSeconds;
+  aioConfig.drives = s_config.drives;
+  aioConfig.numaAware = s_config.numa;
+  aio_interface::aioInit(aioConfig);
+  if (s_config.poolMB)
+    disk::DiskBlockPool::init(s_config.poolMB * 1024 * 1024);
+  disk::DiskWriteManager::init(s_config.writeRequests, s_config.writeKB * 1024);
+  disk::DiskBlock::s_checksums = s_config.checksums;
+  if (s_config.compress)
+    initCompressible();
+  disk::DiskSpaceManager::ClassSizes classSizes(1, disk::s_partitionSizeBytes);
+  if (!s_config.classMB.empty()) {
+    classSizes.clear();
+    for (auto mb : s_config.classMB)
+      classSizes.push_back(mb * 1024 * 1024);
+  }
+  disk::DiskSpaceManager::init(diskSize, aio_interface::numDevices(), classSizes);
+  if (s_config.discardMBps >= 0) {
+    disk::DiscardConfig discardConfig;
+    discardConfig.bytesPerSecond = (size_t)s_config.discardMBps * 1024 * 1024;
+    disk::DiscardQueue::init(discardConfig);
+  }
+  if (s_config.groupCommit)
+    disk::GroupCommit::init();
+  if (s_config.cacheMB)
+    disk::BlockCache::init(s_config.cacheMB * 1024 * 1024);
+  // the files in the pool and in flight, a file larger than the partitions
+  // left free would fail its write
+  s_files.init(diskSize / 100 * s_config.fillPercent);
+  s_scanSlots.init(s_config.fetchers);
+  s_writeSlots.init(s_config.writers);
+
+  // populate with writers at the write concurrency
+  {
+    std::vector<std::thread> threads;
+    for (uint i = 0; i < s_config.writers; i++)
+      threads.emplace_back(populate, i);
+    for (auto &thread : threads)
+      thread.join();
+  }
+  if (!s_config.json || strcmp(s_config.json, "-"))
+    printf("populated %zu files\n", s_files.size());
+
+  aio_interface::IoStats before, after;
+  aio_interface::IoStats::snapshot(before);
+  const uint nNodes = Numa::nNodes() > 1 ? Numa::nNodes() : 0;
+  std::unique_ptr<aio_interface::IoStats[]> nodeStats(new aio_interface::IoStats[nNodes]);
+  for (uint node = 0; node < nNodes; node++)
+    aio_interface::IoStats::nodeSnapshot(node, nodeStats[node]);
+  std::vector<std::unique_ptr<JobStats> > stats(s_config.jobs);
+  std::vector<std::thread> threads;
+  uint64_t start = nowNs();
+  for (uint i = 0; i < s_config.jobs; i++) {
+    stats[i].reset(new JobStats);
+    threads.emplace_back(runJob, i, stats[i].get());
+  }
+  sleep(s_config.seconds);
+  s_stop = true;
+  for (auto &thread : threads)
+    thread.join();
+  double seconds = (nowNs() - start) / 1e9;
+  aio_interface::IoStats::snapshot(after);
+  after.subtract(before);
+  for (uint node = 0; node < nNodes; node++) {
+    aio_interface::IoStats nodeBefore;
+    nodeBefore.merge(nodeStats[node]);
+    aio_interface::IoStats::nodeSnapshot(node, nodeStats[node]);
+    nodeStats[node].subtract(nodeBefore);
+  }
+
+  JobStats total;
+  for (auto const &s : stats) {
+    for (uint op = 0; op < opNumOps; op++) {
+      total.ops[op].latency.merge(s->ops[op].latency);
+      total.ops[op].bytes += s->ops[op].bytes;
+      total.ops[op].errors += s->ops[op].errors;
+    }
+  }
+  std::vector<Result> results;
+  for (uint op = 0; op < opNumOps; op++) {
+    auto const &o = total.ops[op];
+    results.push_back(Result{s_opNames[op], o.latency.count(), o.bytes, o.errors, &o.latency});
+  }
+  // aio requests, of the operations and of the background work they cause
+  results.push_back(Result{"device_read", after.latency[aio_interface::AioData::opRead].count(),
+			   after.bytes[aio_interface::AioData::opRead].load(), 0,
+			   &after.latency[aio_interface::AioData::opRead]});
+  results.push_back(Result{"device_write", after.latency[aio_interface::AioData::opWrite].count(),
+			   after.bytes[aio_interface::AioData::opWrite].load(), 0,
+			   &after.latency[aio_interface::AioData::opWrite]});
+  if (s_config.discardMBps >= 0) {
+    results.push_back(Result{"device_discard", after.discard.count(),
+			     after.discardBytes.load(), 0, &after.discard});
+  }
+  // the requests completed on each node
+  std::vector<std::string> nodeNames;
+  nodeNames.reserve(2 * nNodes);
+  for (uint node = 0; node < nNodes; node++) {
+    auto const &stats = nodeStats[node];
+    const auto opRead = aio_interface::AioData::opRead;
+    const auto opWrite = aio_interface::AioData::opWrite;
+    nodeNames.push_back("node" + std::to_string(node) + "_read");
+    results.push_back(Result{nodeNames.back().c_str(), stats.latency[opRead].count(),
+			     stats.bytes[opRead].load(), 0, &stats.latency[opRead]});
+    nodeNames.push_back("node" + std::to_string(node) + "_write");
+    results.push_back(Result{nodeNames.back().c_str(), stats.latency[opWrite].count(),
+			     stats.bytes[opWrite].load(), 0, &stats.latency[opWrite]});
+  }
+
+  if (!s_config.json || strcmp(s_config.json, "-"))
+    printText(results, seconds);
+  if (s_config.json) {
+    FILE *out = strcmp(s_config.json, "-") ? fopen(s_config.json, "w") : stdout;
+    if (!out) {
+      perror(s_config.json);
+      return 1;
+    }
+    printJson(out, results, seconds);
+    if (out != stdout)
+      fclose(out);
+  }
+  fflush(stdout);
+  // the aio and writer threads never exit
+  _exit(0);
+}
@@ -0,0 +1,178 @@
+#include "disk_block_pool.hpp"
+#include "disk_io_manager.hpp"
+#include "../aio_interface/libaio_int.hpp"
+#include "../aio_interface/numa.hpp"
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace disk
+{
+  using aio_interface::Numa;
+
+  static const size_t s_blockAlignment = 4096;
+  static const uint   s_maxNodes = Numa::s_maxNodes;
+  template <size_t Node>
+  using NodePool = aio_interface::ObjectPool<DiskBlock, 64, 1024, Node>;
+
+  struct NodeArena
+  {
+    char                *base;
+    size_t               size;
+    std::atomic<size_t>  used;
+    std::atomic<size_t>  heapBytes;
+  };
+  static NodeArena  s_arenas[s_maxNodes];
+  static uint       s_nNodes = 1;
+  // the heap slabs by start, to find the node of a block outside the
+  // arenas. kept only with several nodes
+  static std::mutex                                 s_heapMutex;
+  static std::map<char *, std::pair<size_t, uint> > s_heapSlabs; // size, node
+
+  static void *allocSlab(uint node, size_t bytes)
+  {
+    NodeArena &arena = s_arenas[node];
+    if (arena.base) {
+      size_t start = arena.used.fetch_add(bytes);
+      if (start + bytes <= arena.size) {
+	return arena.base + start;
+      }
+    }
+    void *ret = aligned_alloc(s_blockAlignment, bytes);
+    assert(ret);
+    arena.heapBytes += bytes;
+    if (s_nNodes > 1) {
+      // pages the heap already touched stay where they are
+      Numa::bindMemory(ret, bytes, node);
+      std::lock_guard<std::mutex> lk(s_heapMutex);
+      s_heapSlabs[(char *)ret] = std::make_pair(bytes, node);
+    }
+    return ret;
+  }
+
+  template <size_t Node>
+  static void *allocNodeSlab(size_t bytes)
+  {
+    return allocSlab(Node, bytes);
+  }
+
+  struct NodePoolOps
+  {
+    void *(*alloc)();
+    void  (*free)(void *);
+  };
+
+  template <size_t... Nodes>
+  static const NodePoolOps *makePools(std::index_sequence<Nodes...>)
+  {
+    static const NodePoolOps pools[] = {{NodePool<Nodes>::alloc, NodePool<Nodes>::free}...};
+    int unused[] = {(NodePool<Nodes>::setSlabAllocator(allocNodeSlab<Nodes>), 0)...};
+    (void)unused;
+    return pools;
+  }
+
+  static const NodePoolOps *pools()
+  {
+    static const NodePoolOps *pools = makePools(std::make_index_sequence<s_maxNodes>());
+    return pools;
+  }
+
+  static void *mapArena(size_t size, bool hugePages)
+  {
+    void *arena = MAP_FAILED;
+    if (hugePages) {
+      arena = mmap(0, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+      if (arena == MAP_FAILED) {
+	printf("no huge pages reserved for the block pool, using regular pages\n");
+      }
+    }
+    if (arena == MAP_FAILED) {
+      arena = mmap(0, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      assert(arena != MAP_FAILED);
+      if (hugePages) {
+	madvise(arena, size, MADV_HUGEPAGE);
+      }
+    }
+    return arena;
+  }
+
+  void DiskBlockPool::init(size_t capacityBytes, bool hugePages)
+  {
+    assert(!s_arenas[0].base);
+    s_nNodes = Numa::nNodes();
+    std::vector<struct iovec> nodeBuffers(s_nNodes);
+    const size_t nodeBytes = capacityBytes / s_nNodes / s_blockAlignment * s_blockAlignment;
+    for (uint node = 0; node < s_nNodes; node++) {
+      NodeArena &arena = s_arenas[node];
+      arena.base = (char *)mapArena(nodeBytes, hugePages);
+      arena.size = nodeBytes;
+      // nothing is touched yet, the pages are placed as they are first used
+      if (s_nNodes > 1)
+	Numa::bindMemory(arena.base, arena.size, node);
+      nodeBuffers[node].iov_base = arena.base;
+      nodeBuffers[node].iov_len  = arena.size;
+    }
+    aio_interface::registerBuffers(nodeBuffers);
+  }
+
+  static uint blockNode(void *block)
+  {
+    const char *p = (const char *)block;
+    for (uint node = 0; node < s_nNodes; node++) {
+      auto const &arena = s_arenas[node];
+      if (p >= arena.base && p < arena.base + arena.size)
+	return node;
+    }
+    std::lock_guard<std::mutex> lk(s_heapMutex);
+    auto it = s_heapSlabs.upper_bound((char *)p);
+    assert(it != s_heapSlabs.begin());
+    --it;
+    assert(p < it->first + it->second.first);
+    return it->second.second;
+  }
+
+  void *DiskBlockPool::alloc()
+  {
+    return pools()[s_nNodes > 1 ? Numa::currentNode() : 0].alloc();
+  }
+
+  void DiskBlockPool::free(void *block)
+  {
+    pools()[s_nNodes > 1 ? blockNode(block) : 0].free(block);
+  }
+
+  size_t DiskBlockPool::arenaUsedBytes()
+  {
+    size_t used = 0;
+    for (uint node = 0; node < s_nNodes; node++)
+      used += arenaUsedBytes(node);
+    return used;
+  }
+
+  uint DiskBlockPool::nNodes()
+  {
+    return s_nNodes;
+  }
+
+  size_t DiskBlockPool::arenaUsedBytes(uint node)
+  {
+    auto const &arena = s_arenas[node];
+    return std::min(arena.used.load(), arena.size);
+  }
+
+  size_t DiskBlockPool::heapBytes(uint node)
+  {
+    return s_arenas[node].heapBytes.load();
+  }
+}
+}
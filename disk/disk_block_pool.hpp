@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // source of the DiskBlock buffers (DiskBlock::operator new).
+  // blocks are carved from 4K aligned arenas, good for O_DIRECT, that are
+  // registered with the aio layer. without init, or once an arena is
+  // exhausted, slabs come from aligned heap memory.
+  // with NUMA enabled (AioConfig::numaAware) every node has its own arena
+  // and pool: a block comes from the node of the allocating thread and
+  // goes back to the pool of its node when freed
+  class DiskBlockPool
+  {
+  public:
+    // call after aioInit and before the first block is allocated,
+    // capacityBytes is split between the nodes
+    static void init(size_t capacityBytes, bool hugePages = false);
+    static void *alloc();
+    static void free(void *block);
+    static size_t arenaUsedBytes();
+    // the pools, one per node once init ran with NUMA enabled
+    static uint   nNodes();
+    static size_t arenaUsedBytes(uint node);
+    // slabs of the node beyond its arena
+    static size_t heapBytes(uint node);
+  };
+}
+}
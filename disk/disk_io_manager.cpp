@@ -1,98 +1,468 @@
 #include "disk_io_manager.hpp"
 #include "../aio_interface/libaio_int.hpp"
+#include "block_cache.hpp"
+#include "../aio_interface/io_stats.hpp"
+#include "../aio_interface/numa.hpp"
+#include "crc32c.hpp"
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
 namespace rocksxl
 {
 namespace disk
 {
+  bool DiskBlock::s_checksums;
 
-  DiskSyncRead::DiskSyncRead(const DiskPartitionId partition,
-			     const size_t blockNum) :
-    m_data(new DiskBlock)
+  void DiskBlock::setChecksum()
+  {
+    uint32_t crc = crc32c(data, s_blockDataSize);
+    memcpy(data + s_blockDataSize, &crc, sizeof(crc));
+  }
+
+  bool DiskBlock::checksumOk() const
+  {
+    uint32_t crc;
+    memcpy(&crc, data + s_blockDataSize, sizeof(crc));
+    return crc == crc32c(data, s_blockDataSize);
+  }
+
+  // a read that succeeded fails when one of its blocks does not match
+  // its checksum
+  static void verifyChecksums(aio_interface::AioData *data)
+  {
+    if (!DiskBlock::s_checksums || data->status != 0)
+      return;
+    const size_t nBlocks = data->size / s_diskBlockSize;
+    for (size_t i = 0; i < nBlocks; i++) {
+      auto block = (const DiskBlock *)(data->iovcnt ? data->iov[i].iov_base :
+				       (char *)data->data + i * s_diskBlockSize);
+      if (!block->checksumOk()) {
+	printf("checksum mismatch device %u offset %lu\n", data->device,
+	       data->aioLba + i * s_diskBlockSize);
+	data->status = -EBADMSG;
+	return;
+      }
+    }
+  }
+
+
+  void MultiRead::add(DiskPartitionId partition, size_t blockNum)
   {
+    m_blocks.push_back(Entry{partition, blockNum, DiskBlockPtr(), 0});
+  }
+
+  void MultiRead::submit(cb done, void *userCntxt)
+  {
+    m_callback = done;
+    m_userCntxt = userCntxt;
+    // one extra reference so completions can not finish before all the
+    // requests are queued
+    m_pending = m_blocks.size() + 1;
+    auto cache = BlockCache::s_blockCache;
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    aio_interface::AioBatch batch;
+    size_t nCached = 0;
+    for (size_t i = 0; i < m_blocks.size(); i++) {
+      auto &entry = m_blocks[i];
+      if (cache && (entry.block = cache->lookup(entry.partition, entry.blockNum,
+						  &entry.generation))) {
+	nCached++;
+	continue;
+      }
+      entry.block = DiskBlockPtr(new DiskBlock);
+      const size_t lba = spaceManager->partitionOffset(entry.partition) +
+	entry.blockNum *s_diskBlockSize ;
+      auto aioData = new aio_interface::AioData(lba, entry.block->data, s_diskBlockSize,
+						this, fetchDone);
+      aioData->device = spaceManager->partitionDevice(entry.partition);
+      aioData->userTag = i;
+      batch.read(aioData);
+    }
+    m_pending -= nCached;
+    batch.submit();
+    oneDone();
+  }
+
+  void MultiRead::wait()
+  {
+    submit(0, 0);
     std::unique_lock<std::mutex> lk(m_mutex);
-    const size_t lba = partition * s_partitionSizeBytes + blockNum *s_diskBlockSize ;
-    auto aioData = new aio_interface::AioData(lba, m_data.get(), s_diskBlockSize,
-					      this, fetchDone);   
-    aio_interface::Read(aioData);
-    m_cond.wait(lk);
+    m_cond.wait(lk, [this]{return m_done;});
+  }
+
+  void MultiRead::oneDone()
+  {
+    if (--m_pending > 0)
+      return;
+    if (m_callback) {
+      // the callback may delete us
+      m_callback(this);
+      return;
+    }
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_done = true;
+    m_cond.notify_one();
   }
 
-  void DiskSyncRead::fetchDone(aio_interface::AioData *data)
+  void MultiRead::fetchDone(aio_interface::AioData *data)
   {
-    assert(data->status == 0);
-    auto me = (DiskSyncRead *) data->userCntxt;
-    std::lock_guard<std::mutex> lk(me->m_mutex);;
+    verifyChecksums(data);
+    auto me = (MultiRead *) data->userCntxt;
+    auto &entry = me->m_blocks[data->userTag];
+    if (data->status != 0) {
+      // the blocks complete on several reaper threads
+      int expected = 0;
+      me->m_status.compare_exchange_strong(expected, data->status);
+      entry.block.reset();
+    } else if (BlockCache::s_blockCache) {
+      BlockCache::s_blockCache->insert(entry.partition, entry.blockNum, entry.block,
+				       entry.generation);
+    }
     delete data;
-    me->m_cond.notify_one();
+    me->oneDone();
+  }
+
+  class SingleRead : public MultiRead
+  {
+  public:
+    SingleRead(ReadCallback done, void *userCntxt) :
+      m_readDone(done), m_readCntxt(userCntxt) {}
+    static void readDone(MultiRead *read) {
+      auto me = (SingleRead *) read;
+      me->m_readDone(me->m_readCntxt, me->block(0));
+      delete me;
+    }
+  private:
+    ReadCallback m_readDone;
+    void        *m_readCntxt;
+  };
+
+  void readBlock(DiskPartitionId partition, size_t blockNum,
+		 ReadCallback done, void *userCntxt)
+  {
+    auto read = new SingleRead(done, userCntxt);
+    read->add(partition, blockNum);
+    read->submit(SingleRead::readDone, 0);
+  }
+
+  static void promiseDone(void *userCntxt, DiskBlockPtr block)
+  {
+    auto promise = (std::promise<DiskBlockPtr> *) userCntxt;
+    promise->set_value(block);
+    delete promise;
+  }
+
+  std::future<DiskBlockPtr> readBlock(DiskPartitionId partition, size_t blockNum)
+  {
+    auto promise = new std::promise<DiskBlockPtr>;
+    auto ret = promise->get_future();
+    readBlock(partition, blockNum, promiseDone, promise);
+    return ret;
+  }
+
+  DiskSyncRead::DiskSyncRead(const DiskPartitionId partition,
+			     const size_t blockNum)
+  {
+    MultiRead read;
+    read.add(partition, blockNum);
+    read.wait();
+    m_data = read.block(0);
+    m_status = read.status();
+  }
+
+  DiskSyncRead::DiskSyncRead(const Locations &locations,
+			     const BlockMap &blockMap,
+			     const size_t blockNum)
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    size_t fileBlock = blockMap.blocks[blockNum].fileBlock;
+    auto it = locations.begin();
+    while (fileBlock >= spaceManager->partitionBlocks(*it)) {
+      fileBlock -= spaceManager->partitionBlocks(*it);
+      it++;
+    }
+    MultiRead read;
+    read.add(*it, fileBlock);
+    read.wait();
+    m_status = read.status();
+    if (m_status == 0) {
+      m_data.reset(new DiskBlock);
+      if (!unpackBlock(blockMap, blockNum, *read.block(0), *m_data)) {
+	m_data.reset();
+	m_status = -EBADMSG;
+      }
+    }
+  }
+
+  bool unpackBlock(const BlockMap &blockMap, size_t blockNum,
+		   const DiskBlock &fileBlock, DiskBlock &block)
+  {
+    auto const &packed = blockMap.blocks[blockNum];
+    const size_t dataSize = DiskBlock::dataSize();
+    if (packed.offset + packed.size > dataSize)
+      return false;
+    const char *from = fileBlock.data + packed.offset;
+    if (packed.size == dataSize) {
+      memcpy(block.data, from, dataSize);
+    } else {
+      auto codec = BlockCodec::codec(blockMap.codec);
+      if (!codec || !codec->decompress(from, packed.size, block.data, dataSize))
+	return false;
+    }
+    // like a block read whole, the tail is its checksum
+    if (DiskBlock::s_checksums)
+      block.setChecksum();
+    return true;
   }
   
   
-  DiskFetcher::DiskFetcher(const Locations &locations) :
+  size_t              DiskFetcher::s_maxFetcherBytes = 2 * s_partitionSizeBytes;
+  size_t              DiskFetcher::s_globalBudgetBytes = 1024ull * 1024 * 1024;
+  std::atomic<size_t> DiskFetcher::s_globalBytes;
+  static const size_t s_minReadaheadBlocks = 2;
+  static const size_t s_maxRequestBlocks = aio_interface::s_maxIov;
+
+  DiskFetcher::DiskFetcher(const Locations &locations, CacheFill fill,
+			   size_t firstBlock, size_t endBlock,
+			   const BlockMap *blockMap) :
     m_locations(locations),
-    m_maxActiveRequests(1) ,
+    m_headSeq(0),
     m_activeRequests(0),
+    m_activeBlocks(0),
+    m_window(s_minReadaheadBlocks),
+    m_cacheFill(BlockCache::s_blockCache ? fill : cacheFillNone),
     m_nextFetchLocation(m_locations.cbegin(), 0),
-    m_terminated(false)
+    m_terminated(false),
+    m_status(0),
+    m_blockMap(blockMap && !blockMap->empty() ? blockMap : 0),
+    m_firstBlock(0),
+    m_endBlock(0),
+    m_firstFileBlock(0),
+    m_frontUnpacked(0)
   {
+    // the blocks come from the pool of the consumer node, keep it there
+    if (aio_interface::Numa::nNodes() > 1 && aio_interface::Numa::pinnedNode() < 0) {
+      aio_interface::Numa::pinThread(aio_interface::Numa::currentNode());
+    }
+    if (m_blockMap) {
+      // the file blocks that hold the blocks
+      m_firstBlock = firstBlock;
+      m_endBlock = std::min(endBlock, m_blockMap->blocks.size());
+      if (m_firstBlock < m_endBlock) {
+	m_blockMap->fileBlocks(m_firstBlock, m_endBlock, firstBlock, endBlock);
+      } else {
+	firstBlock = endBlock = 0;
+      }
+      m_firstFileBlock = firstBlock;
+    }
+    m_blocksLeft = endBlock > firstBlock ? endBlock - firstBlock : 0;
+    // partitions may be of different size classes
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    auto &it = m_nextFetchLocation.first;
+    while (it != m_locations.cend() && firstBlock >= spaceManager->partitionBlocks(*it)) {
+      firstBlock -= spaceManager->partitionBlocks(*it);
+      it++;
+    }
+    m_nextFetchLocation.second = it == m_locations.cend() ? 0 : firstBlock * s_diskBlockSize;
     std::unique_lock<std::mutex> lk(m_mutex);
     fetch();    
   }
 
+  DiskFetcher::~DiskFetcher()
+  {
+    s_globalBytes -= m_fetchedData.size() * s_diskBlockSize;
+  }
+
   // return empty when fetch is done!!! 
   DiskBlockPtr DiskFetcher::getBlock()
   {
     DiskBlockPtr ret;
     std::unique_lock<std::mutex> lk(m_mutex);
     do { 
-      if (!m_fetchedData.empty()) {
-	ret = m_fetchedData.front();
+      if (!m_fetchedData.empty() && m_fetchedData.front().ready) {
+	auto &front = m_fetchedData.front();
+	if (!front.block)
+	  break; // the read failed, m_status tells why
+	if (m_blockMap) {
+	  assert(m_frontUnpacked < front.unpacked.size());
+	  ret = front.unpacked[m_frontUnpacked++];
+	  if (m_frontUnpacked < front.unpacked.size())
+	    break; // more blocks are packed in the front one
+	  m_frontUnpacked = 0;
+	} else {
+	  ret = front.block;
+	}
+	if (m_cacheFill != cacheFillNone) {
+	  // the cache keeps the blocks as they are on disk
+	  BlockCache::s_blockCache->insert(front.partition, front.blockNum, front.block,
+					   front.generation, m_cacheFill);
+	}
 	m_fetchedData.pop_front();
+	m_headSeq++;
+	s_globalBytes -= s_diskBlockSize;
 	break;	  
       }
       if (m_activeRequests == 0)
 	break;
+      // the consumer waits for the disk, read further ahead
+      m_window = std::min(m_window * 2,
+			  std::max<size_t>(s_maxFetcherBytes / s_diskBlockSize,
+					   s_minReadaheadBlocks));
+      fetch();
       m_cond.wait(lk);
     } while(1);
+    if (m_fetchedData.size() - m_activeBlocks >= m_window &&
+	m_window > s_minReadaheadBlocks) {
+      // a whole window is waiting for the consumer
+      m_window /= 2;
+    }
     fetch();
     return ret;
   }
   
   
+  // lock is held
   void DiskFetcher::fetch()
   {
-    if (m_terminated)
+    if (m_terminated || m_status != 0)
       return;
-    while (m_activeRequests + m_fetchedData.size() <  m_maxActiveRequests) {
-      if (m_nextFetchLocation.first == m_locations.cend()) {
+    aio_interface::AioBatch batch;
+    while (m_fetchedData.size() <  m_window) {
+      if (m_nextFetchLocation.first == m_locations.cend() || m_blocksLeft == 0) {
 	break;
       }
-      m_activeRequests++;
-      const size_t lba = (*m_nextFetchLocation.first) *s_partitionSizeBytes + m_nextFetchLocation.second;
-      auto aioData = new aio_interface::AioData(lba, new DiskBlock, s_diskBlockSize,
+      // requests grow with the window, crossing into the next partition
+      // only when it is adjacent on the device
+      auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+      const size_t wanted = std::min(std::max<size_t>(m_window / 2, 1), s_maxRequestBlocks);
+      size_t nBlocks = (spaceManager->partitionSize(*m_nextFetchLocation.first) -
+			m_nextFetchLocation.second) / s_diskBlockSize;
+      for (auto it = m_nextFetchLocation.first; nBlocks < wanted; ) {
+	auto next = std::next(it);
+	if (next == m_locations.cend() || !spaceManager->adjacent(*it, *next))
+	  break;
+	nBlocks += spaceManager->partitionBlocks(*next);
+	it = next;
+      }
+      nBlocks = std::min(std::min(nBlocks, wanted), m_blocksLeft);
+      size_t room = m_window - m_fetchedData.size();
+      if (room < nBlocks) {
+	if (m_activeRequests > 0)
+	  break; // wait for room for a full sized request
+	nBlocks = room;
+      }
+      size_t bytes = nBlocks * s_diskBlockSize;
+      if (s_globalBytes.fetch_add(bytes) + bytes > s_globalBudgetBytes &&
+	  !m_fetchedData.empty()) {
+	// out of global budget, a fetcher with nothing buffered still progresses
+	s_globalBytes -= bytes;
+	break;
+      }
+      const DiskPartitionId partition = *m_nextFetchLocation.first;
+      // taken before the read, see BlockCache
+      uint32_t generation = m_cacheFill != cacheFillNone ?
+	BlockCache::s_blockCache->generation(partition) : 0;
+      const size_t lba = spaceManager->partitionOffset(partition) + m_nextFetchLocation.second;
+      auto aioData = new aio_interface::AioData(lba, 0, bytes,
 						  this, fetchDone);
+      aioData->device = spaceManager->partitionDevice(partition);
+      aioData->ioClass = aio_interface::ioCompaction;
+      aioData->userTag = m_headSeq + m_fetchedData.size();
+      if (nBlocks > 1) {
+	aioData->setIovCount(nBlocks);
+      }
+      for (size_t i = 0; i < nBlocks; i++) {
+	auto block = new DiskBlock;
+	if (nBlocks == 1) {
+	  aioData->data = block;
+	} else {
+	  aioData->iov[i].iov_base = block->data;
+	  aioData->iov[i].iov_len  = s_diskBlockSize;
+	}
+	m_fetchedData.push_back(FetchedBlock{DiskBlockPtr(block), false,
+					     *m_nextFetchLocation.first,
+					     (uint32_t)(m_nextFetchLocation.second / s_diskBlockSize),
+					     generation, {}});
+	m_nextFetchLocation.second += s_diskBlockSize;
+	if (m_nextFetchLocation.second >= spaceManager->partitionSize(*m_nextFetchLocation.first)) {
+	  m_nextFetchLocation.first++;
+	  m_nextFetchLocation.second=0;
+	  if (m_cacheFill != cacheFillNone && i + 1 < nBlocks)
+	    generation = BlockCache::s_blockCache->generation(*m_nextFetchLocation.first);
+	}
+      }
+      m_activeRequests++;
+      m_activeBlocks += nBlocks;
+      m_blocksLeft -= nBlocks;
       
-      aio_interface::Read(aioData);
-      m_nextFetchLocation.second += s_diskBlockSize;
-      if (m_nextFetchLocation.second >= s_partitionSizeBytes) {
-	m_nextFetchLocation.first++;
-	m_nextFetchLocation.second=0;
+      batch.read(aioData);
+    }
+    batch.submit();
+  }
+
+  // lock is not held, the block map and the range do not change. the
+  // blocks of each file block of the request, only those in the range
+  bool DiskFetcher::unpack(aio_interface::AioData *data,
+			   std::vector< std::vector<DiskBlockPtr> > &unpacked)
+  {
+    const size_t nBlocks = data->size / s_diskBlockSize;
+    // the sequence counts the file blocks from the first one fetched
+    const size_t fileBlock = m_firstFileBlock + data->userTag;
+    auto const &blocks = m_blockMap->blocks;
+    size_t b = std::lower_bound(blocks.begin() + m_firstBlock, blocks.begin() + m_endBlock,
+				fileBlock, [](const PackedBlock &packed, size_t fileBlock) {
+				  return packed.fileBlock < fileBlock;
+				}) - blocks.begin();
+    unpacked.resize(nBlocks);
+    for (size_t i = 0; i < nBlocks; i++) {
+      auto packed = (const DiskBlock *)(data->iovcnt ? data->iov[i].iov_base :
+					(char *)data->data + i * s_diskBlockSize);
+      for (; b < m_endBlock && blocks[b].fileBlock == fileBlock + i; b++) {
+	DiskBlockPtr block(new DiskBlock);
+	if (!unpackBlock(*m_blockMap, b, *packed, *block)) {
+	  printf("block %zu does not decompress\n", b);
+	  return false;
+	}
+	unpacked[i].push_back(block);
       }
     }
+    return true;
   }
 
   void DiskFetcher::fetchDone(aio_interface::AioData *data)
   {
-    assert(data->status == 0);
+    verifyChecksums(data);
     auto me = (DiskFetcher *) data->userCntxt;
+    std::vector< std::vector<DiskBlockPtr> > unpacked;
+    if (me->m_blockMap && data->status == 0 && !me->unpack(data, unpacked)) {
+      data->status = -EBADMSG;
+    }
     bool toDelete = false;
     {
       std::lock_guard<std::mutex> lk(me->m_mutex);;
+      size_t nBlocks = data->size / s_diskBlockSize;
       me->m_activeRequests--;
+      me->m_activeBlocks -= nBlocks;
       if (me->m_terminated && me->m_activeRequests == 0) {
 	toDelete = true;
       }  else {    
-	me->m_fetchedData.push_back(DiskBlockPtr((DiskBlock *)data->data));
-	me->m_cond.notify_one();
+	// requests may complete out of order, the slots keep the file order
+	size_t first = data->userTag - me->m_headSeq;
+	for (size_t i = 0; i < nBlocks; i++) {
+	  auto &fetched = me->m_fetchedData[first + i];
+	  fetched.ready = true;
+	  if (data->status != 0)
+	    fetched.block.reset();
+	  else if (me->m_blockMap)
+	    fetched.unpacked.swap(unpacked[i]);
+	}
+	if (data->status != 0 && me->m_status == 0) {
+	  // the blocks before the failed ones are still given to the consumer
+	  me->m_status = data->status;
+	}
+	if (first == 0)
+	  me->m_cond.notify_one();
       }
       delete data;
     }
@@ -116,98 +486,503 @@ namespace disk
     
 
 
+  // with checksums the last bytes of a block belong to the writer, the
+  // caller fills DiskBlock::dataSize(). a block shared beyond its owners
+  // (the caller and the writer) may be read meanwhile, by the block cache
+  // users or another writer, so the checksum goes to a private copy of it
+  static DiskBlockPtr checksummed(const DiskBlockPtr &block, long owners)
+  {
+    if (block.use_count() <= owners) {
+      block->setChecksum();
+      return block;
+    }
+    DiskBlockPtr copy(new DiskBlock);
+    memcpy(copy->data, block->data, s_blockDataSize);
+    copy->setChecksum();
+    return copy;
+  }
+
   DiskWriter::DiskWriter(FileData &dataToWrite,
-			 WriteSignal *writeSignal) :
+			 WriteSignal *writeSignal,
+			 WriterClass writerClass) :
+    m_data(dataToWrite.begin(), dataToWrite.end()),
+    m_dataBase(0),
+    m_appended(dataToWrite.size()),
+    m_lastLocationOffset(0),
+    m_dataLocation(0),
+    m_numActiveWrites(0),
+    m_inFlightBlocks(dataToWrite.size()),
+    m_windowBlocks(-1ul),
+    m_sealed(true),
+    m_queued(!dataToWrite.empty()),
+    m_finished(false),
+    m_status(0),
+    m_writeSignal(writeSignal),
+    m_nextDevice(DiskSpaceManager::s_anyDevice),
+    m_writerClass(writerClass),
+    m_codec(0),
+    m_packedBytes(0)
+  {
+    if (DiskBlock::s_checksums) {
+      // held by dataToWrite and m_data
+      for (auto &block : m_data)
+	block = checksummed(block, 2);
+    }
+    reserve(dataToWrite.size());
+    if (m_queued) {
+      DiskWriteManager::s_diskWriteManager->appendWriter(this);
+    } else {
+      finish();
+    }
+  }
+
+  DiskWriter::DiskWriter(WriteSignal *writeSignal,
+			 WriterClass writerClass,
+			 size_t expectedBlocks,
+			 size_t windowBlocks,
+			 uint8_t codec) :
+    m_dataBase(0),
+    m_appended(0),
     m_lastLocationOffset(0),
     m_dataLocation(0),
     m_numActiveWrites(0),
-    m_dataToWrite(dataToWrite),    
-    m_writeSignal(writeSignal)
+    m_inFlightBlocks(0),
+    m_windowBlocks(std::max<size_t>(windowBlocks, 1)),
+    m_sealed(false),
+    m_queued(false),
+    m_finished(false),
+    m_status(0),
+    m_writeSignal(writeSignal),
+    m_nextDevice(DiskSpaceManager::s_anyDevice),
+    m_writerClass(writerClass),
+    m_codec(BlockCodec::codec(codec)),
+    m_packedBytes(0)
+  {
+    assert(codec == BlockCodec::s_none || m_codec);
+    m_blockMap.codec = codec;
+    if (m_codec) {
+      m_compressed.resize(s_diskBlockSize);
+    } else {
+      reserve(expectedBlocks);
+    }
+  }
+
+  void DiskWriter::reserve(size_t nBlocks)
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    if (nBlocks * s_diskBlockSize > spaceManager->unitSize()) {
+      // otherwise the partitions are taken one at a time as the data is written
+      spaceManager->getFreeExtent(nBlocks * s_diskBlockSize, m_reserved);
+    }
+  }
+
+  // lock is held. room left in the current partition, or the size of the
+  // next one: the reserved partition, or a class that grows with the file
+  // so an unknown size does not cost many small partitions
+  size_t DiskWriter::partitionRoom() const
+  {
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    if (m_lastLocationOffset > 0)
+      return spaceManager->partitionSize(m_locations.back()) - m_lastLocationOffset;
+    if (!m_reserved.empty())
+      return spaceManager->partitionSize(m_reserved.front());
+    return spaceManager->classSize(nextClass());
+  }
+
+  // lock is held. a full request, the end of the partition or the last
+  // blocks of a sealed file
+  bool DiskWriter::ready() const
+  {
+    size_t pending = m_appended - m_dataLocation;
+    if (m_sealed || pending == 0)
+      return pending > 0;
+    size_t full = std::min(DiskWriteManager::s_diskWriteManager->maxBlocksPerWrite(),
+			   partitionRoom() / s_diskBlockSize);
+    return pending >= std::min(full, m_windowBlocks);
+  }
+
+  void DiskWriter::append(const DiskBlockPtr &block)
+  {
+    if (m_codec)
+      pack(block);
+    else
+      appendFileBlock(block);
+  }
+
+  // on the producer thread. the block goes compressed to the file block
+  // being filled, or whole when it does not compress
+  void DiskWriter::pack(const DiskBlockPtr &block)
+  {
+    const size_t dataSize = DiskBlock::dataSize();
+    const char *from = m_compressed.data();
+    size_t size = m_codec->compress(block->data, dataSize,
+				    m_compressed.data(), dataSize - 1);
+    if (size == 0) {
+      from = block->data;
+      size = dataSize;
+    }
+    if (m_packing && m_packedBytes + size > dataSize) {
+      flushPacked();
+    }
+    if (!m_packing) {
+      m_packing.reset(new DiskBlock);
+      m_packedBytes = 0;
+    }
+    memcpy(m_packing->data + m_packedBytes, from, size);
+    // only the producer appends, m_appended is the number of the packing block
+    m_blockMap.blocks.push_back(PackedBlock{(uint32_t)m_appended, (uint16_t)m_packedBytes,
+					    (uint16_t)size});
+    m_packedBytes += size;
+  }
+
+  void DiskWriter::flushPacked()
+  {
+    memset(m_packing->data + m_packedBytes, 0, DiskBlock::dataSize() - m_packedBytes);
+    appendFileBlock(m_packing);
+    m_packing.reset();
+  }
+
+  void DiskWriter::appendFileBlock(const DiskBlockPtr &block)
+  {
+    // on the producer thread, outside the lock. held by the caller
+    DiskBlockPtr own = DiskBlock::s_checksums ? checksummed(block, 1) : block;
+    bool enqueue = false;
+    {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      assert(!m_sealed);
+      m_windowCond.wait(lk, [this] {return m_inFlightBlocks < m_windowBlocks;});
+      m_data.push_back(own);
+      m_appended++;
+      m_inFlightBlocks++;
+      if (!m_queued && ready()) {
+	m_queued = enqueue = true;
+      }
+    }
+    if (enqueue) {
+      DiskWriteManager::s_diskWriteManager->appendWriter(this);
+    }
+  }
+
+  void DiskWriter::seal()
+  {
+    if (m_packing) {
+      flushPacked();
+    }
+    bool enqueue = false;
+    bool done = false;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      assert(!m_sealed);
+      m_sealed = true;
+      if (!m_queued && ready()) {
+	m_queued = enqueue = true;
+      }
+      done = finished() && !m_finished;
+      m_finished |= done;
+    }
+    if (enqueue) {
+      DiskWriteManager::s_diskWriteManager->appendWriter(this);
+    }
+    if (done) {
+      finish();
+    }
+  }
+
+  void DiskWriter::finish()
   {
-    DiskWriteManager::s_diskWriteManager->appendWriter(this);
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    // the size was over estimated
+    DiskPartitionId partition;
+    while (m_reserved.tryPopLocation(partition)) {
+      spaceManager->writeAborted(partition);
+    }
+    // a failed write is not synced, the file is lost anyway
+    if (GroupCommit::s_groupCommit && !m_locations.empty() && m_status == 0) {
+      GroupCommit::s_groupCommit->sync(this);
+    } else {
+      m_writeSignal->writeDone(this);
+    }
+  }
+
+  void DiskWriter::syncDone(int status)
+  {
+    if (status != 0)
+      m_status = status;
+    m_writeSignal->writeDone(this);
+  }
+
+  void DiskWriter::writeDone(size_t firstBlock, size_t nBlocks, int status)
+  {
+    bool done = false;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      assert(m_numActiveWrites > 0);
+      m_numActiveWrites--;
+      if (status != 0 && m_status == 0)
+	m_status = status;
+      // written blocks are released in file order
+      for (size_t i = firstBlock; i < firstBlock + nBlocks; i++) {
+	m_data[i - m_dataBase].reset();
+      }
+      while (!m_data.empty() && m_dataBase < m_dataLocation && !m_data.front()) {
+	m_data.pop_front();
+	m_dataBase++;
+      }
+      m_inFlightBlocks -= nBlocks;
+      m_windowCond.notify_all();
+      done = finished() && !m_finished;
+      m_finished |= done;
+    }
+    if (done) {
+      finish();
+    }
   }
 
   void DiskWriter::getNextBlockForWrite(aio_interface::AioData &aioData,
+					size_t maxBlocks,
 					bool &lastDataForLoaction,
 					bool &lastData)
   {
-    assert( m_dataLocation < m_dataToWrite.size());
+    std::lock_guard<std::mutex> lk(m_mutex);
+    assert( m_dataLocation < m_appended);
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
     if (m_lastLocationOffset == 0) {
-      m_locations.push_back(DiskSpaceManager::s_diskSpaceManager
-			    ->getFreePlace());
+      if (!m_reserved.empty()) {
+	m_locations.push_back(m_reserved.popLocation());
+      } else {
+	// consecutive partitions go to different devices
+	m_locations.push_back(spaceManager->getFreePlace(m_nextDevice, nextClass()));
+      }
+      if (BlockCache::s_blockCache) {
+	// blocks of the previous owner of the partition
+	BlockCache::s_blockCache->erasePartition(m_locations.back());
+      }
+      m_nextDevice = (spaceManager->partitionDevice(m_locations.back()) + 1) %
+	spaceManager->nDevices();
     } 
-    aioData.aioLba = m_locations.back() * s_partitionSizeBytes + m_lastLocationOffset;
-    aioData.data = const_cast<char *>( m_dataToWrite[m_dataLocation]->data);
-    aioData.size = s_diskBlockSize;
-    m_dataLocation++;
-    m_lastLocationOffset += s_diskBlockSize;
-    if (m_lastLocationOffset >= s_partitionSizeBytes) {
+    aioData.aioLba = spaceManager->partitionOffset(m_locations.back()) + m_lastLocationOffset;
+    aioData.device = spaceManager->partitionDevice(m_locations.back());
+    aioData.userTag = m_dataLocation;
+    const size_t partitionSize = spaceManager->partitionSize(m_locations.back());
+    size_t nBlocks = std::min(maxBlocks,
+			      std::min((partitionSize - m_lastLocationOffset) / s_diskBlockSize,
+				       m_appended - m_dataLocation));
+    const size_t first = m_dataLocation - m_dataBase;
+    if (nBlocks == 1) {
+      aioData.data = const_cast<char *>( m_data[first]->data);
+    } else {
+      // the blocks are contiguous on disk, write them straight from the file data
+      aioData.data = 0;
+      aioData.setIovCount(nBlocks);
+      for (size_t i = 0; i < nBlocks; i++) {
+	aioData.iov[i].iov_base = const_cast<char *>( m_data[first + i]->data);
+	aioData.iov[i].iov_len  = s_diskBlockSize;
+      }
+    }
+    aioData.size = nBlocks * s_diskBlockSize;
+    m_dataLocation += nBlocks;
+    m_lastLocationOffset += nBlocks * s_diskBlockSize;
+    if (m_lastLocationOffset >= partitionSize) {
       m_lastLocationOffset  = 0;
       lastDataForLoaction = true;
     } else {
       lastDataForLoaction = false;
     }	
-    lastData = 	m_dataLocation == m_dataToWrite.size();
+    lastData = !ready();
+    if (lastData) {
+      m_queued = false;
+    }
   }
   
   DiskWriteManager *DiskWriteManager::s_diskWriteManager;
 
+  DiskWriteManager::DiskWriteManager(size_t concurentWrites, size_t maxWriteBytes) :
+    m_maxConcurentWrites(concurentWrites),
+    m_maxBlocksPerWrite(std::max<size_t>(1, std::min(maxWriteBytes / s_diskBlockSize,
+						     s_maxRequestBlocks))),
+    m_backgroundWrites(0),
+    m_virtualTime(0),
+    m_numActiveWrites(0),
+    m_numWriters(0),
+    m_throttleUntil(0)
+  {
+    const WriterClassConfig defaults[writerNumClasses] = {
+      {0, 1, concurentWrites, 0}, // writerFlush
+      {1, 3, concurentWrites, 0}, // writerL0Compaction
+      {1, 1, concurentWrites, 0}, // writerCompaction
+    };
+    for (int c = 0; c < writerNumClasses; c++) {
+      auto &state = m_classes[c];
+      state.config = defaults[c];
+      state.curLocation = state.writers.end();
+      state.numActiveWrites = 0;
+      state.virtualTime = 0;
+      state.tokens = 0;
+      state.lastRefill = aio_interface::nowNs();
+    }
+    std::thread(&DiskWriteManager::throttleThread, this).detach();
+  }
+
+  void DiskWriteManager::setClassConfig(WriterClass writerClass,
+					const WriterClassConfig &config)
+  {
+    assert(config.weight > 0 && config.maxConcurrent > 0);
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_classes[writerClass].config = config;
+    scheduleWrites();
+  }
+
   void DiskWriteManager::appendWriter(DiskWriter *diskWriter)
   {
     std::lock_guard<std::mutex> lk(m_mutex);    
-    m_writers.push_back(diskWriter);
-    if (m_writers.size() == 1) {
-      m_curLocation = m_writers.begin();
+    auto &state = m_classes[diskWriter->writerClass()];
+    if (state.writers.empty()) {
+      // an idle class does not get to catch up on the time it had no work
+      state.virtualTime = std::max(state.virtualTime, m_virtualTime);
     }
-    if (m_numActiveWrites < m_maxConcurentWrites) {
-      scheduleWrites();
+    state.writers.push_back(diskWriter);
+    if (state.writers.size() == 1) {
+      state.curLocation = state.writers.begin();
     }
+    m_numWriters++;
+    scheduleWrites();
+  }
+
+  // lock is held. refill the token bucket, a write may take the bucket
+  // into debt so the burst is one write
+  bool DiskWriteManager::rateAllows(ClassState &state, uint64_t now)
+  {
+    double rate = state.config.bytesPerSecond;
+    if (rate == 0)
+      return true;
+    double burst = m_maxBlocksPerWrite * s_diskBlockSize;
+    state.tokens = std::min(burst, state.tokens + rate * (now - state.lastRefill) / 1e9);
+    state.lastRefill = now;
+    if (state.tokens > 0)
+      return true;
+    uint64_t until = now + (uint64_t)(-state.tokens / rate * 1e9) + 1;
+    if (m_throttleUntil == 0 || until < m_throttleUntil) {
+      m_throttleUntil = until;
+      m_throttleCond.notify_one();
+    }
+    return false;
+  }
+
+  // lock is held. the class to serve next or -1
+  int DiskWriteManager::pickClass(uint64_t now)
+  {
+    int ret = -1;
+    for (int c = 0; c < writerNumClasses; c++) {
+      auto &state = m_classes[c];
+      auto const &config = state.config;
+      if (state.writers.empty() ||
+	  state.numActiveWrites >= config.maxConcurrent ||
+	  (config.priority > 0 && m_backgroundWrites >= m_maxConcurentWrites)) {
+	continue;
+      }
+      if (ret >= 0) {
+	auto const &best = m_classes[ret];
+	if (config.priority > best.config.priority ||
+	    (config.priority == best.config.priority &&
+	     state.virtualTime >= best.virtualTime)) {
+	  continue;
+	}
+      }
+      if (!rateAllows(state, now))
+	continue;
+      ret = c;
+    }
+    return ret;
   }
 
   //lock is held
   void DiskWriteManager::scheduleWrites()
   {    
-    while (!m_writers.empty() && m_numActiveWrites < m_maxConcurentWrites) {
-      if (m_curLocation == m_writers.end()) {
-	m_curLocation = m_writers.begin();
+    aio_interface::AioBatch batch;
+    uint64_t now = aio_interface::nowNs();
+    int c;
+    while ((c = pickClass(now)) >= 0) {
+      auto &state = m_classes[c];
+      if (state.curLocation == state.writers.end()) {
+	state.curLocation = state.writers.begin();
       }      
-      auto aioData = new aio_interface::AioData(0,0,0,*m_curLocation,writeDone);
+      auto aioData = new aio_interface::AioData(0,0,0,*state.curLocation,writeDone);
+      aioData->ioClass = c == writerFlush ? aio_interface::ioFlush : aio_interface::ioCompaction;
       bool lastDataForLoaction = false;
       bool lastData = false;
-      (*m_curLocation)->getNextBlockForWrite(*aioData, lastDataForLoaction, lastData);
-      (*m_curLocation)->newWrite();
+      (*state.curLocation)->newWrite();
+      (*state.curLocation)->getNextBlockForWrite(*aioData, m_maxBlocksPerWrite,
+						 lastDataForLoaction, lastData);
       if (lastData) {
-	auto tmp = m_curLocation;
-	m_curLocation++;
-	m_writers.erase(tmp);
+	auto tmp = state.curLocation;
+	state.curLocation++;
+	state.writers.erase(tmp);
+	m_numWriters--;
       } else {
 	if (lastDataForLoaction) {
-	  m_curLocation++;
+	  state.curLocation++;
 	}
       }
+      state.numActiveWrites++;
+      state.virtualTime += (double)aioData->size / state.config.weight;
+      m_virtualTime = state.virtualTime;
+      if (state.config.bytesPerSecond)
+	state.tokens -= aioData->size;
+      if (state.config.priority > 0)
+	m_backgroundWrites++;
       m_numActiveWrites++;
-      aio_interface::Write(aioData);
+      batch.write(aioData);
     }
+    batch.submit();
   }
 
   void DiskWriteManager::writeDone(aio_interface::AioData *aioData)    
   {
     DiskWriter *diskWriter = (DiskWriter *)aioData->userCntxt;
-    diskWriter->writeDone();
+    // the writer may be gone once it reports its last write
+    WriterClass writerClass = diskWriter->writerClass();
+    diskWriter->writeDone(aioData->userTag, aioData->size / s_diskBlockSize, aioData->status);
     std::lock_guard<std::mutex> lk(s_diskWriteManager->m_mutex);    
+    auto &state = s_diskWriteManager->m_classes[writerClass];
+    state.numActiveWrites--;
+    if (state.config.priority > 0)
+      s_diskWriteManager->m_backgroundWrites--;
     s_diskWriteManager->m_numActiveWrites--;
-    if (!s_diskWriteManager->m_writers.empty()) {
-      s_diskWriteManager->scheduleWrites();
-    }
+    s_diskWriteManager->scheduleWrites();
     delete aioData;
   }
 
+  // rate limited classes with nothing in flight are scheduled from here
+  void DiskWriteManager::throttleThread()
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (1) {
+      if (m_throttleUntil == 0) {
+	m_throttleCond.wait(lk);
+	continue;
+      }
+      uint64_t now = aio_interface::nowNs();
+      if (now < m_throttleUntil) {
+	m_throttleCond.wait_for(lk, std::chrono::nanoseconds(m_throttleUntil - now));
+	continue;
+      }
+      m_throttleUntil = 0;
+      scheduleWrites();
+    }
+  }
+
 }
 }
 
 #ifdef DISK_IO_UTESTS
+#include "write_ahead_log.hpp"
+#include "discard.hpp"
+#include "compaction.hpp"
+#include "../xl_index/memtable.hpp"
+#include <map>
 #include <thread>
 #include <unistd.h>
+#include <fcntl.h>
 
 using namespace rocksxl;
 struct test_file
@@ -226,6 +1001,7 @@ public:
   {
   }
   void writeDone(disk::DiskWriter *writer) {
+    assert(writer->status() == 0);
     auto &f = test_files[m_index];
     f.file_chunks = writer->locations();
     auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
@@ -297,7 +1073,13 @@ void runCompact(std::vector<size_t> filesToCompact,
     prefechedBlock[i] = fetchers[i]->getBlock();
   }
   
-  std::vector< disk::DiskBlockPtr >compactOutput;
+  while (nWriters  > 32) {
+    usleep(1);
+  }
+  nWriters++;
+  // the output is written while it is produced
+  auto diskWriter = new disk::DiskWriter(new UtestCompactWriteDone(targetFile, filesToCompact),
+					 disk::writerCompaction);
   size_t count = fetchers.size()*16* disk::s_nBlocksInPartition;
   for (size_t j=0; j<count; j++)   {
     // randomly select a block from the fetched
@@ -310,17 +1092,12 @@ void runCompact(std::vector<size_t> filesToCompact,
       } else {
 	// to get back about the same size we use rand() % fetchers.size...
 	if (rand() % fetchers.size() == 0) {
-	  compactOutput.push_back(block);
+	  diskWriter->append(block);
 	}
       }
     }
   }
-  
-  while (nWriters  > 32) {
-    usleep(1);
-  }
-  nWriters++;
-  auto diskWriter = new disk::DiskWriter(compactOutput, new UtestCompactWriteDone(targetFile, filesToCompact));
+  diskWriter->seal();
   for (auto f : fetchers) {
     if (f)
       f->terminate();
@@ -389,12 +1166,1089 @@ void threadRun()
   }
 }
 
+// single slots, aligned runs and the allocated bitmap round trip
+void testPartitionBitmap()
+{
+  const size_t nSlots = 200; // the last word is partial
+  disk::PartitionBitmap bitmap;
+  bitmap.resize(nSlots);
+  assert(bitmap.freeSlots() == 0);
+  bitmap.setFree(0, nSlots);
+  std::vector<bool> taken(nSlots);
+  size_t slot;
+  for (size_t i = 0; i < nSlots; i++) {
+    bool ok = bitmap.allocate(slot);
+    assert(ok && slot < nSlots && !taken[slot]);
+    taken[slot] = true;
+    (void)ok;
+  }
+  bool ok = bitmap.allocate(slot);
+  assert(!ok && bitmap.freeSlots() == 0);
+
+  // free every other run of 16, an aligned run of 8 comes from them
+  for (size_t first = 0; first + 16 <= nSlots; first += 32)
+    bitmap.setFree(first, 16);
+  size_t first;
+  ok = bitmap.allocateRun(8, first, 8);
+  assert(ok && first % 8 == 0);
+  for (size_t s = first; s < first + 8; s++)
+    assert(!bitmap.isFree(s));
+  // no free run of 17
+  ok = bitmap.allocateRun(17, first);
+  assert(!ok);
+  (void)ok;
+
+  bitmap.setAllocated(40, 3, true);
+  assert(bitmap.isAllocated(40) && bitmap.isAllocated(42) && !bitmap.isAllocated(43));
+  std::vector<uint64_t> words(bitmap.nWords());
+  bitmap.saveAllocated(words.data());
+  disk::PartitionBitmap loaded;
+  loaded.resize(nSlots);
+  loaded.loadAllocated(words.data());
+  assert(loaded.freeSlots() == nSlots - 3);
+  assert(!loaded.isFree(41) && loaded.isAllocated(41) && loaded.isFree(43));
+
+  disk::FreeSpaceStats stats = {0, 0, 0, 0};
+  loaded.addStats(stats);
+  assert(stats.freePartitions == nSlots - 3 && stats.freeExtents == 2 &&
+	 stats.largestExtent == nSlots - 43);
+  printf("partition bitmap ok\n");
+}
+
+static uint64_t journalGeneration(const std::string &journalPath)
+{
+  uint64_t generation = 0;
+  FILE *f = fopen(journalPath.c_str(), "r");
+  assert(f);
+  size_t n = fread(&generation, sizeof(generation), 1, f);
+  assert(n == 1);
+  (void)n;
+  fclose(f);
+  return generation;
+}
+
+// a journal of generation that frees id, as a crash would leave it
+static void writeJournal(const std::string &journalPath, uint64_t generation,
+			 disk::DiskPartitionId id)
+{
+  const uint32_t record = (2u << 30) | id; // journalFreed
+  FILE *f = fopen(journalPath.c_str(), "w");
+  assert(f);
+  fwrite(&generation, sizeof(generation), 1, f);
+  fwrite(&record, sizeof(record), 1, f);
+  fclose(f);
+}
+
+// checkpoint plus journal recovery. a journal left by a checkpoint that
+// did not restart it has the previous generation and is ignored
+void testSpaceJournal()
+{
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "/tmp/utest_space_%d", getpid());
+  const std::string checkpointPath = std::string(prefix) + ".checkpoint";
+  const std::string journalPath = std::string(prefix) + ".journal";
+  unlink(checkpointPath.c_str());
+  unlink(journalPath.c_str());
+  const size_t diskSize = 64 * disk::s_partitionSizeBytes;
+  disk::DiskSpaceManager::recover(checkpointPath, journalPath, diskSize, 2);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  auto a = spaceManager->getFreePlace();
+  auto b = spaceManager->getFreePlace();
+  auto c = spaceManager->getFreePlace();
+  (void)c;
+  spaceManager->doneWithWrite(a);
+  spaceManager->doneWithWrite(b);
+  spaceManager->freeLocation(a);
+  int ret = spaceManager->syncJournal();
+  // only reused once the record is synced
+  assert(ret == 0 && spaceManager->status(a) == disk::DiskPartition::freeSpace);
+
+  disk::DiskSpaceManager::recover(checkpointPath, journalPath, diskSize, 2);
+  spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  assert(spaceManager->nDevices() == 2);
+  assert(spaceManager->status(a) == disk::DiskPartition::freeSpace);
+  assert(spaceManager->status(b) == disk::DiskPartition::allocated);
+  assert(spaceManager->status(c) == disk::DiskPartition::freeSpace); // was in write
+  assert(spaceManager->freeSpaceSize() == diskSize - disk::s_partitionSizeBytes);
+
+  // a stale journal does not free b
+  uint64_t generation = journalGeneration(journalPath);
+  writeJournal(journalPath, generation - 1, b);
+  disk::DiskSpaceManager::recover(checkpointPath, journalPath, diskSize, 2);
+  spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  assert(spaceManager->status(b) == disk::DiskPartition::allocated);
+
+  // the journal of the checkpoint does
+  generation = journalGeneration(journalPath);
+  writeJournal(journalPath, generation, b);
+  disk::DiskSpaceManager::recover(checkpointPath, journalPath, diskSize, 2);
+  spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  assert(spaceManager->status(b) == disk::DiskPartition::freeSpace);
+  assert(spaceManager->freeSpaceSize() == diskSize);
+  unlink(checkpointPath.c_str());
+  unlink(journalPath.c_str());
+
+  // a checkpoint that cannot be written leaves the journal stale, a freed
+  // partition stays in write
+  const std::string badCheckpointPath = std::string(prefix) + ".nodir/checkpoint";
+  disk::DiskSpaceManager::recover(badCheckpointPath, journalPath, diskSize, 2);
+  spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  a = spaceManager->getFreePlace();
+  spaceManager->doneWithWrite(a);
+  spaceManager->freeLocation(a);
+  ret = spaceManager->syncJournal();
+  assert(ret != 0 && spaceManager->status(a) != disk::DiskPartition::freeSpace);
+  ret = spaceManager->checkpoint();
+  assert(ret != 0 && spaceManager->status(a) != disk::DiskPartition::freeSpace);
+  (void)ret;
+  unlink(journalPath.c_str());
+  printf("space journal ok\n");
+}
+
+// the class and unit encoded in a partition id, and a file extent split
+// in adjacent partitions of descending classes
+void testSizeClasses()
+{
+  const size_t mb = 1024 * 1024;
+  disk::DiskSpaceManager::ClassSizes classSizes = {mb, 8 * mb, 64 * mb};
+  disk::DiskSpaceManager::init(256 * mb, 2, classSizes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  assert(spaceManager->classFor(100) == 0 && spaceManager->classFor(mb) == 0);
+  assert(spaceManager->classFor(9 * mb) == 1 && spaceManager->classFor(100 * mb) == 2);
+
+  auto id = spaceManager->getFreePlace(1, 2);
+  assert(id >> disk::DiskSpaceManager::s_classShift == 2);
+  assert(spaceManager->partitionClass(id) == 2 && spaceManager->partitionDevice(id) == 1);
+  assert(spaceManager->partitionSize(id) == 64 * mb);
+  assert(spaceManager->partitionBlocks(id) == 64 * mb / disk::s_diskBlockSize);
+  assert(spaceManager->partitionOffset(id) % (64 * mb) == 0);
+  assert(spaceManager->status(id) == disk::DiskPartition::inWrite);
+  spaceManager->doneWithWrite(id);
+  assert(spaceManager->status(id) == disk::DiskPartition::allocated);
+  spaceManager->freeLocation(id);
+  assert(spaceManager->freeSpaceSize() == 256 * mb);
+
+  const size_t bytes = 64 * mb + 8 * mb + mb + 1;
+  disk::Locations extent;
+  bool ok = spaceManager->getFreeExtent(bytes, extent, 0);
+  assert(ok && extent.size() == 4);
+  (void)ok;
+  const uint expected[] = {2, 1, 0, 0};
+  (void)expected;
+  size_t i = 0;
+  size_t size = 0;
+  for (auto it = extent.begin(); it != extent.end(); ++it, i++) {
+    assert(spaceManager->partitionClass(*it) == expected[i]);
+    assert(spaceManager->partitionDevice(*it) == 0);
+    if (i > 0)
+      assert(spaceManager->adjacent(*std::prev(it), *it));
+    size += spaceManager->partitionSize(*it);
+  }
+  assert(size >= bytes && size - bytes < spaceManager->unitSize());
+  assert(extent.sizeInBytes() == size);
+  assert(spaceManager->freeSpaceSize() == 256 * mb - size);
+  printf("size classes ok\n");
+}
+
+static std::string walRecord(uint64_t lsn)
+{
+  return std::string(1 + lsn % 300, 'a' + lsn % 26);
+}
+
+static size_t walAppend(disk::WriteAheadLog &wal, uint64_t firstLsn, size_t nRecords)
+{
+  for (uint64_t lsn = firstLsn; lsn < firstLsn + nRecords; lsn++) {
+    auto data = walRecord(lsn);
+    uint64_t appended;
+    int ret = wal.append(data.data(), data.size(), &appended);
+    assert(ret == 0 && appended == lsn);
+    (void)ret;
+  }
+  return nRecords;
+}
+
+// replay of the records of a log on a partition that held a longer log
+// before, and of a log followed by one that does not continue its lsns
+void testWriteAheadLog()
+{
+  // a free slot is taken lowest first, the logs get partition 0 then 1.
+  // appended one at a time each record takes a page
+  disk::DiskSpaceManager::init(2 * disk::s_partitionSizeBytes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  auto stale = new disk::WriteAheadLog(1000);
+  walAppend(*stale, 1000, 800);
+  auto staleLocations = stale->partitions();
+  delete stale;
+  assert(staleLocations.size() == 1);
+  for (auto id : staleLocations)
+    spaceManager->freeLocation(id);
+
+  auto wal = new disk::WriteAheadLog(1);
+  walAppend(*wal, 1, 500);
+  auto locations = wal->partitions();
+  delete wal;
+  assert(locations.size() == 1 && locations.front() == staleLocations.front());
+  auto next = new disk::WriteAheadLog(600);
+  walAppend(*next, 600, 10);
+  auto nextLocations = next->partitions();
+  delete next;
+
+  size_t nRecords = 0;
+  auto check = [&nRecords](uint64_t lsn, const char *data, size_t size) {
+    auto expected = walRecord(lsn);
+    assert(size == expected.size() && memcmp(data, expected.data(), size) == 0);
+    nRecords++;
+  };
+  // the stale records of the previous log end it
+  uint64_t nextLsn = disk::WriteAheadLog::replay(locations, check);
+  assert(nextLsn == 501 && nRecords == 500);
+  // as does the gap to the next log
+  locations.push_back(nextLocations.front());
+  nRecords = 0;
+  nextLsn = disk::WriteAheadLog::replay(locations, check);
+  assert(nextLsn == 501 && nRecords == 500);
+  nRecords = 0;
+  nextLsn = disk::WriteAheadLog::replay(nextLocations, check);
+  assert(nextLsn == 610 && nRecords == 10);
+  (void)nextLsn;
+  printf("write ahead log ok\n");
+}
+
+// appends of threads that wait for each other's write are acknowledged
+// together, their records packed into the same pages: more records than
+// the partition has pages fit in it. then the appends to a log on the
+// failing device fail, and once a write failed the rest fail without one
+void testWriteAheadLogConcurrent()
+{
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes, 2);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  const size_t nThreads = 8;
+  const size_t nAppends = 250;
+  const size_t pages = disk::s_partitionSizeBytes / disk::s_diskBlockSize;
+  assert(nThreads * nAppends > pages);
+  (void)pages;
+  auto wal = new disk::WriteAheadLog(1);
+  auto appendAll = [&wal, nAppends] (std::vector<uint64_t> &lsns, std::atomic<int> &failed) {
+    for (size_t i = 0; i < nAppends; i++) {
+      auto data = walRecord(i);
+      uint64_t lsn = 0;
+      if (wal->append(data.data(), data.size(), &lsn) != 0)
+	failed++;
+      lsns.push_back(lsn);
+    }
+  };
+  std::vector<std::vector<uint64_t> > lsns(nThreads);
+  std::atomic<int> failed(0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nThreads; t++)
+    threads.emplace_back(appendAll, std::ref(lsns[t]), std::ref(failed));
+  for (auto &thread : threads)
+    thread.join();
+  threads.clear();
+  assert(failed == 0 && wal->records() == nThreads * nAppends);
+  assert(wal->writes() < wal->records());
+  auto locations = wal->partitions();
+  assert(locations.size() == 1);
+  delete wal;
+
+  // every record once, in lsn order, each thread's in its append order
+  std::map<uint64_t, size_t> order; // lsn to the append of its thread
+  for (auto const &l : lsns) {
+    for (size_t i = 0; i < l.size(); i++) {
+      if (i > 0)
+	assert(l[i] > l[i - 1]);
+      order[l[i]] = i;
+    }
+  }
+  assert(order.size() == nThreads * nAppends);
+  uint64_t expectedLsn = 1;
+  auto check = [&order, &expectedLsn](uint64_t lsn, const char *data, size_t size) {
+    assert(lsn == expectedLsn++);
+    auto expected = walRecord(order[lsn]);
+    assert(size == expected.size() && memcmp(data, expected.data(), size) == 0);
+    (void)data;
+    (void)size;
+  };
+  uint64_t nextLsn = disk::WriteAheadLog::replay(locations, check);
+  assert(nextLsn == nThreads * nAppends + 1 && expectedLsn == nextLsn);
+  (void)nextLsn;
+  for (auto id : locations)
+    spaceManager->freeLocation(id);
+
+  // the log goes to device 1 when device 0 is full
+  std::vector<disk::DiskPartitionId> held;
+  for (size_t i = 0; i < 2; i++) {
+    held.push_back(spaceManager->getFreePlace(0));
+    assert(spaceManager->partitionDevice(held.back()) == 0);
+  }
+  wal = new disk::WriteAheadLog(1);
+  for (auto &l : lsns)
+    l.clear();
+  for (size_t t = 0; t < nThreads; t++)
+    threads.emplace_back(appendAll, std::ref(lsns[t]), std::ref(failed));
+  for (auto &thread : threads)
+    thread.join();
+  assert(failed == (int)(nThreads * nAppends));
+  const size_t writes = wal->writes();
+  assert(writes >= 1 && writes < wal->records());
+  auto data = walRecord(0);
+  int ret = wal->append(data.data(), data.size());
+  assert(ret != 0 && wal->writes() == writes);
+  (void)ret;
+  (void)writes;
+  auto failedLocations = wal->partitions();
+  assert(failedLocations.size() == 1 &&
+	 spaceManager->partitionDevice(failedLocations.front()) == 1);
+  delete wal;
+  for (auto id : failedLocations)
+    spaceManager->freeLocation(id);
+  for (auto id : held)
+    spaceManager->writeAborted(id);
+  printf("write ahead log concurrent ok\n");
+}
+
+// puts of threads to the same keys through a logged memtable list, a
+// list rebuilt from the log has the same versions of every key
+void testMemTableReplay()
+{
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  auto wal = new disk::WriteAheadLog(1);
+  memtable::MemTableList memTables(wal);
+  const size_t nThreads = 4;
+  const size_t nPuts = 500;
+  const size_t nKeys = 50;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nThreads; t++) {
+    threads.emplace_back([&memTables, t, nPuts, nKeys] {
+	for (size_t i = 0; i < nPuts; i++) {
+	  auto type = i % 7 == 0 ? ObjectEntry::Delete : i % 3 == 0 ? ObjectEntry::Put :
+	    ObjectEntry::Update;
+	  auto entry = new ObjectEntry("key" + std::to_string(i % nKeys), type,
+				       std::to_string(t) + "." + std::to_string(i));
+	  int ret = memTables.put(entry);
+	  assert(ret == 0);
+	  (void)ret;
+	}
+      });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  auto locations = wal->partitions();
+  const uint64_t walNextLsn = wal->nextLsn();
+  delete wal;
+
+  memtable::MemTableList replayed;
+  uint64_t nextLsn = replayed.replay(locations);
+  assert(nextLsn == walNextLsn && nextLsn == nThreads * nPuts + 1);
+  (void)nextLsn;
+  (void)walNextLsn;
+  for (size_t k = 0; k < nKeys; k++) {
+    std::list<ObjectEntry *> expected, found;
+    memTables.get("key" + std::to_string(k), expected);
+    replayed.get("key" + std::to_string(k), found);
+    assert(!expected.empty() && expected.size() == found.size());
+    for (auto e = expected.begin(), f = found.begin(); e != expected.end(); ++e, ++f) {
+      assert((*e)->sequenceId == (*f)->sequenceId && (*e)->type == (*f)->type &&
+	     (*e)->value == (*f)->value);
+    }
+  }
+  for (auto id : locations)
+    spaceManager->freeLocation(id);
+  printf("memtable replay ok\n");
+}
+
+namespace rocksxl
+{
+namespace aio_interface
+{
+  extern const char *driveName;
+}
+}
+// device 1 of the unit tests, every write fails (ENOSPC) and so does
+// every sync (EINVAL)
+static const char *s_failingDrive = "/dev/full";
+
+class UtestSyncWait : public disk::SyncSignal
+{
+public:
+  UtestSyncWait() : m_status(0), m_done(false) {}
+  void syncDone(int status) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_status = status;
+    m_done = true;
+    m_cond.notify_one();
+  }
+  int wait() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [this] {return m_done;});
+    return m_status;
+  }
+private:
+  int                     m_status;
+  bool                    m_done;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+};
+
+// the writer is kept for the checks, deleted by the test
+class UtestWriteWait : public disk::WriteSignal
+{
+public:
+  UtestWriteWait() : m_writer(0) {}
+  void writeDone(disk::DiskWriter *writer) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_writer = writer;
+    m_cond.notify_one();
+  }
+  disk::DiskWriter *wait() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [this] {return m_writer != 0;});
+    return m_writer;
+  }
+private:
+  disk::DiskWriter        *m_writer;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+};
+
+// a round with a failed device sync fails all its waiters, the writes
+// are not durable
+void testGroupCommitFailure()
+{
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes, 2);
+  disk::GroupCommit::init();
+  UtestSyncWait sync;
+  disk::GroupCommit::s_groupCommit->sync(&sync);
+  int status = sync.wait();
+  assert(status != 0);
+
+  // a writer of a file on the good device fails in the sync
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  disk::FileData data(4);
+  for (auto &block : data)
+    block.reset(new disk::DiskBlock);
+  UtestWriteWait signal;
+  new disk::DiskWriter(data, &signal);
+  auto writer = signal.wait();
+  status = writer->status();
+  assert(status != 0);
+  for (auto location : writer->locations()) {
+    spaceManager->doneWithWrite(location);
+    spaceManager->freeLocation(location);
+  }
+  delete writer;
+
+  // and a log append
+  disk::WriteAheadLog wal;
+  status = wal.append("record", 6);
+  assert(status != 0);
+  disk::GroupCommit::s_groupCommit = 0;
+  (void)status;
+  printf("group commit failure ok\n");
+}
+
+// every byte of data of a block, with and without checksums, survives
+// the codec and a compressed file read back block by block
+void testCompressedFile()
+{
+  auto codec = disk::BlockCodec::codec(disk::BlockCodec::s_lz);
+  assert(codec);
+  const bool checksums = disk::DiskBlock::s_checksums;
+  for (int withChecksums = 0; withChecksums < 2; withChecksums++) {
+    disk::DiskBlock::s_checksums = withChecksums;
+    const size_t dataSize = disk::DiskBlock::dataSize();
+    const size_t nBlocks = 20;
+    std::vector<std::string> blocks(nBlocks);
+    for (size_t i = 0; i < nBlocks; i++) {
+      std::string &data = blocks[i];
+      if (i == 7) {
+	for (size_t j = 0; j < dataSize; j++)
+	  data.push_back(rand());
+      } else {
+	while (data.size() < dataSize)
+	  data += "key" + std::to_string(data.size() % 97) + " value " + std::to_string(i) + ";";
+	data.resize(dataSize);
+	data[dataSize - 1] = 'a' + i; // the last byte counts too
+      }
+    }
+    std::vector<char> compressed(disk::s_diskBlockSize);
+    size_t size = codec->compress(blocks[0].data(), dataSize, compressed.data(), dataSize - 1);
+    assert(size > 0 && size < dataSize / 2);
+    disk::DiskBlock restored;
+    bool ok = codec->decompress(compressed.data(), size, restored.data, dataSize);
+    assert(ok && memcmp(restored.data, blocks[0].data(), dataSize) == 0);
+    (void)ok;
+
+    disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+    UtestWriteWait signal;
+    auto writer = new disk::DiskWriter(&signal, disk::writerFlush, 0,
+				       disk::DiskWriter::s_defaultWindowBlocks,
+				       disk::BlockCodec::s_lz);
+    for (auto const &data : blocks) {
+      disk::DiskBlockPtr block(new disk::DiskBlock);
+      memcpy(block->data, data.data(), dataSize);
+      writer->append(block);
+    }
+    writer->seal();
+    signal.wait();
+    int status = writer->status();
+    assert(status == 0);
+    (void)status;
+    disk::Locations locations = writer->locations();
+    disk::BlockMap blockMap = writer->blockMap();
+    delete writer;
+    assert(blockMap.blocks.size() == nBlocks && blockMap.blocks.back().fileBlock < nBlocks / 2);
+    assert(blockMap.blocks[7].size == dataSize); // kept whole
+    for (size_t i = 0; i < nBlocks; i++) {
+      disk::DiskSyncRead read(locations, blockMap, i);
+      auto block = read.getData();
+      assert(read.status() == 0 && block);
+      assert(memcmp(block->data, blocks[i].data(), dataSize) == 0);
+      assert(!disk::DiskBlock::s_checksums || block->checksumOk());
+    }
+  }
+  disk::DiskBlock::s_checksums = checksums;
+  printf("compressed file ok\n");
+}
+
+struct UtestRecord
+{
+  std::string      key;
+  disk::RecordType type;
+  std::string      value;
+};
+
+// the locations of a written sorted file go to the file
+class UtestFileDone : public disk::WriteSignal
+{
+public:
+  UtestFileDone(disk::SortedFile &file) : m_file(file), m_done(false) {}
+  void writeDone(disk::DiskWriter *writer) {
+    int status = writer->status();
+    assert(status == 0);
+    (void)status;
+    for (auto location : writer->locations()) {
+      m_file.locations.push_back(location);
+      disk::DiskSpaceManager::s_diskSpaceManager->doneWithWrite(location);
+    }
+    delete writer;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_done = true;
+    m_cond.notify_one();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [this] {return m_done;});
+  }
+private:
+  disk::SortedFile        &m_file;
+  bool                    m_done;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+};
+
+class UtestCompactionDone
+{
+public:
+  UtestCompactionDone() : m_done(false) {}
+  static void done(disk::Compaction *, void *userCntxt) {
+    auto me = (UtestCompactionDone *)userCntxt;
+    std::lock_guard<std::mutex> lk(me->m_mutex);
+    me->m_done = true;
+    me->m_cond.notify_one();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [this] {return m_done;});
+  }
+private:
+  bool                    m_done;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+};
+
+static std::string utestKey(size_t i)
+{
+  char key[16];
+  snprintf(key, sizeof(key), "key%08zu", i);
+  return key;
+}
+
+static void writeSortedFile(disk::SortedFile &file, const std::vector<UtestRecord> &records)
+{
+  UtestFileDone signal(file);
+  disk::RecordWriter writer(file, &signal, disk::writerFlush);
+  for (auto const &record : records)
+    writer.add(record.key, record.type, record.value);
+  writer.finish();
+  signal.wait();
+}
+
+// the merge of files, newest first: the versions of a key newest first,
+// up to and including the first one that is not an update
+static std::vector<UtestRecord> mergeRecords(const std::vector<std::vector<UtestRecord> > &files,
+					     const std::string &fromKey, const std::string &toKey)
+{
+  std::map<std::string, std::vector<const UtestRecord *> > versions;
+  for (auto const &file : files) {
+    for (auto const &record : file) {
+      if (record.key >= fromKey && (toKey.empty() || record.key < toKey))
+	versions[record.key].push_back(&record);
+    }
+  }
+  std::vector<UtestRecord> ret;
+  for (auto const &key : versions) {
+    for (auto record : key.second) {
+      ret.push_back(*record);
+      if (record->type != disk::recordUpdate)
+	break;
+    }
+  }
+  return ret;
+}
+
+static bool sameRecord(const UtestRecord &record, const UtestRecord &expected)
+{
+  return record.key == expected.key && record.type == expected.type &&
+    record.value == expected.value;
+}
+
+// sorted files of overlapping keys with update chains and records
+// spanning blocks, read whole, from a fence and merged. then a compaction
+// of them in 3 subcompactions, and one whose output write fails
+void testCompaction()
+{
+  disk::DiskSpaceManager::init(64 * disk::s_partitionSizeBytes, 2);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  // the inputs go to device 0, device 1 fails every write
+  std::vector<disk::DiskPartitionId> held;
+  for (size_t i = 0; i < 32; i++) {
+    held.push_back(spaceManager->getFreePlace(1));
+    assert(spaceManager->partitionDevice(held.back()) == 1);
+  }
+  const size_t nKeys = 3000;
+  const size_t nFiles = 3;
+  std::vector<std::vector<UtestRecord> > records(nFiles); // newest first
+  for (size_t i = 0; i < nKeys; i++) {
+    for (size_t f = 0; f < nFiles; f++) {
+      if (rand() % 3 == 0)
+	continue;
+      int type = rand() % 8;
+      std::string value(i % 97 == 0 ? 20000 : rand() % 300, 'a' + f);
+      value += std::to_string(i);
+      records[f].push_back(UtestRecord{utestKey(i), type == 0 ? disk::recordDelete :
+	    type < 4 ? disk::recordUpdate : disk::recordPut, value});
+    }
+  }
+  std::vector<disk::SortedFile> files(nFiles);
+  for (size_t f = 0; f < nFiles; f++)
+    writeSortedFile(files[f], records[f]);
+  for (auto id : held)
+    spaceManager->writeAborted(id);
+
+  // a whole file
+  {
+    disk::RecordReader reader(files[0]);
+    size_t n = 0;
+    while (reader.next()) {
+      assert(n < records[0].size());
+      assert(sameRecord(UtestRecord{reader.key(), reader.type(), reader.value()},
+			records[0][n]));
+      n++;
+    }
+    assert(reader.status() == 0 && n == records[0].size());
+  }
+  // from the last fence below a key, blocks before it are skipped
+  {
+    assert(files[0].fences.size() > 2);
+    const std::string fromKey = utestKey(nKeys / 2);
+    disk::RecordReader reader(files[0], &fromKey);
+    bool more = reader.next();
+    assert(more && reader.key() > records[0].front().key && reader.key() <= fromKey);
+    while (more && reader.key() < fromKey)
+      more = reader.next();
+    size_t n = 0;
+    while (records[0][n].key < fromKey)
+      n++;
+    for (; more; more = reader.next(), n++)
+      assert(sameRecord(UtestRecord{reader.key(), reader.type(), reader.value()},
+			records[0][n]));
+    assert(n == records[0].size());
+  }
+  // the merge, newest version first
+  {
+    std::vector<disk::RecordReader *> readers;
+    for (auto const &file : files)
+      readers.push_back(new disk::RecordReader(file));
+    auto expected = mergeRecords(records, "", "");
+    disk::MergeIterator merge(readers, 0, 0);
+    size_t n = 0;
+    while (merge.next()) {
+      auto const &record = merge.current();
+      assert(n < expected.size());
+      assert(sameRecord(UtestRecord{record.key(), record.type(), record.value()},
+			expected[n]));
+      n++;
+    }
+    assert(n == expected.size());
+    for (auto reader : readers)
+      delete reader;
+  }
+
+  std::vector<const disk::SortedFile *> inputs;
+  for (auto const &file : files)
+    inputs.push_back(&file);
+  std::vector<disk::UserKey> splitKeys = {utestKey(nKeys / 3), utestKey(2 * nKeys / 3)};
+  size_t inputBytes = 0;
+  for (auto const &file : files) {
+    for (auto location : file.locations)
+      inputBytes += spaceManager->partitionSize(location);
+  }
+  // an output on device 1 fails, the inputs are kept and the outputs freed
+  {
+    const size_t freeBytes = spaceManager->freeSpaceSize();
+    disk::Compaction compaction(inputs, splitKeys);
+    UtestCompactionDone done;
+    compaction.run(UtestCompactionDone::done, &done);
+    done.wait();
+    assert(compaction.status() != 0 && compaction.outputs().empty());
+    for (auto const &file : files) {
+      for (auto location : file.locations)
+	assert(spaceManager->status(location) == disk::DiskPartition::allocated);
+    }
+    assert(spaceManager->freeSpaceSize() == freeBytes);
+  }
+  // every subcompaction has the records of its range, the inputs are freed
+  {
+    const size_t freeBytes = spaceManager->freeSpaceSize();
+    held.clear();
+    for (size_t i = 0; i < 32; i++)
+      held.push_back(spaceManager->getFreePlace(1));
+    disk::Compaction compaction(inputs, splitKeys);
+    UtestCompactionDone done;
+    compaction.run(UtestCompactionDone::done, &done);
+    done.wait();
+    for (auto id : held)
+      spaceManager->writeAborted(id);
+    int status = compaction.status();
+    assert(status == 0 && compaction.outputs().size() == splitKeys.size() + 1);
+    (void)status;
+    for (size_t i = 0; i < compaction.outputs().size(); i++) {
+      auto const &output = compaction.outputs()[i];
+      auto expected = mergeRecords(records, i ? splitKeys[i - 1] : "",
+				   i < splitKeys.size() ? splitKeys[i] : "");
+      disk::RecordReader reader(output);
+      size_t n = 0;
+      while (reader.next()) {
+	assert(n < expected.size());
+	assert(sameRecord(UtestRecord{reader.key(), reader.type(), reader.value()},
+			  expected[n]));
+	n++;
+      }
+      assert(n == expected.size());
+      delete output.index;
+      for (auto location : output.locations)
+	spaceManager->freeLocation(location);
+    }
+    assert(spaceManager->freeSpaceSize() == freeBytes + inputBytes);
+  }
+  for (auto const &file : files)
+    delete file.index;
+  printf("compaction ok\n");
+}
+
+// CRC32C known answer, a block shared beyond the writer is checksummed in
+// a copy and a block corrupted on the disk fails its read
+void testChecksums()
+{
+  uint32_t crc = disk::crc32c("123456789", 9);
+  assert(crc == 0xE3069283);
+  crc = disk::crc32c("56789", 5, disk::crc32c("1234", 4));
+  assert(crc == 0xE3069283);
+
+  const bool checksums = disk::DiskBlock::s_checksums;
+  disk::DiskBlock::s_checksums = true;
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  const size_t nBlocks = 4;
+  disk::FileData data(nBlocks);
+  for (size_t i = 0; i < nBlocks; i++) {
+    data[i].reset(new disk::DiskBlock);
+    memset(data[i]->data, 'a' + i, disk::s_diskBlockSize);
+  }
+  disk::DiskBlockPtr shared = data[1]; // as the block cache would hold it
+  UtestWriteWait signal;
+  new disk::DiskWriter(data, &signal);
+  auto writer = signal.wait();
+  int status = writer->status();
+  assert(status == 0);
+  assert(data[0]->checksumOk());
+  assert(!shared->checksumOk() && shared->data[disk::s_diskBlockSize - 1] == 'b');
+  disk::Locations locations = writer->locations();
+  delete writer;
+  assert(locations.size() == 1);
+  const disk::DiskPartitionId partition = locations.front();
+  spaceManager->doneWithWrite(partition);
+  for (size_t i = 0; i < nBlocks; i++) {
+    disk::DiskSyncRead read(partition, i);
+    auto block = read.getData();
+    assert(read.status() == 0 && block && block->checksumOk());
+    assert(memcmp(block->data, data[i]->data, disk::s_blockDataSize) == 0);
+  }
+
+  // a byte of block 2 changes on the disk
+  int fd = open(aio_interface::driveName, O_WRONLY);
+  assert(fd >= 0);
+  const char byte = 'z';
+  ssize_t written = pwrite(fd, &byte, 1, spaceManager->partitionOffset(partition) +
+			   2 * disk::s_diskBlockSize + 100);
+  assert(written == 1);
+  close(fd);
+  disk::DiskSyncRead read(partition, 2);
+  status = read.status();
+  assert(status == -EBADMSG && !read.getData());
+  spaceManager->freeLocation(partition);
+  disk::DiskBlock::s_checksums = checksums;
+  (void)crc;
+  (void)status;
+  (void)written;
+  printf("checksums ok\n");
+}
+
+// a file of unknown size streamed through a small window spans several
+// partitions, the writer never holds more than its window and the file
+// reads back whole
+static disk::DiskBlockPtr utestStreamBlock(size_t i)
+{
+  disk::DiskBlockPtr block(new disk::DiskBlock);
+  memset(block->data, 'a' + i % 26, disk::s_diskBlockSize);
+  memcpy(block->data, &i, sizeof(i));
+  return block;
+}
+
+void testStreamingWriter()
+{
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  const size_t windowBlocks = 8;
+  const size_t nBlocks = 2 * disk::s_partitionSizeBytes / disk::s_diskBlockSize + 100;
+  UtestWriteWait signal;
+  auto writer = new disk::DiskWriter(&signal, disk::writerFlush, 0, windowBlocks);
+  std::vector<std::weak_ptr<disk::DiskBlock> > appended;
+  size_t oldest = 0; // of the blocks that may still be held
+  for (size_t i = 0; i < nBlocks; i++) {
+    auto block = utestStreamBlock(i);
+    appended.push_back(block);
+    writer->append(block);
+    block.reset();
+    while (oldest < appended.size() && appended[oldest].expired())
+      oldest++;
+    size_t held = 0;
+    for (size_t b = oldest; b < appended.size(); b++)
+      held += !appended[b].expired();
+    assert(held <= windowBlocks);
+    (void)held;
+  }
+  writer->seal();
+  auto written = signal.wait();
+  assert(written == writer);
+  int status = writer->status();
+  assert(status == 0);
+  disk::Locations locations = writer->locations();
+  delete writer;
+  assert(locations.size() == 3);
+
+  size_t next = 0;
+  for (auto id : locations) {
+    spaceManager->doneWithWrite(id);
+    disk::MultiRead read;
+    for (size_t b = 0; b < spaceManager->partitionBlocks(id) && next + b < nBlocks; b++)
+      read.add(id, b);
+    read.wait();
+    status = read.status();
+    assert(status == 0);
+    for (size_t b = 0; b < read.size(); b++, next++) {
+      auto expected = utestStreamBlock(next);
+      assert(memcmp(read.block(b)->data, expected->data, disk::DiskBlock::dataSize()) == 0);
+    }
+  }
+  assert(next == nBlocks);
+  for (auto id : locations)
+    spaceManager->freeLocation(id);
+  (void)status;
+  (void)written;
+  printf("streaming writer ok\n");
+}
+
+// a batch of block reads with one block corrupted on the disk fails with
+// its status and only that block is missing. the blocks read go to the
+// block cache, a batch of them completes inline
+static void utestMultiReadDone(disk::MultiRead *read)
+{
+  *(bool *)read->userCntxt() = true;
+}
+
+void testMultiRead()
+{
+  const bool checksums = disk::DiskBlock::s_checksums;
+  disk::DiskBlock::s_checksums = true;
+  disk::BlockCache::init(64 * disk::s_diskBlockSize, 4);
+  disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+  auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+  const size_t nBlocks = 8;
+  const size_t badBlock = 5;
+  disk::FileData data(nBlocks);
+  for (size_t i = 0; i < nBlocks; i++) {
+    data[i].reset(new disk::DiskBlock);
+    memset(data[i]->data, 'a' + i, disk::s_diskBlockSize);
+  }
+  UtestWriteWait signal;
+  new disk::DiskWriter(data, &signal);
+  auto writer = signal.wait();
+  int status = writer->status();
+  assert(status == 0);
+  disk::Locations locations = writer->locations();
+  delete writer;
+  assert(locations.size() == 1);
+  const disk::DiskPartitionId partition = locations.front();
+  spaceManager->doneWithWrite(partition);
+
+  int fd = open(aio_interface::driveName, O_WRONLY);
+  assert(fd >= 0);
+  const char byte = 'z';
+  ssize_t written = pwrite(fd, &byte, 1, spaceManager->partitionOffset(partition) +
+			   badBlock * disk::s_diskBlockSize + 100);
+  assert(written == 1);
+  close(fd);
+
+  disk::MultiRead read;
+  for (size_t i = nBlocks; i > 0; i--)
+    read.add(partition, i - 1);
+  read.wait();
+  status = read.status();
+  assert(status == -EBADMSG && read.size() == nBlocks);
+  for (size_t i = 0; i < nBlocks; i++) {
+    auto block = read.block(nBlocks - 1 - i);
+    if (i == badBlock) {
+      assert(!block);
+      continue;
+    }
+    assert(block && memcmp(block->data, data[i]->data, disk::s_blockDataSize) == 0);
+  }
+
+  bool done = false;
+  disk::MultiRead cached;
+  for (size_t i = 0; i < nBlocks; i++) {
+    if (i != badBlock)
+      cached.add(partition, i);
+  }
+  cached.submit(utestMultiReadDone, &done);
+  assert(done && cached.status() == 0);
+  for (size_t i = 0; i < cached.size(); i++)
+    assert(cached.block(i) == read.block(nBlocks - 1 - (i < badBlock ? i : i + 1)));
+
+  disk::BlockCache::s_blockCache = 0;
+  spaceManager->freeLocation(partition);
+  disk::DiskBlock::s_checksums = checksums;
+  (void)status;
+  (void)written;
+  printf("multi read ok\n");
+}
+
+// a read that completes after its partition was erased does not bring
+// the old blocks back, the erase drops all the blocks of the partition
+void testBlockCache()
+{
+  const size_t capacity = 4 * 16; // blocks
+  disk::BlockCache::init(capacity * disk::s_diskBlockSize, 4);
+  auto cache = disk::BlockCache::s_blockCache;
+  const disk::DiskPartitionId partition = 7, other = 8;
+  disk::DiskBlockPtr block(new disk::DiskBlock);
+  uint32_t generation = -1u;
+  auto found = cache->lookup(partition, 0, &generation);
+  assert(!found && generation == 0);
+  for (size_t i = 0; i < 10; i++) {
+    cache->insert(partition, i, block, generation);
+    cache->insert(other, i, block, 0);
+  }
+  found = cache->lookup(partition, 9);
+  assert(found == block && cache->sizeBytes() == 20 * disk::s_diskBlockSize);
+
+  // a read issued before the erase
+  uint32_t staleGeneration;
+  found = cache->lookup(partition, 10, &staleGeneration);
+  assert(!found);
+  cache->erasePartition(partition);
+  assert(cache->sizeBytes() == 10 * disk::s_diskBlockSize);
+  for (size_t i = 0; i < 10; i++) {
+    found = cache->lookup(partition, i);
+    assert(!found);
+    found = cache->lookup(other, i);
+    assert(found == block);
+  }
+  cache->insert(partition, 10, block, staleGeneration);
+  found = cache->lookup(partition, 10, &generation);
+  assert(!found && generation != staleGeneration);
+  cache->insert(partition, 10, block, generation);
+  found = cache->lookup(partition, 10);
+  assert(found == block);
+
+  // full shards evict, never grow
+  for (size_t i = 0; i < 10 * capacity; i++)
+    cache->insert(i % 16, i, block, cache->generation(i % 16));
+  assert(cache->sizeBytes() <= capacity * disk::s_diskBlockSize);
+  disk::BlockCache::s_blockCache = 0;
+  (void)found;
+  printf("block cache ok\n");
+}
+
+// a freed partition is discarded and given back to the space manager of
+// the time, not to the one there was when the queue started
+void testDiscard()
+{
+  disk::DiscardQueue::init();
+  auto discardQueue = disk::DiscardQueue::s_discardQueue;
+  for (int replaced = 0; replaced < 2; replaced++) {
+    disk::DiskSpaceManager::init(4 * disk::s_partitionSizeBytes);
+    auto spaceManager = disk::DiskSpaceManager::s_diskSpaceManager;
+    auto id = spaceManager->getFreePlace();
+    spaceManager->doneWithWrite(id);
+    spaceManager->freeLocation(id);
+    // in write until discarded, the queue waits for neighbours first
+    assert(spaceManager->status(id) == disk::DiskPartition::inWrite);
+    while (discardQueue->pendingSlots())
+      usleep(1000);
+    assert(spaceManager->status(id) == disk::DiskPartition::freeSpace);
+    assert(spaceManager->freeSpaceSize() == 4 * disk::s_partitionSizeBytes);
+  }
+  disk::DiscardQueue::s_discardQueue = 0;
+  printf("discard ok\n");
+}
+
 int main()
 {
   const size_t s_fileSize = 1024ll * 1024 * 1024 * 16;
-  aio_interface::aioInit();
+  testPartitionBitmap();
+  testSpaceJournal();
+  testSizeClasses();
+  testBlockCache();
+  aio_interface::AioConfig config;
+  config.drives = {aio_interface::driveName, s_failingDrive};
+  aio_interface::aioInit(config);
   disk::DiskWriteManager::init();
+  testWriteAheadLog();
+  testWriteAheadLogConcurrent();
+  testMemTableReplay();
+  testGroupCommitFailure();
+  testCompaction();
+  testCompressedFile();
+  testChecksums();
+  testStreamingWriter();
+  testMultiRead();
+  testDiscard();
   disk::DiskSpaceManager::init(s_fileSize);
+  disk::GroupCommit::init();
   test_files.resize(1024);
   for (int i = 0; i < 1024; i++) {
     test_files[i].mutex = new std::mutex;
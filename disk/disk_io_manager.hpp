@@ -1,8 +1,15 @@
 #pragma once
 #include "disk_space.hpp"
+#include "disk_block_pool.hpp"
+#include "group_commit.hpp"
+#include "compression.hpp"
 #include <mutex>
 #include <condition_variable>
+#include <future>
 #include <atomic>
+#include <deque>
+#include <list>
+#include <algorithm>
 
 namespace rocksxl
 {
@@ -16,55 +23,207 @@ namespace disk
 {
 #pragma pack(push,1)
   static const size_t s_diskBlockSize = 0x2000; // must be multiplaction of 4K
-  static const size_t s_nBlocksInPartition = s_partitionSizeBytes/s_diskBlockSize;
+  static const size_t s_nBlocksInPartition = s_partitionSizeBytes/s_diskBlockSize; // of the default size
+  // the last bytes of a block hold its CRC32C, the rest is for the data
+  static const size_t s_blockChecksumSize = sizeof(uint32_t);
+  static const size_t s_blockDataSize = s_diskBlockSize - s_blockChecksumSize;
   struct DiskBlock
   {
     char data[s_diskBlockSize];
+
+    // when set DiskWriter fills in the checksums and the reads verify
+    // them, a mismatch fails the read with -EBADMSG. set before the first
+    // write, files are read with the setting they were written with
+    static bool s_checksums;
+    // bytes of data, the rest of the block holds the checksum. DiskWriter
+    // sets it in the blocks it is given, or in a copy when they are shared
+    static size_t dataSize() {return s_checksums ? s_blockDataSize : s_diskBlockSize;}
+    void setChecksum();
+    bool checksumOk() const;
+
+    // aligned blocks from the pool, required for O_DIRECT
+    static void *operator new(size_t size) {
+      assert(size == sizeof(DiskBlock));
+      return DiskBlockPool::alloc();
+    }
+    static void operator delete(void *p) {
+      DiskBlockPool::free(p);
+    }
   };
+#pragma pack(pop)
+
+  inline size_t DiskSpaceManager::partitionBlocks(DiskPartitionId id) const
+  {
+    return partitionSize(id) / s_diskBlockSize;
+  }
   
   typedef std::shared_ptr<DiskBlock> DiskBlockPtr;
   typedef std::vector< DiskBlockPtr > FileData;
 
+  // how a read populates the block cache (block_cache.hpp)
+  enum CacheFill : uint8_t {
+    cacheFillNormal,  // head of probation
+    cacheFillLight,   // tail of probation, first to go unless hit again
+    cacheFillNone     // do not cache
+  };
+
+  // point reads of many blocks submitted as one batch. the blocks are
+  // served from the block cache when possible, the others are read from
+  // disk and completed together: done is called once, after the last one.
+  // a caller thread can keep any number of MultiReads in flight
+  class MultiRead
+  {
+  public:
+    typedef void (*cb)(MultiRead *);
+    MultiRead() : m_pending(0), m_status(0), m_done(false),
+		  m_callback(0), m_userCntxt(0) {}
+    virtual ~MultiRead() {}
+    void add(DiskPartitionId partition, size_t blockNum);
+    // asynchronous, done may run inline when every block is cached.
+    // the object must live until done is called
+    void submit(cb done, void *userCntxt);
+    // submit and return once all the blocks are read
+    void wait();
+
+    size_t       size() const {return m_blocks.size();}
+    // empty when the read failed
+    DiskBlockPtr block(size_t i) const {return m_blocks[i].block;}
+    int          status() const {return m_status;}
+    void        *userCntxt() const {return m_userCntxt;}
+  private:
+    struct Entry
+    {
+      DiskPartitionId partition;
+      size_t          blockNum;
+      DiskBlockPtr    block;
+      uint32_t        generation; // of the partition in the cache, before the read
+    };
+    void oneDone();
+    static void fetchDone(aio_interface::AioData *);
+  private:
+    std::vector<Entry>                              m_blocks;
+    std::atomic<size_t>                             m_pending;
+    std::atomic<int>                                m_status; // the first error
+    bool                                            m_done;
+    cb                                              m_callback;
+    void                                           *m_userCntxt;
+    std::mutex                                      m_mutex;
+    std::condition_variable                         m_cond;
+  };
+
+  // asynchronous single block read, block is empty when the read failed.
+  // done may run inline when the block is cached
+  typedef void (*ReadCallback)(void *userCntxt, DiskBlockPtr block);
+  void readBlock(DiskPartitionId partition, size_t blockNum,
+		 ReadCallback done, void *userCntxt);
+  std::future<DiskBlockPtr> readBlock(DiskPartitionId partition, size_t blockNum);
+
+  // block blockNum of a compressed file out of the file block that holds
+  // it, false when it does not decompress
+  bool unpackBlock(const BlockMap &blockMap, size_t blockNum,
+		   const DiskBlock &fileBlock, DiskBlock &block);
+
   // return when the read is done!!!
   class DiskSyncRead {
   public:
     DiskSyncRead(const DiskPartitionId partition,
 		 const size_t blockNum);
+    // block blockNum of a compressed file
+    DiskSyncRead(const Locations &locations,
+		 const BlockMap &blockMap,
+		 const size_t blockNum);
     ~DiskSyncRead() {}
+    // empty when the read failed
     DiskBlockPtr getData() {return m_data;}
+    int          status() const {return m_status;}
   private:
-    static void fetchDone(aio_interface::AioData *);
     DiskBlockPtr m_data;
-    
-    // to implement wait for response ... 
-    std::mutex                                      m_mutex;
-    std::condition_variable                         m_cond;
+    int          m_status;
   };
 
   
+  // sequential reader of a file with an adaptive readahead window. the
+  // window doubles whenever the consumer has to wait for the disk and
+  // shrinks when fetched data is not consumed. reads grow with the window
+  // up to a whole partition. memory is bounded per fetcher and globally,
+  // counting the blocks read from disk. the blocks of a compressed file
+  // are decompressed by the completions, in parallel over the aio queues
   class DiskFetcher
   {
   public:
-    DiskFetcher(const Locations &locations);
+    // fill - how the fetched blocks populate the block cache
+    // blocks [firstBlock, endBlock) of the file are fetched
+    // blockMap - of a compressed file
+    // with several NUMA nodes the constructing thread, the consumer, is
+    // pinned to its node. the reads then complete on that node and the
+    // blocks are allocated from its pool
+    DiskFetcher(const Locations &locations,
+		CacheFill fill = cacheFillNone,
+		size_t firstBlock = 0,
+		size_t endBlock = -1ul,
+		const BlockMap *blockMap = 0);
+    // empty at the end, or once a read failed
     DiskBlockPtr getBlock();
+    // 0, or the error of the first failed read once getBlock returned empty
+    int       status() const {return m_status;}
     void      terminate();
+    // readahead memory limits, per fetcher and of all the fetchers together
+    static void setReadaheadLimits(size_t fetcherBytes, size_t globalBytes) {
+      s_maxFetcherBytes = fetcherBytes;
+      s_globalBudgetBytes = globalBytes;
+    }
     
   private:
-    ~DiskFetcher() {}; // must call to doneWithFetcher!!!    
+    ~DiskFetcher(); // must call to doneWithFetcher!!!    
   private:    
+    struct FetchedBlock
+    {
+      DiskBlockPtr    block;
+      bool            ready;
+      DiskPartitionId partition;
+      uint32_t        blockNum;
+      uint32_t        generation; // of the partition in the cache, before the read
+      std::vector<DiskBlockPtr> unpacked; // of a compressed file
+    };
     const Locations                                 &m_locations;
-    std::list< DiskBlockPtr >                       m_fetchedData;
+    // in file order, including the blocks still in flight
+    std::deque< FetchedBlock >                      m_fetchedData;
+    size_t                                          m_headSeq; // sequence of the front block
     size_t                                          m_activeRequests;
-    size_t                                          m_maxActiveRequests;
+    size_t                                          m_activeBlocks;
+    size_t                                          m_window;  // in blocks
+    CacheFill                                       m_cacheFill;
     std::pair <Locations::const_iterator, size_t>   m_nextFetchLocation;
+    size_t                                          m_blocksLeft;
     std::mutex                                      m_mutex;
     std::condition_variable                         m_cond;
     bool m_terminated;
+    int                                             m_status;
+    const BlockMap                                 *m_blockMap;
+    size_t                                          m_firstBlock; // of a compressed file
+    size_t                                          m_endBlock;
+    size_t                                          m_firstFileBlock;
+    size_t                                          m_frontUnpacked; // given from the front block
     void fetch();
+    bool unpack(aio_interface::AioData *data,
+		std::vector< std::vector<DiskBlockPtr> > &unpacked);
     // callback from aioInterface..
     static void fetchDone(aio_interface::AioData *);
+
+    static size_t                                   s_maxFetcherBytes;
+    static size_t                                   s_globalBudgetBytes;
+    static std::atomic<size_t>                      s_globalBytes;
   };
   class DiskWriter;
+  // what a writer writes, DiskWriteManager shares the disk between the
+  // classes by their WriterClassConfig
+  enum WriterClass : uint8_t {
+    writerFlush,         // memtable flush
+    writerL0Compaction,  // compaction out of level 0
+    writerCompaction,    // deeper compactions
+    writerNumClasses
+  };
+
   class WriteSignal
   {
   public:
@@ -73,62 +232,172 @@ namespace disk
   };
 
 
-  class DiskWriter
+  // writes a file to free partitions. the blocks are given at once
+  // (FileData), or appended as they are produced and the file is ended by
+  // seal(). writes start as soon as a full request is buffered, append
+  // waits while windowBlocks are buffered or in flight, so a streaming
+  // writer holds a few MB whatever the file size.
+  // when GroupCommit is initialized the writer reports writeDone only
+  // after its data is durable. a file of known size larger than a unit is
+  // placed on adjacent partitions of one device, the largest size classes
+  // first, when there is such room. otherwise the partitions are taken as
+  // the data is written, of a size class that grows with the file.
+  // a compressed file is written by a streaming writer, its blocks are
+  // packed into the file blocks as they are appended and blockMap() tells
+  // where each one went. its size is not known, so nothing is reserved
+  class DiskWriter : public SyncSignal
   {
   public:
+    static const size_t s_defaultWindowBlocks = 512; // 4M
     DiskWriter(FileData  &dataToWrite,
-	       WriteSignal     *writeSignal);
-    ~DiskWriter() {
-      //for (auto d : m_dataToWrite)
-      //delete d;
-    }
+	       WriteSignal     *writeSignal,
+	       WriterClass     writerClass = writerFlush);
+    // expectedBlocks - size of the file when known, 0 if not
+    // codec - BlockCodec id, s_none for a file that is not compressed
+    DiskWriter(WriteSignal     *writeSignal,
+	       WriterClass     writerClass = writerFlush,
+	       size_t          expectedBlocks = 0,
+	       size_t          windowBlocks = s_defaultWindowBlocks,
+	       uint8_t         codec = BlockCodec::s_none);
+    ~DiskWriter() {}
+    // the next block of the file, blocks while the window is full. the
+    // block gets its checksum here (DiskBlock::s_checksums), it is not
+    // modified after
+    void append(const DiskBlockPtr &block);
+    // no more blocks, writeDone is signaled once all are written
+    void seal();
+
+    // next run of consecutive blocks, at most maxBlocks and never crossing
+    // a partition, as one (vectored) request. lastData is set when the
+    // writer has no full request ready, it is queued again by append
     void getNextBlockForWrite(aio_interface::AioData &writeData,
+			      size_t maxBlocks,
 			      bool &lastDataForLoaction,
 			      bool &lastData);
 
-    void   newWrite() {m_numActiveWrites++;};
-    void   writeDone() {assert(m_numActiveWrites > 0);
-      m_numActiveWrites--;
-      if (m_numActiveWrites == 0 && m_dataLocation == m_dataToWrite.size()) {
-	m_writeSignal->writeDone(this);
-      }
-    };
+    // newWrite must be called before the data is taken, so a completion
+    // of another queue can not see the writer idle and fully scheduled
+    void   newWrite() {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_numActiveWrites++;
+    }
+    // the write of getNextBlockForWrite that set userTag to firstBlock,
+    // status - 0 or -errno
+    void   writeDone(size_t firstBlock, size_t nBlocks, int status);
+    void   syncDone(int status);
+    // 0, or -errno of the first failed write or sync. valid once writeDone
+    // is signaled, the file is then not durable
+    int    status() const {return m_status;}
     const Locations                           &locations() {return m_locations;}
+    // of a compressed file, complete once writeDone is signaled
+    const BlockMap                            &blockMap() const {return m_blockMap;}
+    WriterClass                               writerClass() const {return m_writerClass;}
+  private:
+    void   appendFileBlock(const DiskBlockPtr &block);
+    void   pack(const DiskBlockPtr &block);
+    void   flushPacked();
+    void   reserve(size_t nBlocks);
+    // lock is held
+    bool   ready() const;
+    size_t partitionRoom() const;
+    uint   nextClass() const {
+      return DiskSpaceManager::s_diskSpaceManager->classFor(m_dataLocation * s_diskBlockSize);
+    }
+    bool   finished() const {
+      return m_sealed && m_numActiveWrites == 0 && m_dataLocation == m_appended;
+    }
+    void   finish();
   private:
     Locations                                 m_locations;
-    const     FileData                        m_dataToWrite;
+    Locations                                 m_reserved; // adjacent partitions not written yet
+    // blocks from file index m_dataBase, written ones are released
+    std::deque<DiskBlockPtr>                  m_data;
+    size_t                                    m_dataBase;
+    size_t                                    m_appended;
     size_t                                    m_lastLocationOffset;
-    size_t                                    m_dataLocation;
+    size_t                                    m_dataLocation; // next block to write
     size_t                                    m_numActiveWrites;
+    size_t                                    m_inFlightBlocks; // appended, not written
+    size_t                                    m_windowBlocks;
+    bool                                      m_sealed;
+    bool                                      m_queued;   // in DiskWriteManager
+    bool                                      m_finished;
+    int                                       m_status;
+    std::mutex                                m_mutex;
+    std::condition_variable                   m_windowCond;
     WriteSignal                               *m_writeSignal;
+    uint                                      m_nextDevice;
+    WriterClass                               m_writerClass;
+    // compression, used by the producer thread only
+    BlockCodec                                *m_codec;
+    BlockMap                                  m_blockMap;
+    DiskBlockPtr                              m_packing;     // the file block being filled
+    size_t                                    m_packedBytes;
+    std::vector<char>                         m_compressed;
   };
 
+  struct WriterClassConfig
+  {
+    uint   priority;       // 0 is the highest, a class runs only when no class
+			   // of a higher priority can
+    uint   weight;         // share between the classes of the same priority
+    size_t maxConcurrent;  // writes of the class in flight
+    size_t bytesPerSecond; // 0 for no limit
+  };
+
+  // the writers of each class are served round robin. priority 0 classes
+  // are limited only by their own maxConcurrent, the other classes together
+  // by concurentWrites as well, so a flush never waits for compaction
+  // writes to finish. by default flush is priority 0 and the compactions
+  // share priority 1, level 0 with 3 times the weight of the deeper levels
   class DiskWriteManager
   {
   public:
     static DiskWriteManager *s_diskWriteManager;
-    static void init(size_t concurentWrites = 2) {
-      s_diskWriteManager = new DiskWriteManager(concurentWrites);
+    // maxWriteBytes - size of a single write request, a request never
+    // crosses a partition
+    static void init(size_t concurentWrites = 2,
+		     size_t maxWriteBytes = 128 * s_diskBlockSize) {
+      s_diskWriteManager = new DiskWriteManager(concurentWrites, maxWriteBytes);
     }    
   public:    
     void appendWriter(DiskWriter *);
     bool hasWriters() const {return
 	m_numActiveWrites != 0 || 
-	!m_writers.empty();}
+	m_numWriters != 0;}
+    size_t maxBlocksPerWrite() const {return m_maxBlocksPerWrite;}
+    void setClassConfig(WriterClass writerClass, const WriterClassConfig &config);
   private:
-    DiskWriteManager(size_t concurentWrites ) :
-      m_maxConcurentWrites(concurentWrites),
-      m_numActiveWrites(0)
-    {};
+    DiskWriteManager(size_t concurentWrites, size_t maxWriteBytes);
     
   private:
     typedef std::list<DiskWriter *> Writers;
-    Writers                         m_writers;
-    Writers::iterator               m_curLocation;
+    struct ClassState
+    {
+      WriterClassConfig             config;
+      Writers                       writers;
+      Writers::iterator             curLocation;
+      size_t                        numActiveWrites;
+      double                        virtualTime; // bytes / weight written
+      double                        tokens;      // bytes the rate limit allows now
+      uint64_t                      lastRefill;  // ns
+    };
+    ClassState                      m_classes[writerNumClasses];
     std::mutex                      m_mutex;
     size_t                          m_maxConcurentWrites;
+    size_t                          m_maxBlocksPerWrite;
+    size_t                          m_backgroundWrites; // of classes of priority > 0
+    double                          m_virtualTime;      // of the last class served
     std::atomic<size_t>             m_numActiveWrites;
+    std::atomic<size_t>             m_numWriters;
+    // wakes scheduleWrites when a rate limited class has writers and no
+    // completion will
+    std::condition_variable         m_throttleCond;
+    uint64_t                        m_throttleUntil; // ns, 0 when not throttled
     void                            scheduleWrites();
+    int                             pickClass(uint64_t now);
+    bool                            rateAllows(ClassState &state, uint64_t now);
+    void                            throttleThread();
     static void                     writeDone(aio_interface::AioData *);
   };
 }
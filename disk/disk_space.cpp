@@ -1,68 +1,736 @@
-#include "disk_space.hpp"
+#include <sched.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include "disk_io_manager.hpp"
+#include "discard.hpp"
 namespace rocksxl
 {
 namespace disk
 {
+  void PartitionBitmap::resize(size_t nSlots)
+  {
+    assert(nSlots >= m_nSlots);
+    size_t nWords = (nSlots + 63) / 64;
+    if (nWords != m_nWords) {
+      std::unique_ptr<std::atomic<uint64_t>[]> words(new std::atomic<uint64_t>[nWords]);
+      std::unique_ptr<std::atomic<uint64_t>[]> allocated(new std::atomic<uint64_t>[nWords]);
+      for (size_t i = 0; i < nWords; i++) {
+	words[i].store(i < m_nWords ? m_words[i].load() : 0, std::memory_order_relaxed);
+	allocated[i].store(i < m_nWords ? m_allocated[i].load() : 0, std::memory_order_relaxed);
+      }
+      m_words.swap(words);
+      m_allocated.swap(allocated);
+      m_nWords = nWords;
+    }
+    m_nSlots = nSlots;
+    // spread the cores over the device
+    for (uint c = 0; c < s_nCursors; c++)
+      m_cursors[c].store(c * m_nWords / s_nCursors, std::memory_order_relaxed);
+  }
+
+  void PartitionBitmap::setFree(size_t first, size_t count)
+  {
+    assert(first + count <= m_nSlots);
+    for (size_t slot = first; slot < first + count; slot++) {
+      uint64_t bit = 1ull << (slot % 64);
+      uint64_t old = m_words[slot / 64].fetch_or(bit, std::memory_order_release);
+      assert(!(old & bit));
+      (void)old;
+    }
+    m_nFree += count;
+  }
+
+  void PartitionBitmap::setAllocated(size_t first, size_t count, bool allocated)
+  {
+    assert(first + count <= m_nSlots);
+    for (size_t slot = first; slot < first + count; slot++) {
+      uint64_t bit = 1ull << (slot % 64);
+      if (allocated)
+	m_allocated[slot / 64].fetch_or(bit, std::memory_order_relaxed);
+      else
+	m_allocated[slot / 64].fetch_and(~bit, std::memory_order_relaxed);
+    }
+  }
+
+  void PartitionBitmap::saveAllocated(uint64_t *to) const
+  {
+    for (size_t w = 0; w < m_nWords; w++)
+      to[w] = m_allocated[w].load(std::memory_order_relaxed);
+  }
+
+  void PartitionBitmap::loadAllocated(const uint64_t *from)
+  {
+    size_t nFree = 0;
+    for (size_t w = 0; w < m_nWords; w++) {
+      size_t bits = std::min<size_t>(64, m_nSlots - w * 64);
+      uint64_t valid = bits == 64 ? ~0ull : (1ull << bits) - 1;
+      uint64_t allocated = from[w] & valid;
+      m_allocated[w].store(allocated, std::memory_order_relaxed);
+      m_words[w].store(~allocated & valid, std::memory_order_relaxed);
+      nFree += __builtin_popcountll(~allocated & valid);
+    }
+    m_nFree = nFree;
+  }
+
+  bool PartitionBitmap::allocate(size_t &slot)
+  {
+    if (m_nWords == 0)
+      return false;
+    int cpu = sched_getcpu();
+    auto &cursor = m_cursors[(cpu < 0 ? 0 : cpu) % s_nCursors];
+    size_t start = cursor.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < m_nWords; i++) {
+      size_t w = (start + i) % m_nWords;
+      uint64_t word = m_words[w].load(std::memory_order_relaxed);
+      while (word) {
+	uint64_t bit = word & -word;
+	if (m_words[w].compare_exchange_weak(word, word & ~bit,
+					     std::memory_order_acquire,
+					     std::memory_order_relaxed)) {
+	  cursor.store(w, std::memory_order_relaxed);
+	  m_nFree--;
+	  slot = w * 64 + __builtin_ctzll(bit);
+	  return true;
+	}
+      }
+    }
+    return false;
+  }
+
+  // clear the bits of [first, first + count) when all are set
+  bool PartitionBitmap::claim(size_t first, size_t count)
+  {
+    size_t end = first + count;
+    for (size_t pos = first; pos < end; ) {
+      size_t w = pos / 64;
+      size_t bits = std::min<size_t>(64 - pos % 64, end - pos);
+      uint64_t mask = (bits == 64 ? ~0ull : ((1ull << bits) - 1)) << (pos % 64);
+      uint64_t word = m_words[w].load(std::memory_order_relaxed);
+      do {
+	if ((word & mask) != mask) {
+	  release(first, pos - first);
+	  return false;
+	}
+      } while (!m_words[w].compare_exchange_weak(word, word & ~mask,
+						 std::memory_order_acquire,
+						 std::memory_order_relaxed));
+      pos += bits;
+    }
+    m_nFree -= count;
+    return true;
+  }
+
+  void PartitionBitmap::release(size_t first, size_t count)
+  {
+    size_t end = first + count;
+    for (size_t pos = first; pos < end; ) {
+      size_t bits = std::min<size_t>(64 - pos % 64, end - pos);
+      uint64_t mask = (bits == 64 ? ~0ull : ((1ull << bits) - 1)) << (pos % 64);
+      m_words[pos / 64].fetch_or(mask, std::memory_order_release);
+      pos += bits;
+    }
+  }
+
+  bool PartitionBitmap::allocateRun(size_t count, size_t &first, size_t align)
+  {
+    assert(count > 0);
+    if (freeSlots() < count)
+      return false;
+    std::lock_guard<std::mutex> lk(m_runMutex);
+    size_t runStart = 0;
+    size_t runLength = 0;
+    for (size_t slot = 0; slot < m_nSlots; ) {
+      uint64_t word = m_words[slot / 64].load(std::memory_order_relaxed);
+      if (slot % 64 == 0 && (word == 0 || word == ~0ull)) {
+	// whole word at once
+	if (word == 0) {
+	  runLength = 0;
+	} else {
+	  if (runLength == 0)
+	    runStart = slot;
+	  runLength += 64;
+	}
+	slot += 64;
+      } else {
+	if (word & (1ull << (slot % 64))) {
+	  if (runLength == 0)
+	    runStart = slot;
+	  runLength++;
+	} else {
+	  runLength = 0;
+	}
+	slot++;
+      }
+      size_t start = (runStart + align - 1) / align * align;
+      if (runLength > 0 && runStart + runLength >= start + count &&
+	  start + count <= m_nSlots) {
+	if (claim(start, count)) {
+	  first = start;
+	  return true;
+	}
+	// a single allocation took a slot of the run, search after it
+	runLength = 0;
+	slot = start + 1;
+      }
+    }
+    return false;
+  }
+
+  void PartitionBitmap::addStats(FreeSpaceStats &stats) const
+  {
+    size_t runLength = 0;
+    size_t largest = 0;
+    for (size_t slot = 0; slot <= m_nSlots; slot++) {
+      if (slot < m_nSlots && isFree(slot)) {
+	runLength++;
+	continue;
+      }
+      if (runLength) {
+	stats.freePartitions += runLength;
+	stats.freeExtents++;
+	largest = std::max(largest, runLength);
+      }
+      runLength = 0;
+    }
+    stats.largestExtent = std::max(stats.largestExtent, largest);
+    stats.largestPerDevice += largest;
+  }
+
   DiskSpaceManager *DiskSpaceManager::s_diskSpaceManager;
+  // checkpoint: size_t disk size, uint32 nDevices, uint32 nClasses, uint64 generation,
+  // uint64 size of every class, then the allocated bitmap words (of units)
+  // of every device.
+  // journal: uint64 generation then uint32 records
+  
   // manintain a virtual disk with pre-determine size
-  DiskSpaceManager::DiskSpaceManager(size_t diskSizeBytes) :
-    m_curSize(diskSizeBytes)
+  DiskSpaceManager::DiskSpaceManager(size_t diskSizeBytes, uint nDevices,
+				     const ClassSizes &classSizes) :
+    m_curSize(diskSizeBytes),
+    m_nDevices(nDevices),
+    m_classSizes(classSizes),
+    m_devices(new PartitionBitmap[nDevices]),
+    m_nextDevice(0),
+    m_journalFd(-1),
+    m_journalRecords(0),
+    m_checkpointRecords(0),
+    m_generation(0),
+    m_journalBytes(0),
+    m_journalStale(false)
   {
-    DiskPartitionId nDisksLocations = diskSizeBytes/s_partitionSizeBytes;
-    m_allLocations.resize(nDisksLocations);
-    for (uint i = 0; i < nDisksLocations; i++) {
-      m_allLocations[i].id = i;
-      m_freeList.push_back(i);
+    assert(nDevices > 0);
+    checkClasses();
+    DiskPartitionId nUnits = diskSizeBytes/unitSize();
+    resize(nUnits);
+    for (uint i = 0; i < nUnits; i++) {
+      m_devices[partitionDevice(i)].setFree(i / nDevices);
     }
   }
-  DiskSpaceManager::DiskSpaceManager(const std::string &from)
+
+  void DiskSpaceManager::checkClasses() const
+  {
+    assert(!m_classSizes.empty() && m_classSizes.size() <= s_maxClasses);
+    assert(unitSize() >= s_diskBlockSize && unitSize() % s_diskBlockSize == 0);
+    for (uint c = 1; c < nClasses(); c++) {
+      assert(m_classSizes[c] > m_classSizes[c - 1] && m_classSizes[c] % unitSize() == 0);
+    }
+  }
+
+  // the journal is applied to the checkpoint words before they are loaded,
+  // so the work is a few word operations per device plus one per record
+  DiskSpaceManager::DiskSpaceManager(const std::string &from, const std::string &journal) :
+    m_nextDevice(0),
+    m_journalFd(-1),
+    m_journalRecords(0),
+    m_checkpointRecords(0),
+    m_journalBytes(0),
+    m_journalStale(false)
   {
-    
     const char * data = from.data();
     m_curSize  = *(size_t *)data;
     data += sizeof(size_t);
-    DiskPartitionId nDisksLocations = m_curSize/s_partitionSizeBytes;
-    m_allLocations.resize(nDisksLocations);    
-    for (uint i = 0; i < nDisksLocations; i++) {
-      m_allLocations[i].id = i;
-      m_allLocations[i].status = (DiskPartition::LocationStat) *data;
-      data++;
-      if (m_allLocations[i].status == DiskPartition::freeSpace) 
-	m_freeList.push_back(i);
+    m_nDevices = *(uint32_t *)data;
+    data += sizeof(uint32_t);
+    m_classSizes.resize(*(uint32_t *)data);
+    data += sizeof(uint32_t);
+    m_generation = *(uint64_t *)data;
+    data += sizeof(uint64_t);
+    for (auto &size : m_classSizes) {
+      size = *(uint64_t *)data;
+      data += sizeof(uint64_t);
     }
+    checkClasses();
+    m_devices.reset(new PartitionBitmap[m_nDevices]);
+    resize(m_curSize/unitSize());
+
+    std::vector< std::vector<uint64_t> > allocated(m_nDevices);
+    for (uint d = 0; d < m_nDevices; d++) {
+      allocated[d].resize(m_devices[d].nWords());
+      memcpy(allocated[d].data(), data, allocated[d].size() * sizeof(uint64_t));
+      data += allocated[d].size() * sizeof(uint64_t);
+    }
+    assert(data <= from.data() + from.size());
+
+    if (journal.size() >= sizeof(uint64_t) &&
+	*(const uint64_t *)journal.data() == m_generation) {
+      // a torn record at the end is dropped
+      const uint32_t *record = (const uint32_t *)(journal.data() + sizeof(uint64_t));
+      size_t nRecords = (journal.size() - sizeof(uint64_t)) / sizeof(uint32_t);
+      for (size_t i = 0; i < nRecords; i++) {
+	uint32_t op = record[i] >> s_journalOpShift;
+	DiskPartitionId id = record[i] & ((1u << s_journalOpShift) - 1);
+	if (op != journalAllocated && op != journalFreed)
+	  break; // unwritten tail
+	assert(unit(id) < m_curSize / unitSize() && partitionClass(id) < nClasses());
+	auto &words = allocated[partitionDevice(id)];
+	for (size_t s = slot(id); s < slot(id) + units(id); s++) {
+	  if (op == journalAllocated)
+	    words[s / 64] |= 1ull << (s % 64);
+	  else
+	    words[s / 64] &= ~(1ull << (s % 64));
+	}
+      }
+    }
+    for (uint d = 0; d < m_nDevices; d++)
+      m_devices[d].loadAllocated(allocated[d].data());
+  }
+
+  void DiskSpaceManager::load(const std::string &from)
+  {
+    s_diskSpaceManager = new DiskSpaceManager(from);
+  }
+
+  static bool readFile(const std::string &path, std::string &to)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    off_t size = lseek(fd, 0, SEEK_END);
+    to.resize(size);
+    ssize_t ret = pread(fd, const_cast<char *>(to.data()), size, 0);
+    if (ret != size) {
+      printf("read of %s failed %d\n", path.c_str(), errno);
+      assert(0);
+    }
+    close(fd);
+    return true;
+  }
+
+  void DiskSpaceManager::recover(const std::string &checkpointPath,
+				 const std::string &journalPath,
+				 size_t diskSize, uint nDevices,
+				 const ClassSizes &classSizes)
+  {
+    std::string checkpointData;
+    std::string journalData;
+    if (readFile(checkpointPath, checkpointData)) {
+      readFile(journalPath, journalData);
+      s_diskSpaceManager = new DiskSpaceManager(checkpointData, journalData);
+      if (diskSize > s_diskSpaceManager->m_curSize)
+	s_diskSpaceManager->enlarge(diskSize);
+    } else {
+      s_diskSpaceManager = new DiskSpaceManager(diskSize, nDevices, classSizes);
+    }
+    s_diskSpaceManager->startJournal(checkpointPath, journalPath);
   }
   
   void DiskSpaceManager::enlarge(size_t newDiskSize)
   {
     assert(newDiskSize >= m_curSize);
     
-    uint start = m_curSize /s_partitionSizeBytes;
+    uint start = m_curSize / unitSize();
     m_curSize  = newDiskSize;    
-    DiskPartitionId nDisksLocations = m_curSize /s_partitionSizeBytes;
-    m_allLocations.resize(nDisksLocations);    
-    for (uint i = start; i < nDisksLocations; i++) {
-      m_allLocations[i].id = i;
-      m_freeList.push_back(i);
+    DiskPartitionId nUnits = m_curSize / unitSize();
+    resize(nUnits);
+    for (uint i = start; i < nUnits; i++) {
+      m_devices[partitionDevice(i)].setFree(i / nDevices());
+    }
+    if (m_journalFd >= 0) {
+      // journal records of the new partitions would not fit the checkpoint
+      checkpoint();
+    }
+  }
+
+  // the slots of every device for nUnits units, all not free
+  void DiskSpaceManager::resize(DiskPartitionId nUnits)
+  {
+    assert(nUnits <= s_unitMask + 1);
+    for (uint d = 0; d < m_nDevices; d++) {
+      m_devices[d].resize(nUnits > d ? (nUnits - d + m_nDevices - 1) / m_nDevices : 0);
     }
-    
-    
   }
+
   void DiskSpaceManager::save(std::string &to)
   {
-    to.resize(sizeof(size_t) + (m_allLocations.size()*sizeof(DiskPartitionId)));
+    std::lock_guard<std::mutex> lk(m_journalMutex);
+    saveLocked(to);
+  }
+
+  void DiskSpaceManager::saveLocked(std::string &to)
+  {
+    size_t nWords = 0;
+    for (uint d = 0; d < m_nDevices; d++)
+      nWords += m_devices[d].nWords();
+    to.resize(sizeof(size_t) + 2 * sizeof(uint32_t) + sizeof(uint64_t) +
+	      (nClasses() + nWords) * sizeof(uint64_t));
     char *data = const_cast<char *>(to.data());
     
-    *(DiskPartitionId *)data = m_curSize;
-    data += sizeof(DiskPartitionId);
+    *(size_t *)data = m_curSize;
+    data += sizeof(size_t);
+    *(uint32_t *)data = nDevices();
+    data += sizeof(uint32_t);
+    *(uint32_t *)data = nClasses();
+    data += sizeof(uint32_t);
+    *(uint64_t *)data = m_generation;
+    data += sizeof(uint64_t);
+    for (auto size : m_classSizes) {
+      *(uint64_t *)data = size;
+      data += sizeof(uint64_t);
+    }
+    for (uint d = 0; d < m_nDevices; d++) {
+      m_devices[d].saveAllocated((uint64_t *)data);
+      data += m_devices[d].nWords() * sizeof(uint64_t);
+    }
+  }
+
+  // 0 or -errno
+  static int writeAll(int fd, const void *data, size_t size, const std::string &path)
+  {
+    ssize_t ret = write(fd, data, size);
+    if (ret != (ssize_t)size) {
+      int err = ret < 0 ? -errno : -EIO;
+      printf("write of %s failed %d\n", path.c_str(), err);
+      return err;
+    }
+    return 0;
+  }
+
+  void DiskSpaceManager::startJournal(const std::string &checkpointPath,
+				      const std::string &journalPath,
+				      size_t checkpointRecords)
+  {
+    {
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      assert(m_journalFd < 0);
+      m_checkpointPath = checkpointPath;
+      m_journalPath = journalPath;
+      m_checkpointRecords = checkpointRecords;
+      m_journalFd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (m_journalFd < 0) {
+	printf("open of %s failed %d\n", journalPath.c_str(), errno);
+	assert(0);
+      }
+      // the replayed journal may end with a torn record, nothing is
+      // appended to it
+      m_journalStale = true;
+    }
+    // the replayed records are part of the state the checkpoint saves
+    checkpoint();
+    std::thread(&DiskSpaceManager::journalThread, this).detach();
+  }
+
+  // the records are synced as they come, so doneWithWrite and freeLocation
+  // (often on aio completion threads) never wait for the journal write.
+  // a failing disk is retried less and less often
+  void DiskSpaceManager::journalThread()
+  {
+    const uint64_t minRetryMs = 10;
+    const uint64_t maxRetryMs = 30 * 1000;
+    uint64_t retryMs = minRetryMs;
+    while (1) {
+      {
+	std::unique_lock<std::mutex> lk(m_journalMutex);
+	m_journalCond.wait(lk, [this] {return !m_journalBuffer.empty();});
+      }
+      if (syncJournal() == 0) {
+	retryMs = minRetryMs;
+      } else {
+	std::this_thread::sleep_for(std::chrono::milliseconds(retryMs));
+	retryMs = std::min(retryMs * 2, maxRetryMs);
+      }
+    }
+  }
+
+  // lock is held
+  void DiskSpaceManager::journal(DiskPartitionId id, JournalOp op)
+  {
+    if (m_journalFd < 0)
+      return;
+    assert(id < (1u << s_journalOpShift));
+    if (m_journalBuffer.empty())
+      m_journalCond.notify_one();
+    m_journalBuffer.push_back(((uint32_t)op << s_journalOpShift) | id);
+  }
+
+  // lock is held. records and freed were taken out and did not make it to
+  // the disk, they go back in front of those that came meanwhile
+  void DiskSpaceManager::rebuffer(std::vector<uint32_t> &records,
+				  std::vector<DiskPartitionId> &freed)
+  {
+    records.insert(records.end(), m_journalBuffer.begin(), m_journalBuffer.end());
+    m_journalBuffer.swap(records);
+    freed.insert(freed.end(), m_freedBuffered.begin(), m_freedBuffered.end());
+    m_freedBuffered.swap(freed);
+  }
+
+  // m_syncMutex is held. a failed append is cut off, so the journal always
+  // ends with a whole record
+  int DiskSpaceManager::appendJournal(const std::vector<uint32_t> &records)
+  {
+    const size_t size = records.size() * sizeof(uint32_t);
+    int ret = writeAll(m_journalFd, records.data(), size, m_journalPath);
+    if (ret == 0 && fdatasync(m_journalFd) != 0) {
+      ret = -errno;
+      printf("sync of %s failed %d\n", m_journalPath.c_str(), ret);
+    }
+    if (ret != 0) {
+      if (ftruncate(m_journalFd, m_journalBytes) != 0)
+	m_journalStale = true; // a checkpoint starts a new one
+      return ret;
+    }
+    m_journalBytes += size;
+    return 0;
+  }
+
+  // the records are written without m_journalMutex, the changes go on
+  int DiskSpaceManager::syncJournal()
+  {
+    std::lock_guard<std::mutex> sync(m_syncMutex);
+    if (m_journalStale)
+      return checkpointSynced();
+    std::vector<uint32_t> records;
+    std::vector<DiskPartitionId> freed;
+    {
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      if (m_journalFd < 0 || m_journalBuffer.empty())
+	return 0;
+      records.swap(m_journalBuffer);
+      freed.swap(m_freedBuffered);
+    }
+    int ret = appendJournal(records);
+    {
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      if (ret != 0) {
+	// the freed partitions are not reused before their record is synced
+	rebuffer(records, freed);
+	return ret;
+      }
+      for (auto id : freed)
+	release(id);
+      m_journalRecords += records.size();
+      if (m_journalRecords < m_checkpointRecords)
+	return 0;
+    }
+    // the records are synced, a failed checkpoint is retried later
+    checkpointSynced();
+    return 0;
+  }
+
+  int DiskSpaceManager::checkpoint()
+  {
+    std::lock_guard<std::mutex> sync(m_syncMutex);
+    return checkpointSynced();
+  }
+
+  // m_syncMutex is held. the state is saved under m_journalMutex with the
+  // buffered records, the files are written without it while the changes
+  // go on to the buffer of the next journal. the new checkpoint replaces
+  // the old one by rename, only then the journal is restarted. after a
+  // crash in between the journal has the previous generation and is
+  // ignored
+  int DiskSpaceManager::checkpointSynced()
+  {
+    std::string data;
+    std::vector<uint32_t> records;
+    std::vector<DiskPartitionId> freed;
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      if (m_journalFd < 0)
+	return 0;
+      generation = ++m_generation;
+      saveLocked(data);
+      records.swap(m_journalBuffer);
+      freed.swap(m_freedBuffered);
+    }
+    int ret = writeCheckpoint(data);
+    if (ret != 0) {
+      // the previous checkpoint and journal stay
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      m_generation--;
+      rebuffer(records, freed);
+      return ret;
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_journalMutex);
+      for (auto id : freed)
+	release(id);
+      m_journalRecords = 0;
+    }
+    return restartJournal(generation);
+  }
 
-    for (auto e : m_allLocations) {
-      *data = (char) e.status;
-      data++;                  
+  // 0 or -errno, the old checkpoint is kept on a failure
+  int DiskSpaceManager::writeCheckpoint(const std::string &data)
+  {
+    std::string tmpPath = m_checkpointPath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      int ret = -errno;
+      printf("open of %s failed %d\n", tmpPath.c_str(), ret);
+      return ret;
+    }
+    int ret = writeAll(fd, data.data(), data.size(), tmpPath);
+    if (ret == 0 && fsync(fd) != 0) {
+      ret = -errno;
+      printf("sync of %s failed %d\n", tmpPath.c_str(), ret);
+    }
+    close(fd);
+    if (ret == 0 && rename(tmpPath.c_str(), m_checkpointPath.c_str()) != 0) {
+      ret = -errno;
+      printf("rename of %s failed %d\n", tmpPath.c_str(), ret);
     }
+    if (ret != 0) {
+      unlink(tmpPath.c_str());
+      return ret;
+    }
+    std::string dir = m_checkpointPath;
+    int dirFd = open(dirname(const_cast<char *>(dir.c_str())), O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0) {
+      fsync(dirFd);
+      close(dirFd);
+    }
+    return 0;
   }
 
+  // m_syncMutex is held, the checkpoint of generation is written. until
+  // the journal has the generation, nothing is appended to it
+  int DiskSpaceManager::restartJournal(uint64_t generation)
+  {
+    int ret = 0;
+    if (ftruncate(m_journalFd, 0) != 0) {
+      ret = -errno;
+      printf("truncate of %s failed %d\n", m_journalPath.c_str(), ret);
+    }
+    if (ret == 0)
+      ret = writeAll(m_journalFd, &generation, sizeof(generation), m_journalPath);
+    if (ret == 0 && fdatasync(m_journalFd) != 0) {
+      ret = -errno;
+      printf("sync of %s failed %d\n", m_journalPath.c_str(), ret);
+    }
+    m_journalStale = ret != 0;
+    m_journalBytes = sizeof(generation);
+    return ret;
+  }
+
+  void DiskSpaceManager::doneWithWrite(DiskPartitionId locationId)
+  {
+    std::lock_guard<std::mutex> lk(m_journalMutex);
+    assert(status(locationId) == DiskPartition::inWrite);
+    m_devices[partitionDevice(locationId)].setAllocated(slot(locationId), units(locationId), true);
+    journal(locationId, journalAllocated);
+  }
+
+  // with a journal the partition is released only once its record is
+  // synced, a restart never finds it allocated to its old owner while a
+  // new one writes it. until then it looks in write
+  void DiskSpaceManager::freeLocation(DiskPartitionId locationId)
+  {
+    std::lock_guard<std::mutex> lk(m_journalMutex);
+    assert(status(locationId) == DiskPartition::allocated);
+    m_devices[partitionDevice(locationId)].setAllocated(slot(locationId), units(locationId), false);
+    journal(locationId, journalFreed);
+    if (m_journalFd >= 0)
+      m_freedBuffered.push_back(locationId);
+    else
+      release(locationId);
+  }
+
+  void DiskSpaceManager::writeAborted(DiskPartitionId locationId)
+  {
+    assert(status(locationId) == DiskPartition::inWrite);
+    release(locationId);
+  }
+
+  // the partition goes back to the free space, through the discard queue
+  // when there is one
+  void DiskSpaceManager::release(DiskPartitionId id)
+  {
+    if (DiscardQueue::s_discardQueue)
+      DiscardQueue::s_discardQueue->add(partitionDevice(id), slot(id), units(id));
+    else
+      m_devices[partitionDevice(id)].setFree(slot(id), units(id));
+  }
+
+  DiskPartitionId DiskSpaceManager::getFreePlace(uint preferredDevice, uint sizeClass)
+  {
+    uint n = nDevices();
+    uint device = preferredDevice == s_anyDevice ? m_nextDevice++ : preferredDevice;
+    for (int retry = 0; retry < 2; retry++) {
+      for (int c = sizeClass; c >= 0; c--) {
+	size_t count = classUnits(c);
+	for (uint i = 0; i < n; i++) {
+	  uint d = (device + i) % n;
+	  size_t slot;
+	  if (count == 1 ? m_devices[d].allocate(slot) :
+	      m_devices[d].allocateRun(count, slot, count)) {
+	    return makeId(c, slot, d);
+	  }
+	}
+      }
+      // the freed partitions may still wait for their discard. the caller
+      // may hold writer locks on a completion thread, they are taken back
+      // undiscarded rather than waiting for the device
+      auto discardQueue = DiscardQueue::s_discardQueue;
+      if (!discardQueue || discardQueue->reclaim() == 0)
+	break;
+    }
+    assert(0); // disk is full
+    return -1u;
+  }
+
+  bool DiskSpaceManager::getFreeExtent(size_t bytes, Locations &to, uint preferredDevice)
+  {
+    // the largest classes first, the rest rounded up to a unit
+    std::vector<uint> classes;
+    size_t count = 0;
+    for (size_t left = bytes; left > 0; ) {
+      uint c = classFor(left);
+      classes.push_back(c);
+      count += classUnits(c);
+      left -= std::min(left, classSize(c));
+    }
+    if (classes.empty())
+      return false;
+    uint n = nDevices();
+    uint device = preferredDevice == s_anyDevice ? m_nextDevice++ : preferredDevice;
+    for (uint i = 0; i < n; i++) {
+      uint d = (device + i) % n;
+      size_t first;
+      if (m_devices[d].allocateRun(count, first, classUnits(classes.front()))) {
+	for (auto c : classes) {
+	  to.push_back(makeId(c, first, d));
+	  first += classUnits(c);
+	}
+	return true;
+      }
+    }
+    return false;
+  }
+
+  FreeSpaceStats DiskSpaceManager::freeSpaceStats() const
+  {
+    FreeSpaceStats stats = {0, 0, 0, 0};
+    for (uint d = 0; d < m_nDevices; d++)
+      m_devices[d].addStats(stats);
+    return stats;
+  }
   
 }
 }
-
-  
@@ -5,13 +5,16 @@
 #include <assert.h>
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 namespace rocksxl
 {
 namespace disk
 {
   // management of allocation of chunks
-  static const size_t s_partitionSizeBytes = 1024 * 1024 * 8; // 8M partition Size
+  static const size_t s_partitionSizeBytes = 1024 * 1024 * 8; // 8M default partition Size
 #pragma pack(push,1)
   typedef uint32_t DiskPartitionId;
 
@@ -48,62 +51,258 @@ namespace disk
       pop_front();
       return ret;
     }
+
+    bool tryPopLocation(DiskPartitionId &location) {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (empty())
+	return false;
+      location = front();
+      pop_front();
+      return true;
+    }
     
     
     void  pushLocation(DiskPartitionId location) {
       std::lock_guard<std::mutex> lk(m_mutex);      
       push_front(location);
     }
-    size_t sizeInBytes() const {return size() * s_partitionSizeBytes;}
+    size_t sizeInBytes() const;
   private:
     std::mutex m_mutex;
   };
 
+  // counts are in units, the partitions of the smallest size class
+  struct FreeSpaceStats
+  {
+    size_t freePartitions;
+    size_t freeExtents;    // runs of free units that are adjacent on a device
+    size_t largestExtent;
+    size_t largestPerDevice; // sum of the largest extent of every device
+    // 0 when every device has one free extent, close to 1 when the free
+    // space is scattered
+    double fragmentation() const {
+      return freePartitions ? 1.0 - (double)largestPerDevice / freePartitions : 0;
+    }
+  };
+
+  // free slots of one device, bit i is set when slot i is free.
+  // a single slot is claimed lock free, starting from a cursor of the
+  // calling core, so cores do not contend on the same words and one core
+  // gets neighbouring slots. runs are searched first fit under a mutex and
+  // claimed word by word, a race with a single claim just moves the search on.
+  // a second bitmap marks the slots whose write is done (allocated), a slot
+  // that is neither free nor allocated is in write
+  class PartitionBitmap
+  {
+  public:
+    PartitionBitmap() : m_nWords(0), m_nSlots(0), m_nFree(0) {}
+    // new slots are not free. not concurrent with allocations
+    void   resize(size_t nSlots);
+    void   setFree(size_t first, size_t count = 1);
+    bool   allocate(size_t &slot);
+    // first is a multiple of align
+    bool   allocateRun(size_t count, size_t &first, size_t align = 1);
+    void   setAllocated(size_t first, size_t count, bool allocated);
+    bool   isFree(size_t slot) const {
+      return m_words[slot / 64].load(std::memory_order_relaxed) & (1ull << (slot % 64));
+    }
+    bool   isAllocated(size_t slot) const {
+      return m_allocated[slot / 64].load(std::memory_order_relaxed) & (1ull << (slot % 64));
+    }
+    size_t freeSlots() const {return m_nFree.load(std::memory_order_relaxed);}
+    void   addStats(FreeSpaceStats &stats) const;
+
+    // the allocated bitmap as nWords() words, slots in write are not saved
+    size_t nWords() const {return m_nWords;}
+    void   saveAllocated(uint64_t *to) const;
+    // every slot that is not allocated becomes free. not concurrent with
+    // allocations
+    void   loadAllocated(const uint64_t *from);
+  private:
+    static const uint s_nCursors = 64;
+    bool   claim(size_t first, size_t count);
+    void   release(size_t first, size_t count);
+  private:
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_allocated;
+    size_t                                   m_nWords;
+    size_t                                   m_nSlots;
+    std::atomic<size_t>                      m_nFree;
+    std::atomic<size_t>                      m_cursors[s_nCursors]; // word index per core
+    std::mutex                               m_runMutex;
+  };
+
+  // the space is cut in units, the size of the smallest partition size
+  // class, striped over the devices: unit i lives on device i % nDevices at
+  // slot i / nDevices. a partition of size class c takes classUnits(c)
+  // adjacent units starting at a slot aligned to that count, its id is the
+  // class in bits s_classShift and up and the first unit below. writers
+  // pick the class from the size they expect, so small files do not waste
+  // a large partition and large files need few Locations entries.
+  // the state is persisted as a checkpoint of the allocated bitmaps plus
+  // an append only journal of the partitions allocated (doneWithWrite) and
+  // freed since. a journal thread syncs the records as they come, and the
+  // journal is folded into a new checkpoint once it has checkpointRecords
+  // records. a freed partition is not reused before its record is synced.
+  // partitions in write are free after a restart
   class DiskSpaceManager
   {
   public:
-    static void init(size_t diskSize) {
-      s_diskSpaceManager = new DiskSpaceManager(diskSize);
+    static const uint s_anyDevice = -1u;
+    static const uint s_classShift = 28;
+    static const uint s_maxClasses = 4;  // the journal op takes the bits above
+    typedef std::vector<size_t> ClassSizes;
+    // diskSize - total size of all the devices
+    // classSizes - ascending partition sizes, all multiples of the first
+    // (the unit) which is a multiple of s_diskBlockSize
+    static void init(size_t diskSize, uint nDevices = 1,
+		     const ClassSizes &classSizes = ClassSizes(1, s_partitionSizeBytes)) {
+      s_diskSpaceManager = new DiskSpaceManager(diskSize, nDevices, classSizes);
     }    
     static void load(const std::string &from);
+    // load the checkpoint file, replay the journal file and keep
+    // journaling to it. a missing checkpoint starts an empty disk with
+    // classSizes, otherwise the classes of the checkpoint are kept
+    static void recover(const std::string &checkpointPath,
+			const std::string &journalPath,
+			size_t diskSize, uint nDevices = 1,
+			const ClassSizes &classSizes = ClassSizes(1, s_partitionSizeBytes));
     static DiskSpaceManager    *s_diskSpaceManager;
     
   public:
+    // with a journal, enlarge writes a checkpoint
     void enlarge(size_t newDiskSize);
     void save(std::string &to);
 
-    DiskPartitionId getFreePlace() {
-      auto ret = m_freeList.popLocation();
-      m_allLocations[ret].status = DiskPartition::inWrite;
+    // journal the changes to journalPath, checkpoints go to checkpointPath.
+    // the journal is restarted from a checkpoint of the current state
+    void startJournal(const std::string &checkpointPath,
+		      const std::string &journalPath,
+		      size_t checkpointRecords = 64 * 1024);
+    // the changes made so far are durable when this returns 0, otherwise
+    // -errno and the partitions freed since are not reused yet. blocks on
+    // the journal write, not for the aio completion threads
+    int  syncJournal();
+    // write a checkpoint and empty the journal, 0 or -errno
+    int  checkpoint();
+
+    uint   nDevices() const {return m_nDevices;}
+    uint   nClasses() const {return m_classSizes.size();}
+    size_t classSize(uint sizeClass) const {return m_classSizes[sizeClass];}
+    size_t classUnits(uint sizeClass) const {return m_classSizes[sizeClass] / unitSize();}
+    size_t unitSize() const {return m_classSizes[0];}
+    // the largest class not larger than bytes, 0 when none is
+    uint   classFor(size_t bytes) const {
+      uint ret = 0;
+      while (ret + 1 < nClasses() && m_classSizes[ret + 1] <= bytes)
+	ret++;
       return ret;
-    } 
-    void doneWithWrite(DiskPartitionId locationId) {
-      auto &diskLocation = m_allLocations[locationId];
-      assert(diskLocation.status == DiskPartition::inWrite);
-      diskLocation.status = DiskPartition::allocated;
     }
-    
-    void writeAborted(DiskPartitionId locationId) {
-      auto &diskLocation = m_allLocations[locationId];
-      assert(diskLocation.status == DiskPartition::inWrite);
-      diskLocation.status = DiskPartition::freeSpace;
-      m_freeList.pushLocation(locationId);
+
+    uint   partitionClass(DiskPartitionId id) const {return id >> s_classShift;}
+    size_t partitionSize(DiskPartitionId id) const {return classSize(partitionClass(id));}
+    size_t partitionBlocks(DiskPartitionId id) const;
+    uint   partitionDevice(DiskPartitionId id) const {return unit(id) % nDevices();}
+    // offset of the partition in its device
+    size_t partitionOffset(DiskPartitionId id) const {
+      return slot(id) * unitSize();
+    }
+    // second starts where first ends on the same device
+    bool   adjacent(DiskPartitionId first, DiskPartitionId second) const {
+      return partitionDevice(first) == partitionDevice(second) &&
+	slot(second) == slot(first) + classUnits(partitionClass(first));
     }
-    void freeLocation(DiskPartitionId locationId) {
-      auto &diskLocation = m_allLocations[locationId];
-      assert(diskLocation.status == DiskPartition::allocated);      
-      diskLocation.status = DiskPartition::freeSpace;
-      m_freeList.pushLocation(locationId);
+    DiskPartition::LocationStat status(DiskPartitionId id) const {
+      auto const &device = m_devices[partitionDevice(id)];
+      return device.isFree(slot(id)) ? DiskPartition::freeSpace :
+	device.isAllocated(slot(id)) ? DiskPartition::allocated : DiskPartition::inWrite;
     }
-    size_t freeSpaceSize() const {return m_freeList.sizeInBytes();}
+
+    // a partition of sizeClass on preferredDevice when it has room,
+    // otherwise on the next device that has. when no device has room for
+    // the class a smaller class is taken
+    DiskPartitionId getFreePlace(uint preferredDevice = s_anyDevice,
+				 uint sizeClass = 0);
+    // adjacent partitions of one device for bytes, the largest classes
+    // first, appended to to in disk order. the waste is less than a unit.
+    // false when no device has such a run
+    bool getFreeExtent(size_t bytes, Locations &to,
+		       uint preferredDevice = s_anyDevice);
+    void doneWithWrite(DiskPartitionId locationId);
+    void writeAborted(DiskPartitionId locationId);
+    // with a journal the partition is free only once its record is synced,
+    // with a DiscardQueue only once it is discarded too. until then it
+    // looks in write
+    void freeLocation(DiskPartitionId locationId);
+    // called by the DiscardQueue, the slots are free again
+    void discardDone(uint device, size_t firstSlot, size_t nSlots) {
+      m_devices[device].setFree(firstSlot, nSlots);
+    }
+    size_t freeSpaceSize() const {
+      size_t ret = 0;
+      for (uint d = 0; d < m_nDevices; d++)
+	ret += m_devices[d].freeSlots();
+      return ret * unitSize();
+    }
+    FreeSpaceStats freeSpaceStats() const;
   private:
-    DiskSpaceManager(size_t diskSize);    
-    DiskSpaceManager(const std::string &from);
+    enum JournalOp : uint32_t {journalAllocated = 1, journalFreed = 2};
+    // a record is the op in the 2 high bits and the partition id
+    static const uint s_journalOpShift = 30;
+
+    DiskSpaceManager(size_t diskSize, uint nDevices, const ClassSizes &classSizes);
+    DiskSpaceManager(const std::string &from, const std::string &journal = std::string());
+    static const DiskPartitionId s_unitMask = (1u << s_classShift) - 1;
+    static DiskPartitionId unit(DiskPartitionId id) {return id & s_unitMask;}
+    size_t slot(DiskPartitionId id) const {return unit(id) / nDevices();}
+    size_t units(DiskPartitionId id) const {return classUnits(partitionClass(id));}
+    DiskPartitionId makeId(uint sizeClass, size_t slot, uint device) const {
+      return ((DiskPartitionId)sizeClass << s_classShift) | (slot * nDevices() + device);
+    }
+    void   checkClasses() const;
+    void   resize(DiskPartitionId nUnits);
+    void   saveLocked(std::string &to);
+    int    checkpointSynced();
+    int    writeCheckpoint(const std::string &data);
+    int    restartJournal(uint64_t generation);
+    int    appendJournal(const std::vector<uint32_t> &records);
+    void   rebuffer(std::vector<uint32_t> &records, std::vector<DiskPartitionId> &freed);
+    void   journal(DiskPartitionId id, JournalOp op);
+    void   journalThread();
+    void   release(DiskPartitionId id);
     
   private:
-    size_t                    m_curSize;
-    Locations                 m_freeList;
-    std::vector<DiskPartition> m_allLocations; 
+    size_t                              m_curSize;
+    uint                                m_nDevices;
+    ClassSizes                          m_classSizes;
+    std::unique_ptr<PartitionBitmap[]>  m_devices;
+    std::atomic<uint>                   m_nextDevice;
+    // journal state, changes of the allocated bitmaps are made under m_journalMutex
+    // so the journal order is the order of the changes. m_syncMutex, taken
+    // first, orders the journal writes and checkpoints, the files are
+    // written without m_journalMutex
+    std::mutex                          m_syncMutex;
+    std::mutex                          m_journalMutex;
+    std::condition_variable             m_journalCond;
+    int                                 m_journalFd;
+    std::string                         m_journalPath;
+    std::string                         m_checkpointPath;
+    std::vector<uint32_t>               m_journalBuffer; // not written yet
+    std::vector<DiskPartitionId>        m_freedBuffered; // released once their record is synced
+    size_t                              m_journalRecords;
+    size_t                              m_checkpointRecords;
+    uint64_t                            m_generation; // of the checkpoint and its journal
+    // the rest is under m_syncMutex
+    size_t                              m_journalBytes; // of whole synced records and the header
+    bool                                m_journalStale; // not restarted for the last checkpoint
   };
+
+  inline size_t Locations::sizeInBytes() const
+  {
+    size_t ret = 0;
+    for (auto location : *this)
+      ret += DiskSpaceManager::s_diskSpaceManager->partitionSize(location);
+    return ret;
+  }
 }
 }
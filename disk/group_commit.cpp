@@ -0,0 +1,74 @@
+#include "group_commit.hpp"
+#include "disk_space.hpp"
+#include "../aio_interface/libaio_int.hpp"
+
+namespace rocksxl
+{
+namespace disk
+{
+  GroupCommit *GroupCommit::s_groupCommit;
+
+  void GroupCommit::sync(SyncSignal *signal)
+  {
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_next.push_back(signal);
+      if (m_pendingDevices != 0 || !startRound())
+	return;
+    }
+    submitRound();
+  }
+
+  // lock is held. moves the next waiters to the in flight round
+  bool GroupCommit::startRound()
+  {
+    if (m_next.empty())
+      return false;
+    m_inFlight.swap(m_next);
+    m_rounds++;
+    m_pendingDevices = DiskSpaceManager::s_diskSpaceManager->nDevices();
+    return true;
+  }
+
+  // called without the lock, a sync may complete inline
+  void GroupCommit::submitRound()
+  {
+    uint nDevices = DiskSpaceManager::s_diskSpaceManager->nDevices();
+    aio_interface::AioBatch batch;
+    for (uint device = 0; device < nDevices; device++) {
+      auto aioData = new aio_interface::AioData(0, 0, 0, this, syncDone);
+      aioData->ioClass = aio_interface::ioFlush;
+      aioData->device = device;
+      batch.sync(aioData);
+    }
+    batch.submit();
+  }
+
+  void GroupCommit::syncDone(aio_interface::AioData *aioData)
+  {
+    auto me = (GroupCommit *) aioData->userCntxt;
+    const int status = aioData->status;
+    delete aioData;
+    std::vector<SyncSignal *> done;
+    bool nextRound;
+    int roundStatus;
+    {
+      std::lock_guard<std::mutex> lk(me->m_mutex);
+      if (status != 0 && me->m_status == 0)
+	me->m_status = status;
+      if (--me->m_pendingDevices > 0)
+	return;
+      done.swap(me->m_inFlight);
+      roundStatus = me->m_status;
+      me->m_status = 0;
+      nextRound = me->startRound();
+    }
+    if (nextRound) {
+      me->submitRound();
+    }
+    for (auto signal : done) {
+      signal->syncDone(roundStatus);
+    }
+  }
+}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <vector>
+#include <mutex>
+
+namespace rocksxl
+{
+  namespace  aio_interface
+  {
+    struct AioData;
+  }
+
+namespace disk
+{
+  class SyncSignal
+  {
+  public:
+    virtual ~SyncSignal() {};
+    // status - 0, or -errno of a failed sync of the round, the writes
+    // may then not be durable
+    virtual void syncDone(int status) = 0;
+  };
+
+  // durability barrier shared by all the writers (group commit).
+  // sync requests that arrive while a sync round is in flight are batched
+  // into the next round, so any number of writers costs one fdatasync per
+  // device per round
+  class GroupCommit
+  {
+  public:
+    static GroupCommit *s_groupCommit;
+    static void init() {
+      s_groupCommit = new GroupCommit;
+    }
+  public:
+    // signal->syncDone() is called once all the writes completed before
+    // this call are durable, or a sync of the round failed
+    void sync(SyncSignal *signal);
+    size_t rounds() const {return m_rounds;}
+  private:
+    GroupCommit() : m_pendingDevices(0), m_status(0), m_rounds(0) {}
+    bool startRound();
+    void submitRound();
+    static void syncDone(aio_interface::AioData *);
+  private:
+    std::mutex                 m_mutex;
+    std::vector<SyncSignal *>  m_inFlight;  // waiting for the current round
+    std::vector<SyncSignal *>  m_next;      // waiting for the next round
+    size_t                     m_pendingDevices;
+    int                        m_status;    // first error of the current round
+    size_t                     m_rounds;
+  };
+}
+}
@@ -0,0 +1,216 @@
+#include "pending_writes.hpp"
+#include <string.h>
+#include <algorithm>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // the appends of one device write and the pages they are packed into
+  struct PendingWrites::WriteData
+  {
+    PendingWrites            *pendingWrites;
+    std::vector<Append>       appends;
+    size_t                    startAddress; // of the first append, a page start
+    std::vector<DiskBlockPtr> pages;
+  };
+
+  PendingWrites::PendingWrites(uint device, size_t offset, size_t size,
+			       aio_interface::IoClass ioClass) :
+    m_device(device),
+    m_offset(offset),
+    m_capacity(size / s_diskBlockSize *
+	       (DiskBlock::s_checksums ? s_blockDataSize : s_diskBlockSize)),
+    m_pageData(DiskBlock::s_checksums ? s_blockDataSize : s_diskBlockSize),
+    m_ioClass(ioClass),
+    m_sentSize(0),
+    m_totalSize(0),
+    m_queueLength(0),
+    m_writes(0),
+    m_sealed(false),
+    m_status(0)
+  {
+    assert(offset % s_diskBlockSize == 0 && size % s_diskBlockSize == 0);
+  }
+
+  PendingWrites::~PendingWrites()
+  {
+    assert(idle());
+  }
+
+  bool PendingWrites::append(const struct iovec *iov, int iovcnt, cb done, void *userCntxt)
+  {
+    assert(iovcnt > 0 && iovcnt <= s_maxPieces);
+    Append a;
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      a.pieces[i] = iov[i];
+      size += iov[i].iov_len;
+    }
+    a.nPieces = iovcnt;
+    a.done = done;
+    a.userCntxt = userCntxt;
+    if (size > maxAppend())
+      return false;
+    std::unique_lock<std::mutex> lk(m_mutex);
+    assert(!m_sealed);
+    if (m_totalSize + size > m_capacity)
+      return false;
+    if (m_status != 0) {
+      int status = m_status;
+      lk.unlock();
+      done(userCntxt, status);
+      return true;
+    }
+    m_pendingWrites.push_back(a);
+    m_totalSize += size;
+    WriteData *writeData = m_queueLength == 0 ? takePending() : 0;
+    lk.unlock();
+    if (writeData)
+      send(writeData);
+    return true;
+  }
+
+  size_t PendingWrites::room() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_capacity - m_totalSize;
+  }
+
+  void PendingWrites::seal()
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_sealed = true;
+  }
+
+  bool PendingWrites::idle() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_pendingWrites.empty() && m_queueLength == 0;
+  }
+
+  void PendingWrites::wait()
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_idleCond.wait(lk, [this] {return m_pendingWrites.empty() && m_queueLength == 0;});
+  }
+
+  // lock is held. the pending appends that fit the pages of a request
+  // become the next write, the pages are filled by send without the lock.
+  // the write is padded to a page end and the next one starts on a new
+  // page, so a page that holds acknowledged appends is never written again
+  // and a torn write can only lose the appends not yet acknowledged
+  PendingWrites::WriteData *PendingWrites::takePending()
+  {
+    if (m_pendingWrites.empty())
+      return 0;
+    auto writeData = new WriteData;
+    writeData->pendingWrites = this;
+    writeData->startAddress = m_sentSize;
+    const size_t maxEnd = m_sentSize + maxAppend();
+    size_t taken = 0;
+    for (; taken < m_pendingWrites.size(); taken++) {
+      auto const &a = m_pendingWrites[taken];
+      size_t size = 0;
+      for (int i = 0; i < a.nPieces; i++)
+	size += a.pieces[i].iov_len;
+      if (taken > 0 && m_sentSize + size > maxEnd)
+	break;
+      m_sentSize += size;
+    }
+    writeData->appends.assign(m_pendingWrites.begin(), m_pendingWrites.begin() + taken);
+    m_pendingWrites.erase(m_pendingWrites.begin(), m_pendingWrites.begin() + taken);
+    const size_t left = m_totalSize - m_sentSize;
+    m_sentSize = (m_sentSize + m_pageData - 1) / m_pageData * m_pageData;
+    m_totalSize = m_sentSize + left;
+    m_queueLength++;
+    m_writes++;
+    return writeData;
+  }
+
+  void PendingWrites::send(WriteData *writeData)
+  {
+    size_t address = writeData->startAddress;
+    const size_t firstPage = address / m_pageData;
+    assert(address % m_pageData == 0);
+    DiskBlockPtr page;
+    for (auto const &a : writeData->appends) {
+      for (int i = 0; i < a.nPieces; i++) {
+	const char *data = (const char *)a.pieces[i].iov_base;
+	const size_t size = a.pieces[i].iov_len;
+	size_t copied = 0;
+	while (copied < size) {
+	  const size_t pageOffset = address % m_pageData;
+	  if (pageOffset == 0) {
+	    page.reset(new DiskBlock);
+	    writeData->pages.push_back(page);
+	  }
+	  const size_t n = std::min(size - copied, m_pageData - pageOffset);
+	  memcpy(page->data + pageOffset, data + copied, n);
+	  copied += n;
+	  address += n;
+	}
+      }
+    }
+    // the rest of the last page is zero, the padding a reader skips
+    const size_t tail = address % m_pageData;
+    if (tail != 0)
+      memset(page->data + tail, 0, m_pageData - tail);
+    auto aioData = new aio_interface::AioData(m_offset + firstPage * s_diskBlockSize, 0,
+					      writeData->pages.size() * s_diskBlockSize,
+					      writeData, writeDone);
+    aioData->device = m_device;
+    aioData->ioClass = m_ioClass;
+    if (writeData->pages.size() == 1) {
+      aioData->data = writeData->pages[0].get();
+    } else {
+      aioData->setIovCount(writeData->pages.size());
+    }
+    for (size_t i = 0; i < writeData->pages.size(); i++) {
+      auto &p = writeData->pages[i];
+      if (DiskBlock::s_checksums)
+	p->setChecksum();
+      if (aioData->iovcnt) {
+	aioData->iov[i].iov_base = p->data;
+	aioData->iov[i].iov_len  = s_diskBlockSize;
+      }
+    }
+    aio_interface::Write(aioData);
+  }
+
+  void PendingWrites::ioRequestDone(int status)
+  {
+    std::vector<Append> failed;
+    WriteData *next = 0;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_queueLength--;
+      if (status != 0) {
+	if (m_status == 0)
+	  m_status = status;
+	failed.swap(m_pendingWrites);
+      } else {
+	next = takePending();
+      }
+      if (!next)
+	m_idleCond.notify_all();
+    }
+    if (next)
+      send(next);
+    for (auto const &a : failed)
+      a.done(a.userCntxt, status);
+  }
+
+  void PendingWrites::writeDone(aio_interface::AioData *aioData)
+  {
+    auto writeData = (WriteData *)aioData->userCntxt;
+    const int status = aioData->status;
+    delete aioData;
+    writeData->pendingWrites->ioRequestDone(status);
+    // pendingWrites may be idle and deleted from here on
+    for (auto const &a : writeData->appends)
+      a.done(a.userCntxt, status);
+    delete writeData;
+  }
+}
+}
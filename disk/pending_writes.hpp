@@ -0,0 +1,89 @@
+#pragma once
+#include "disk_io_manager.hpp"
+#include "../aio_interface/libaio_int.hpp"
+#include <sys/uio.h>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // appender of many threads to a region of a device, e.g. a log.
+  // appends are packed into shared pages (blocks of the pool, refcounted)
+  // and a single writev is in flight at a time: the appends that arrive
+  // meanwhile are sent together once it completes, so small appends go
+  // out at close to sequential bandwidth. each write is padded with zeros
+  // to a page end, a page is never rewritten once its appends are
+  // acknowledged.
+  // with DiskBlock::s_checksums a page holds s_blockDataSize bytes and its
+  // checksum, so the region reads back like any other blocks
+  class PendingWrites
+  {
+  public:
+    // status - 0, or -errno of the failed write
+    typedef void (*cb)(void *userCntxt, int status);
+    // the region is [offset, offset + size) of device, offset and size are
+    // multiples of s_diskBlockSize
+    PendingWrites(uint device, size_t offset, size_t size,
+		  aio_interface::IoClass ioClass = aio_interface::ioForeground);
+    // nothing may be pending or in flight
+    ~PendingWrites();
+    static const int s_maxPieces = 4;
+    // false when the region has no room for the iovcnt pieces of iov, one
+    // after the other (in the same write, they may span pages), or they
+    // are larger than maxAppend. otherwise done is called once they are written, the
+    // data must be kept until then. appends are written in the order of
+    // the calls. once a write failed every append fails with its status
+    bool   append(const struct iovec *iov, int iovcnt, cb done, void *userCntxt);
+    bool   append(const void *data, size_t size, cb done, void *userCntxt) {
+      struct iovec iov = {const_cast<void *>(data), size};
+      return append(&iov, 1, done, userCntxt);
+    }
+    // the most a single append takes, the pages of a write
+    static size_t maxAppend() {
+      return aio_interface::s_maxIov * (DiskBlock::s_checksums ? s_blockDataSize : s_diskBlockSize);
+    }
+    // bytes that can still be appended, the padding of the pending
+    // appends is not counted yet
+    size_t room() const;
+    // no more appends
+    void   seal();
+    // nothing waiting or in flight
+    bool   idle() const;
+    // returns once idle
+    void   wait();
+    // device writes so far
+    size_t writes() const {return m_writes;}
+  private:
+    struct Append
+    {
+      struct iovec pieces[s_maxPieces];
+      int          nPieces;
+      cb           done;
+      void        *userCntxt;
+    };
+    struct WriteData;
+    WriteData *takePending();
+    void       send(WriteData *writeData);
+    void       ioRequestDone(int status);
+    static void writeDone(aio_interface::AioData *);
+  private:
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_idleCond;
+    const uint              m_device;
+    const size_t            m_offset;
+    const size_t            m_capacity;     // bytes of data the region holds
+    const size_t            m_pageData;     // bytes of data in a page
+    const aio_interface::IoClass m_ioClass;
+    std::vector<Append>     m_pendingWrites;
+    size_t                  m_sentSize;     // where the pending writes start, a page start
+    size_t                  m_totalSize;    // m_sentSize and the pending appends
+    size_t                  m_queueLength;  // writes in flight, 0 or 1
+    size_t                  m_writes;
+    bool                    m_sealed;
+    int                     m_status;
+  };
+}
+}
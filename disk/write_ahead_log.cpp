@@ -0,0 +1,215 @@
+#include "write_ahead_log.hpp"
+#include "crc32c.hpp"
+#include <string.h>
+#include <errno.h>
+#include <string>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // an append waiting for its record to be durable
+  struct WriteAheadLog::Waiter : public SyncSignal
+  {
+    Waiter() : status(0), done(false) {}
+    void syncDone(int status_) {finish(status_);}
+    void finish(int status_) {
+      std::lock_guard<std::mutex> lk(mutex);
+      status = status_;
+      done = true;
+      cond.notify_one();
+    }
+    void wait() {
+      std::unique_lock<std::mutex> lk(mutex);
+      cond.wait(lk, [this] {return done;});
+    }
+    RecordHeader            header;
+    int                     status;
+    bool                    done;
+    std::mutex              mutex;
+    std::condition_variable cond;
+  };
+
+  WriteAheadLog::WriteAheadLog(uint64_t firstLsn, uint sizeClass) :
+    m_sizeClass(sizeClass),
+    m_firstLsn(firstLsn),
+    m_nextLsn(firstLsn),
+    m_sealedWrites(0)
+  {
+    assert(firstLsn > 0);
+  }
+
+  WriteAheadLog::~WriteAheadLog()
+  {
+    // the partitions stay, they are the log
+    if (m_writes) {
+      m_writes->seal();
+      m_writes->wait();
+    }
+  }
+
+  uint32_t WriteAheadLog::recordCrc(const RecordHeader &header, uint32_t dataCrc)
+  {
+    return crc32c(&header.size, sizeof(header) - sizeof(header.crc), dataCrc);
+  }
+
+  // lock is held
+  bool WriteAheadLog::newPartition()
+  {
+    if (m_writes) {
+      m_writes->seal();
+      m_writes->wait();
+      m_sealedWrites += m_writes->writes();
+      m_writes.reset();
+    }
+    auto spaceManager = DiskSpaceManager::s_diskSpaceManager;
+    DiskPartitionId id = spaceManager->getFreePlace(DiskSpaceManager::s_anyDevice, m_sizeClass);
+    if (id == -1u)
+      return false;
+    // allocated now, so it survives a restart while the log is written
+    spaceManager->doneWithWrite(id);
+    m_partitions.push_back(LogPartition{id, 0});
+    m_writes.reset(new PendingWrites(spaceManager->partitionDevice(id),
+				     spaceManager->partitionOffset(id),
+				     spaceManager->partitionSize(id)));
+    return true;
+  }
+
+  void WriteAheadLog::appendDone(void *userCntxt, int status)
+  {
+    auto waiter = (Waiter *)userCntxt;
+    if (status == 0 && GroupCommit::s_groupCommit) {
+      GroupCommit::s_groupCommit->sync(waiter);
+      return;
+    }
+    waiter->finish(status);
+  }
+
+  int WriteAheadLog::append(const void *data, size_t size, uint64_t *lsn)
+  {
+    if (size == 0)
+      return -EINVAL; // a record of no data is padding to replay
+    if (sizeof(RecordHeader) + size > PendingWrites::maxAppend())
+      return -EMSGSIZE; // larger than a write
+    Waiter waiter;
+    const uint32_t dataCrc = crc32c(data, size);
+    struct iovec iov[2] = {{&waiter.header, sizeof(RecordHeader)},
+			   {const_cast<void *>(data), size}};
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (!m_writes || m_writes->room() < sizeof(RecordHeader) + size) {
+	if (!newPartition())
+	  return -ENOSPC;
+	if (m_writes->room() < sizeof(RecordHeader) + size)
+	  return -EMSGSIZE; // larger than a partition
+      }
+      waiter.header.size = size;
+      waiter.header.lsn = m_nextLsn++;
+      waiter.header.crc = recordCrc(waiter.header, dataCrc);
+      m_partitions.back().lastLsn = waiter.header.lsn;
+      bool appended = m_writes->append(iov, 2, appendDone, &waiter);
+      assert(appended);
+      (void)appended;
+    }
+    waiter.wait();
+    if (lsn)
+      *lsn = waiter.header.lsn;
+    return waiter.status;
+  }
+
+  Locations WriteAheadLog::partitions() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    Locations ret;
+    for (auto const &p : m_partitions)
+      ret.push_back(p.id);
+    return ret;
+  }
+
+  void WriteAheadLog::truncate(uint64_t lsn)
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    // the last partition is kept, the log goes on there
+    while (m_partitions.size() > 1 && m_partitions.front().lastLsn <= lsn) {
+      DiskSpaceManager::s_diskSpaceManager->freeLocation(m_partitions.front().id);
+      m_partitions.pop_front();
+    }
+  }
+
+  uint64_t WriteAheadLog::nextLsn() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_nextLsn;
+  }
+
+  size_t WriteAheadLog::writes() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_sealedWrites + (m_writes ? m_writes->writes() : 0);
+  }
+
+  size_t WriteAheadLog::records() const
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_nextLsn - m_firstLsn;
+  }
+
+  uint64_t WriteAheadLog::replay(const Locations &locations, const RecordFunc &record)
+  {
+    const size_t pageData = DiskBlock::s_checksums ? s_blockDataSize : s_diskBlockSize;
+    uint64_t nextLsn = 0; // any, until the first record
+    for (auto id : locations) {
+      // the partition data up to the first block that does not read
+      Locations partition;
+      partition.push_back(id);
+      auto fetcher = new DiskFetcher(partition);
+      std::string data;
+      size_t blocks = 0;
+      while (DiskBlockPtr block = fetcher->getBlock()) {
+	data.append(block->data, pageData);
+	blocks++;
+      }
+      fetcher->terminate();
+      // a failed read fails the whole request, and past the end of the log
+      // the stale pages of a reused partition fail their checksums, so the
+      // last pages of the log may be in it. they are read one by one
+      const size_t partitionBlocks = DiskSpaceManager::s_diskSpaceManager->partitionBlocks(id);
+      for (; blocks < partitionBlocks; blocks++) {
+	DiskSyncRead read(id, blocks);
+	if (!read.getData())
+	  break;
+	data.append(read.getData()->data, pageData);
+      }
+      size_t pos = 0;
+      size_t nRecords = 0;
+      while (1) {
+	if (data.size() - pos >= sizeof(RecordHeader)) {
+	  RecordHeader header;
+	  memcpy(&header, data.data() + pos, sizeof(header));
+	  const char *recordData = data.data() + pos + sizeof(header);
+	  if (header.size != 0 && header.size <= data.size() - pos - sizeof(header) &&
+	      (nextLsn == 0 || header.lsn == nextLsn) &&
+	      recordCrc(header, crc32c(recordData, header.size)) == header.crc) {
+	    record(header.lsn, recordData, header.size);
+	    nextLsn = header.lsn + 1;
+	    pos += sizeof(header) + header.size;
+	    nRecords++;
+	    continue;
+	  }
+	}
+	// a write is padded with zeros to its page end and the next one
+	// starts on a new page, the log ends on a page that starts with no
+	// record that follows
+	const size_t pageEnd = (pos / pageData + 1) * pageData;
+	if (pos % pageData == 0 || pageEnd > data.size() ||
+	    data.find_first_not_of('\0', pos) < pageEnd)
+	  break;
+	pos = pageEnd;
+      }
+      if (nRecords == 0)
+	break; // every partition of the log has records
+    }
+    return nextLsn;
+  }
+}
+}
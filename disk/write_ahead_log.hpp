@@ -0,0 +1,82 @@
+#pragma once
+#include "pending_writes.hpp"
+#include <stdint.h>
+#include <functional>
+#include <deque>
+#include <memory>
+
+namespace rocksxl
+{
+namespace disk
+{
+  // write ahead log of small records on partitions of the disk space
+  // manager. the records of all the threads are packed into pages by
+  // PendingWrites, one write in flight per log, and acknowledged as a
+  // group when it completes (and is synced, with GroupCommit). a record
+  // never spans two partitions, a full partition is sealed and the log
+  // continues on a new one once the writes of the full one are done, so
+  // the log on disk has no holes.
+  // a record is a header (RecordHeader) and its data. every record has the
+  // next sequence number (lsn), replay stops at the first record that is
+  // not the one that follows, so stale data of a reused partition ends
+  // the log. the zero padding at the end of each write is skipped.
+  // the partitions are allocated (doneWithWrite) as the log takes them,
+  // the owner keeps partitions() with its state and syncs the space
+  // manager journal
+  class WriteAheadLog
+  {
+  public:
+    typedef std::function<void (uint64_t lsn, const char *data, size_t size)> RecordFunc;
+    // firstLsn - of the first record, one past the last replayed record
+    // when a log is recovered
+    WriteAheadLog(uint64_t firstLsn = 1, uint sizeClass = 0);
+    // no append may be in progress
+    ~WriteAheadLog();
+    // returns once the record is on the disk, 0 or -errno. size > 0.
+    // lsn - of the record, also when its write failed, left alone when the
+    // record got none (-ENOSPC, -EMSGSIZE)
+    int       append(const void *data, size_t size, uint64_t *lsn = 0);
+    // the partitions in log order
+    Locations partitions() const;
+    // the records up to lsn are not needed anymore (e.g. the memtable that
+    // has them is flushed), the partitions that hold only such records are
+    // freed
+    void      truncate(uint64_t lsn);
+    // of the next record appended
+    uint64_t  nextLsn() const;
+    // device writes and records so far, records per write is the grouping
+    size_t    writes() const;
+    size_t    records() const;
+
+    // call record for every record of the log in locations in order,
+    // returns the lsn after the last one, 0 when there are none
+    static uint64_t replay(const Locations &locations, const RecordFunc &record);
+  private:
+#pragma pack(push,1)
+    struct RecordHeader
+    {
+      uint32_t crc;   // CRC32C of the data, then size and lsn
+      uint32_t size;  // of the data, never 0
+      uint64_t lsn;
+    };
+#pragma pack(pop)
+    struct LogPartition
+    {
+      DiskPartitionId  id;
+      uint64_t         lastLsn; // of its last record
+    };
+    struct Waiter;
+    bool   newPartition();
+    static void appendDone(void *userCntxt, int status);
+    static uint32_t recordCrc(const RecordHeader &header, uint32_t dataCrc);
+  private:
+    mutable std::mutex              m_mutex;
+    const uint                      m_sizeClass;
+    const uint64_t                  m_firstLsn;
+    uint64_t                        m_nextLsn;
+    std::deque<LogPartition>        m_partitions;
+    std::unique_ptr<PendingWrites>  m_writes;       // of the last partition
+    size_t                          m_sealedWrites; // of the partitions before
+  };
+}
+}
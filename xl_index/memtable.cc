@@ -1,39 +1,74 @@
 #include "memtable.hpp"
+#include "../disk/write_ahead_log.hpp"
+#include <string.h>
+#include <vector>
+#include <algorithm>
 
 namespace rocksxl
 {
 
   std::atomic<size_t> ObjectEntry::s_sequenceId;
 
+  void ObjectEntry::save(char *to) const
+  {
+    *to++ = type;
+    const uint32_t keySize = key.size();
+    memcpy(to, &keySize, sizeof(keySize));
+    to += sizeof(keySize);
+    memcpy(to, key.data(), key.size());
+    memcpy(to + key.size(), value.data(), value.size());
+  }
+
+  ObjectEntry *ObjectEntry::load(const char *from, size_t size)
+  {
+    uint32_t keySize;
+    if (size < sizeof(uint8_t) + sizeof(keySize))
+      return 0;
+    const Type type = (Type)*from;
+    memcpy(&keySize, from + sizeof(uint8_t), sizeof(keySize));
+    const size_t headerSize = sizeof(uint8_t) + sizeof(keySize);
+    if (type < Put || type > Delete || keySize > size - headerSize)
+      return 0;
+    from += headerSize;
+    return new ObjectEntry(std::string(from, keySize), type,
+			   std::string(from + keySize, size - headerSize - keySize));
+  }
+
 namespace memtable {
-  HashTable::HashTable(size_t nEntries) : m_hashTable(nEntries), m_mutexes(1024)
+  HashTable::HashTable(size_t nEntries) :
+    m_hashTable(std::max<size_t>(nEntries, 1)),
+    m_mutexes(1024)
   {
   }
 
+  // a put that was logged first may get here later, it goes before the
+  // newer versions
   void HashTable::put(ObjectEntry *obj)
   {
-    size_t hashEntry = hash(obj->key) % nEntries;
-    auto &mutex = m_mutexes[hashEntry % m_mutexes.size()];
-    mutex->lock();
-    m_hashTable[hashEntry].push_back(obj);
-    mutex->unlock();
+    size_t hashEntry = bucket(obj->key);
+    std::lock_guard<std::mutex> lk(m_mutexes[hashEntry % m_mutexes.size()]);
+    auto &entries = m_hashTable[hashEntry];
+    auto where = entries.end();
+    while (where != entries.begin() && (*std::prev(where))->sequenceId > obj->sequenceId)
+      where--;
+    entries.insert(where, obj);
   }
 
-  void HashTable::get(std::string &key, std::list<ObjectEntry *> &entries) const
+  void HashTable::get(const std::string &key, std::list<ObjectEntry *> &entries) const
   {
-    size_t hashEntry = hash(obj->key) % nEntries;
-    auto mutex = const_cast <std::mutex *> (m_mutexes[hashEntry % m_mutexes.size()]);
-    mutex->lock();
-    for (auto const &e : m_hashTable[hashEntry]) {
-      if (e->key == key)
-	emtries.push_back(e);
+    size_t hashEntry = bucket(key);
+    std::lock_guard<std::mutex> lk(m_mutexes[hashEntry % m_mutexes.size()]);
+    auto const &bucketEntries = m_hashTable[hashEntry];
+    for (auto e = bucketEntries.rbegin(); e != bucketEntries.rend(); e++) {
+      if ((*e)->key == key)
+	entries.push_back(*e);
     }
-    mutex->unlock();
   }
 
   MemTable::MemTable(size_t requiredSize) :
     m_curSizeBytes(0),
     m_requiredSize(requiredSize),
+    m_puts(0),
     m_hashTable(requiredSize/1000),
     m_status(MemTable::RW)
   {
@@ -51,56 +86,85 @@ namespace memtable {
     return true;
   }
 
-  void MemTable::get(std::string &key, std::list<ObjectEntry *> &entries) const
+  void MemTable::get(const std::string &key, std::list<ObjectEntry *> &entries) const
   {
     m_hashTable.get(key, entries);
   }
 
   // MemTableList
-  MemTableList::MemTableList() :
-    m_currentMemTable(new MemTable)
-    
+  MemTableList::MemTableList(disk::WriteAheadLog *wal) :
+    m_currentMemTable(new MemTable),
+    m_wal(wal)
   {
   }
 
   // MemTableList
-  void MemTableList::get(std::string &key, std::list<ObjectEntry *> &entries) const
+  // a version put while the memtable was replaced may be in the new one
+  // while a newer one went to the old one, the versions of all the
+  // memtables are ordered by sequence
+  void MemTableList::get(const std::string &key, std::list<ObjectEntry *> &entries) const
   {
-    m_currentMemTable->get(key, entries);
-    for (auto const &t : entries) {
-      if (t->type != OnjectEntry::Update) {
-	return; // final version of object
+    std::list<ObjectEntry *> found;
+    {
+      std::shared_lock<std::shared_mutex> lk(m_pendingListUpdates);
+      m_currentMemTable.load()->get(key, found);
+      for (auto const &memTable: m_pendingFlushList) {
+	memTable->get(key, found);
       }
     }
-    m_pendingListUpdates.lock_shared();
-    
-    for (auto const &memTable: m_pendingFlushList) { 
-      memTable->get(key, entries);
-      for (auto const &t : entries) {
-	if (t->type != OnjectEntry::Update) {
-	  break; // final version of object
-	}
+    found.sort([] (const ObjectEntry *a, const ObjectEntry *b) {
+	return a->sequenceId > b->sequenceId;
+      });
+    for (auto t : found) {
+      entries.push_back(t);
+      if (t->type != ObjectEntry::Update) {
+	return; // final version of object
       }
     }
-
-    m_pendingListUpdates.unlock_shared();
   }
 
-  void MemTableList::put(ObjectEntry * &entry) 
+  void MemTableList::insert(ObjectEntry *entry)
   {
-    while (!m_currentMemTable->put(entry)) {
-      m_pendingListUpdates.lock(); //exclusive lock
+    while (!m_currentMemTable.load()->put(entry)) {
+      std::lock_guard<std::shared_mutex> lk(m_pendingListUpdates); //exclusive lock
       // check under the lock
-      if (m_currentMemTable->flushNeeded()) {
-	m_pendingListUpdates.push_back(m_currentMemTable);
-	m_currentMemTable->pendingForFlush();
+      MemTable *current = m_currentMemTable;
+      if (current->flushNeeded()) {
+	m_pendingFlushList.push_front(current);
+	current->pendingForFlush();
 	m_currentMemTable = new MemTable;
-      }      
-      m_pendingListUpdates.unlock(); //exclusive lock
+      }
+    }
+  }
+
+  // the entry is logged before it is visible, the puts of all the threads
+  // share the log writes. its sequence is its lsn, the order replay
+  // inserts in, so two puts of a key keep their versions after a restart
+  // whatever order they get here in
+  int MemTableList::put(ObjectEntry * &entry)
+  {
+    if (m_wal) {
+      std::vector<char> record(entry->saveSize());
+      entry->save(record.data());
+      uint64_t lsn = 0;
+      int status = m_wal->append(record.data(), record.size(), &lsn);
+      if (status != 0)
+	return status;
+      entry->sequenceId = lsn;
     }
+    insert(entry);
+    return 0;
   }
 
-  
+  uint64_t MemTableList::replay(const disk::Locations &log)
+  {
+    return disk::WriteAheadLog::replay(log, [this] (uint64_t lsn, const char *data, size_t size) {
+	ObjectEntry *entry = ObjectEntry::load(data, size);
+	if (!entry)
+	  return; // a record of another user of the log
+	entry->sequenceId = lsn;
+	insert(entry);
+      });
+  }
 }
 }
-
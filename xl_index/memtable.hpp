@@ -0,0 +1,107 @@
+#pragma once
+#include "../disk/disk_space.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+
+namespace rocksxl
+{
+namespace disk
+{
+  class WriteAheadLog;
+}
+
+  // a version of an object as the memtables keep it, and the record of
+  // the write ahead log
+  struct ObjectEntry
+  {
+    enum Type : uint8_t {Put = 1, Update, Delete};
+    ObjectEntry(const std::string &key_, Type type_, const std::string &value_) :
+      key(key_), value(value_), type(type_), sequenceId(++s_sequenceId) {}
+    // the record: type, key size, key and value
+    size_t saveSize() const {return sizeof(uint8_t) + sizeof(uint32_t) + key.size() + value.size();}
+    void   save(char *to) const;
+    // from what save wrote, 0 when it is not a record
+    static ObjectEntry *load(const char *from, size_t size);
+
+    std::string key;
+    std::string value;
+    Type        type;
+    // orders the versions of a key, the lsn of a logged entry
+    uint64_t    sequenceId;
+    static std::atomic<size_t> s_sequenceId;
+  };
+
+namespace memtable
+{
+  // the versions of a key are kept in a bucket in sequence order, whatever
+  // the order of the puts
+  class HashTable
+  {
+  public:
+    HashTable(size_t nEntries);
+    void put(ObjectEntry *obj);
+    // appended newest first
+    void get(const std::string &key, std::list<ObjectEntry *> &entries) const;
+  private:
+    size_t bucket(const std::string &key) const {
+      return std::hash<std::string>()(key) % m_hashTable.size();
+    }
+  private:
+    std::vector<std::list<ObjectEntry *> > m_hashTable;
+    mutable std::vector<std::mutex>        m_mutexes; // of the buckets, striped
+  };
+
+  class MemTable
+  {
+  public:
+    enum Status {RW, PendingFlush};
+    static const size_t s_defaultSize = 64 * 1024 * 1024;
+    MemTable(size_t requiredSize = s_defaultSize);
+    // false when the memtable is full, the entry is not inserted
+    bool put(ObjectEntry *obj);
+    void get(const std::string &key, std::list<ObjectEntry *> &entries) const;
+    bool flushNeeded() const {return m_curSizeBytes > m_requiredSize;}
+    void pendingForFlush() {m_status = PendingFlush;}
+  private:
+    std::atomic<size_t> m_curSizeBytes;
+    const size_t        m_requiredSize;
+    std::atomic<int>    m_puts; // in progress
+    HashTable           m_hashTable;
+    std::atomic<Status> m_status;
+  };
+
+  // the memtable that takes the puts and those waiting for their flush.
+  // with a write ahead log a put returns once its entry is logged and
+  // inserted, the entries are ordered by their lsn so replay rebuilds the
+  // same versions
+  class MemTableList
+  {
+  public:
+    // wal - 0 when the entries are not logged
+    MemTableList(disk::WriteAheadLog *wal = 0);
+    // the log of the next puts, when the list is rebuilt by replay first
+    void     setLog(disk::WriteAheadLog *wal) {m_wal = wal;}
+    // 0, or the error of the log write and the entry is not inserted
+    int      put(ObjectEntry * &entry);
+    // the versions of key newest first, up to and including the first one
+    // that is not an update
+    void     get(const std::string &key, std::list<ObjectEntry *> &entries) const;
+    // insert the entries of a log (its partitions in log order), before
+    // the first put. returns the lsn after the last record, the first lsn
+    // of the log that continues it, or 0 when it has none
+    uint64_t replay(const disk::Locations &log);
+  private:
+    void     insert(ObjectEntry *entry);
+  private:
+    std::atomic<MemTable *>        m_currentMemTable;
+    std::list<MemTable *>          m_pendingFlushList;
+    mutable std::shared_mutex      m_pendingListUpdates;
+    disk::WriteAheadLog           *m_wal;
+  };
+}
+}
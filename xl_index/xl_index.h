@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <stddef.h>
+
+// the index of a sorted file: the blocks of the file that may hold a key.
+// a lookup may return blocks that do not hold the key, never misses one
+// that does
+namespace xl_index
+{
+  typedef std::string UserKey;
+
+  struct ObjectLocationInfo
+  {
+    ObjectLocationInfo(size_t blockNum_ = 0, bool isUpdate_ = false,
+		       bool multiBlock_ = false) :
+      blockNum(blockNum_), isUpdate(isUpdate_), multiBlock(multiBlock_) {}
+    size_t blockNum;   // where the object starts
+    bool   isUpdate;   // applies to the older versions of the key
+    bool   multiBlock; // continues in the next blocks
+  };
+
+  class IndexInterface
+  {
+  public:
+    virtual ~IndexInterface() {}
+    // entries - ascending keys, the first one in block 0
+    static IndexInterface *build(const std::vector<std::pair<const UserKey *,
+				 ObjectLocationInfo> > &entries);
+    // from what save wrote
+    static IndexInterface *construct(const char *from);
+    virtual void get_posible_locations(const UserKey &key,
+				       std::vector<ObjectLocationInfo> &ret) const = 0;
+    // saveSize bytes
+    virtual void save(char *to) const = 0;
+    virtual int  saveSize() const = 0;
+  };
+}